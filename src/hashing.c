@@ -0,0 +1,144 @@
+// xxHash32, from the description at https://github.com/Cyan4973/xxHash
+// The input is processed in 16 byte stripes by four independent accumulators, which lets the
+// CPU work on all four at once. Words are always read as little-endian, so a given input
+// hashes the same on every platform - UChars are hashed as if they were UTF-16LE bytes.
+
+#include <string.h>
+#include <unicode/utypes.h>
+#include "hashing.h"
+
+#define PRIME32_1	0x9E3779B1U
+#define PRIME32_2	0x85EBCA77U
+#define PRIME32_3	0xC2B2AE3DU
+#define PRIME32_4	0x27D4EB2FU
+#define PRIME32_5	0x165667B1U
+
+#define rotl32(x,r)	(((x) << (r)) | ((x) >> (32 - (r))))
+
+static uint32_t read32(const unsigned char* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t round32(uint32_t acc, uint32_t input) {
+	acc += input * PRIME32_2;
+	acc = rotl32(acc, 13);
+	return acc * PRIME32_1;
+}
+
+void xxh32_reset(XXH32State* state, uint32_t seed) {
+	state->total_len = 0;
+	state->v[0] = seed + PRIME32_1 + PRIME32_2;
+	state->v[1] = seed + PRIME32_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME32_1;
+	state->memsize = 0;
+	state->large_len = 0;
+}
+
+void xxh32_update(XXH32State* state, const void* input, size_t len) {
+	const unsigned char* p = (const unsigned char*)input;
+	const unsigned char* limit = p + len;
+	uint32_t v1, v2, v3, v4;
+
+	state->total_len += (uint32_t)len;
+	state->large_len |= (len >= 16) || (state->total_len >= 16);
+
+	// Not enough for a whole stripe yet
+	if (state->memsize + len < 16) {
+		memcpy(state->mem + state->memsize, p, len);
+		state->memsize += (int)len;
+		return;
+	}
+
+	// Finish off the stripe left over from last time
+	if (state->memsize) {
+		memcpy(state->mem + state->memsize, p, 16 - state->memsize);
+		state->v[0] = round32(state->v[0], read32(state->mem));
+		state->v[1] = round32(state->v[1], read32(state->mem + 4));
+		state->v[2] = round32(state->v[2], read32(state->mem + 8));
+		state->v[3] = round32(state->v[3], read32(state->mem + 12));
+		p += 16 - state->memsize;
+		state->memsize = 0;
+	}
+
+	v1 = state->v[0];
+	v2 = state->v[1];
+	v3 = state->v[2];
+	v4 = state->v[3];
+	while (limit - p >= 16) {
+		v1 = round32(v1, read32(p));
+		v2 = round32(v2, read32(p + 4));
+		v3 = round32(v3, read32(p + 8));
+		v4 = round32(v4, read32(p + 12));
+		p += 16;
+	}
+	state->v[0] = v1;
+	state->v[1] = v2;
+	state->v[2] = v3;
+	state->v[3] = v4;
+
+	if (p < limit) {
+		memcpy(state->mem, p, limit - p);
+		state->memsize = (int)(limit - p);
+	}
+}
+
+#define XXH32_UCHAR_BLOCK	64
+
+void xxh32_updateuchars(XXH32State* state, const UChar* input, int32_t len) {
+#if U_IS_BIG_ENDIAN
+	unsigned char block[XXH32_UCHAR_BLOCK * 2];
+	int32_t i, n;
+	while (len > 0) {
+		n = len < XXH32_UCHAR_BLOCK ? len : XXH32_UCHAR_BLOCK;
+		for (i = 0; i < n; i++) {
+			block[i*2] = (unsigned char)(input[i] & 0xFF);
+			block[i*2+1] = (unsigned char)(input[i] >> 8);
+		}
+		xxh32_update(state, block, n * 2);
+		input += n;
+		len -= n;
+	}
+#else
+	xxh32_update(state, input, (size_t)len * sizeof(UChar));
+#endif
+}
+
+uint32_t xxh32_digest(const XXH32State* state) {
+	const unsigned char* p = state->mem;
+	const unsigned char* limit = p + state->memsize;
+	uint32_t h;
+
+	if (state->large_len) {
+		h = rotl32(state->v[0], 1) + rotl32(state->v[1], 7) + rotl32(state->v[2], 12) + rotl32(state->v[3], 18);
+	}
+	else {
+		h = state->v[2] + PRIME32_5; // v[2] is still the seed
+	}
+	h += state->total_len;
+
+	while (limit - p >= 4) {
+		h += read32(p) * PRIME32_3;
+		h = rotl32(h, 17) * PRIME32_4;
+		p += 4;
+	}
+	while (p < limit) {
+		h += (*p) * PRIME32_5;
+		h = rotl32(h, 11) * PRIME32_1;
+		p++;
+	}
+
+	h ^= h >> 15;
+	h *= PRIME32_2;
+	h ^= h >> 13;
+	h *= PRIME32_3;
+	h ^= h >> 16;
+	return h;
+}
+
+uint32_t xxh32_uchars(const UChar* input, int32_t len, uint32_t seed) {
+	XXH32State state;
+	xxh32_reset(&state, seed);
+	xxh32_updateuchars(&state, input, len);
+	return xxh32_digest(&state);
+}
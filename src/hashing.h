@@ -0,0 +1,17 @@
+
+// xxHash32, for hashing text by its full content. It is used by icu.ustring (for the pool and
+// icu.ustring.hash) and icu.utf8 (for icu.utf8.hash), and can be fed a piece at a time.
+
+typedef struct XXH32State {
+	uint32_t total_len;
+	uint32_t v[4];
+	unsigned char mem[16];
+	int memsize;
+	int large_len;
+} XXH32State;
+
+void xxh32_reset(XXH32State* state, uint32_t seed);
+void xxh32_update(XXH32State* state, const void* input, size_t len);
+void xxh32_updateuchars(XXH32State* state, const UChar* input, int32_t len);
+uint32_t xxh32_digest(const XXH32State* state);
+uint32_t xxh32_uchars(const UChar* input, int32_t len, uint32_t seed);
@@ -6,33 +6,70 @@
 #include <unicode/uversion.h>
 #include <unicode/ucnv.h>
 #include <unicode/uloc.h>
+#include "icu4lua.h"
+
+// icu.convert has this upvalue set
+#define ICU_UV_CONVERTERS	lua_upvalueindex(1)
+
+#define ICU_PIVOT_SIZE		1024
 
 static int icu_convert(lua_State *L) {
+	icu4lua_ConverterCache* converters = icu4lua_toconvertercache(L, ICU_UV_CONVERTERS);
 	UErrorCode status;
 	size_t text_length;
 	const char* text = luaL_checklstring(L,1,&text_length);
-	char* new_text;
-	int32_t new_text_length;
+	const char* text_limit = text + text_length;
 	const char* current_encoding = luaL_optstring(L,2,ucnv_getDefaultName());
 	const char* new_encoding = luaL_optstring(L,3,ucnv_getDefaultName());
+	UConverter* from_conv;
+	UConverter* to_conv;
+	UChar pivot[ICU_PIVOT_SIZE];
+	UChar* pivot_source = pivot;
+	UChar* pivot_target = pivot;
+	luaL_Buffer b;
+	char* temp_buffer;
+	char* target;
+	UBool reset = TRUE;
+	icu4lua_HeldConverters* held;
+
+	lua_settop(L,3);
+	// Both converters are held until the result is complete, as building it can raise an error
+	held = icu4lua_holdconverters(L, converters);
 	status = U_ZERO_ERROR;
-	new_text_length = ucnv_convert(new_encoding, current_encoding, NULL, 0, text, (int32_t)text_length, &status);
-	if (status != U_BUFFER_OVERFLOW_ERROR && U_FAILURE(status)) {
+	from_conv = held->conv[0] = icu4lua_openconverter(converters, current_encoding, &status);
+	if (U_FAILURE(status)) {
 		lua_pushnil(L);
 		lua_pushstring(L, u_errorName(status));
 		return 2;
 	}
-	new_text = malloc(new_text_length);
-	status = U_ZERO_ERROR;
-	ucnv_convert(new_encoding, current_encoding, new_text, (int32_t)new_text_length, text, (int32_t)text_length, &status);
+	to_conv = held->conv[1] = icu4lua_openconverter(converters, new_encoding, &status);
 	if (U_FAILURE(status)) {
-		free(new_text);
+		icu4lua_releaseconverters(held);
 		lua_pushnil(L);
 		lua_pushstring(L, u_errorName(status));
 		return 2;
 	}
-	lua_pushlstring(L, new_text, new_text_length);
-	free(new_text);
+	luaL_buffinit(L, &b);
+	for (;;) {
+		temp_buffer = luaL_prepbuffer(&b);
+		target = temp_buffer;
+		status = U_ZERO_ERROR;
+		ucnv_convertEx(to_conv, from_conv, &target, temp_buffer + LUAL_BUFFERSIZE, &text, text_limit,
+			pivot, &pivot_source, &pivot_target, pivot + ICU_PIVOT_SIZE, reset, TRUE, &status);
+		reset = FALSE;
+		luaL_addsize(&b, target - temp_buffer);
+		if (status != U_BUFFER_OVERFLOW_ERROR) {
+			break;
+		}
+	}
+	icu4lua_releaseconverters(held);
+	if (U_FAILURE(status)) {
+		luaL_pushresult(&b);
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+	luaL_pushresult(&b);
 	return 1;
 }
 
@@ -61,7 +98,24 @@ static const luaL_Reg icu_lib[] = {
 };
 
 int luaopen_icu(lua_State *L) {
-	luaL_register(L, "icu", icu_lib);
+	int IDX_CONVERTERS, IDX_ICU_LIB;
+	const luaL_Reg* lib_entry;
+	luaL_Reg null_entry = {NULL,NULL};
+
+	// The converter cache belongs to icu.ustring
+	icu4lua_requireustringlib(L);
+	icu4lua_pushconvertercache(L);
+	IDX_CONVERTERS = lua_gettop(L);
+
+	luaL_register(L, "icu", &null_entry);
+	IDX_ICU_LIB = lua_gettop(L);
+
+	for (lib_entry = icu_lib; lib_entry->func; lib_entry++) {
+		lua_pushstring(L, lib_entry->name);
+		lua_pushvalue(L, IDX_CONVERTERS);
+		lua_pushcclosure(L, lib_entry->func, 1);
+		lua_rawset(L, IDX_ICU_LIB);
+	}
 
 	lua_pushstring(L, U_ICU_VERSION);
 	lua_setfield(L,-2,"_VERSION");
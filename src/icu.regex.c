@@ -479,7 +479,7 @@ static int icu_regex_split(lua_State *L) {
 			break;
 		}
 		end = uregex_start(regex, 0, &status);
-		icu4lua_pushustring(L, ustring + start, end - start, REGEX_UV_USTRING_META, REGEX_UV_USTRING_POOL);
+		icu4lua_pushustringslice(L, 2, start, end - start, REGEX_UV_USTRING_META, REGEX_UV_USTRING_POOL);
 		lua_rawseti(L,-2,++count);
 		status = U_ZERO_ERROR;
 		start = uregex_end(regex, 0, &status);
@@ -495,7 +495,7 @@ static int icu_regex_split(lua_State *L) {
 		lua_rawseti(L,-2,1);
 		return 1;
 	}
-	icu4lua_pushustring(L, ustring + start, ustring_len - start, REGEX_UV_USTRING_META, REGEX_UV_USTRING_POOL);
+	icu4lua_pushustringslice(L, 2, start, ustring_len - start, REGEX_UV_USTRING_META, REGEX_UV_USTRING_POOL);
 	lua_rawseti(L,-2,++count);
 	return 1;
 }
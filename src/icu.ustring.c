@@ -1,20 +1,813 @@
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <unicode/ustring.h>
 #include <unicode/ucnv.h>
 #include <unicode/uchar.h>
 #include <unicode/ustdio.h>
+#include <unicode/ucasemap.h>
+#include <unicode/uloc.h>
+#include <unicode/unorm2.h>
+#include <unicode/ubrk.h>
 #include "icu4lua.h"
 #include "matchengine.h"
 #include "formatting.h"
+#include "hashing.h"
+#include "search.h"
 
 // All icu.ustring functions have these upvalues set
 #define USTRING_UV_META		lua_upvalueindex(1)
 #define USTRING_UV_POOL		lua_upvalueindex(2)
+#define USTRING_UV_BUILDER_META	lua_upvalueindex(3)
+#define USTRING_UV_STREAM_META	lua_upvalueindex(4)
+#define USTRING_UV_FORMAT_META	lua_upvalueindex(5)
+#define USTRING_UV_MULTISEARCH_META	lua_upvalueindex(6)
+#define USTRING_UV_PATTERN_META	lua_upvalueindex(7)
+
+// The converter cache. Opening a converter means looking up its name and taking ICU's global
+// lock, which costs more than converting a short string, so converters are kept around once
+// they are finished with. Each idle converter is keyed by its canonical name (ucnv_getName) and
+// requested names are mapped to the same form with ucnv_getAlias. When the cache is full, the
+// converter that has been idle the longest is closed.
+// Looking up an alias is a search of ICU's alias table, so the last few names asked for are kept
+// along with their canonical names, and whether they are UTF-8 (for the UTF-8 fast path).
+
+#define CONVERTER_CACHE_SIZE	16
+#define CONVERTER_NAME_CACHE_SIZE	8
+
+typedef struct ConverterCache {
+	icu4lua_ConverterCache api;
+	struct {
+		UConverter* conv;
+		const char* name;
+		uint32_t last_used;
+	} idle[CONVERTER_CACHE_SIZE];
+	struct {
+		char encoding[UCNV_MAX_CONVERTER_NAME_LENGTH]; // as requested
+		const char* name; // canonical, NULL if this entry is not in use
+		int is_utf8;
+	} names[CONVERTER_NAME_CACHE_SIZE];
+	int name_next; // the entry to replace next
+	int idle_count;
+	uint32_t clock;
+	double hits;
+	double misses;
+	int held_meta_ref; // registry reference to the metatable for held converters
+} ConverterCache;
+
+// Get the canonical name for an encoding (or the name itself if it has none), and whether it is UTF-8
+static const char* converter_cache_name(ConverterCache* cache, const char* encoding, int* is_utf8) {
+	UErrorCode status = U_ZERO_ERROR;
+	size_t encoding_len;
+	const char* name;
+	int i;
+	for (i = 0; i < CONVERTER_NAME_CACHE_SIZE; i++) {
+		if (cache->names[i].name && strcmp(cache->names[i].encoding, encoding) == 0) {
+			*is_utf8 = cache->names[i].is_utf8;
+			return cache->names[i].name;
+		}
+	}
+	name = ucnv_getAlias(encoding, 0, &status);
+	if (!name || U_FAILURE(status)) {
+		name = encoding;
+	}
+	*is_utf8 = ucnv_compareNames(encoding, "UTF-8") == 0 || strcmp(name, "UTF-8") == 0;
+	encoding_len = strlen(encoding);
+	if (encoding_len < UCNV_MAX_CONVERTER_NAME_LENGTH) {
+		i = cache->name_next;
+		cache->name_next = (i + 1) % CONVERTER_NAME_CACHE_SIZE;
+		memcpy(cache->names[i].encoding, encoding, encoding_len + 1);
+		cache->names[i].name = (name == encoding) ? cache->names[i].encoding : name;
+		cache->names[i].is_utf8 = *is_utf8;
+		name = cache->names[i].name;
+	}
+	return name;
+}
+
+static UConverter* converter_cache_open(icu4lua_ConverterCache* api, const char* encoding, UErrorCode* status) {
+	ConverterCache* cache = (ConverterCache*)api;
+	const char* name;
+	int is_utf8;
+	int i;
+	if (!encoding) {
+		encoding = ucnv_getDefaultName();
+	}
+	name = converter_cache_name(cache, encoding, &is_utf8);
+	for (i = cache->idle_count - 1; i >= 0; i--) {
+		if (strcmp(cache->idle[i].name, name) == 0) {
+			UConverter* conv = cache->idle[i].conv;
+			cache->idle[i] = cache->idle[--cache->idle_count];
+			cache->hits++;
+			return conv;
+		}
+	}
+	cache->misses++;
+	return ucnv_open(encoding, status);
+}
+
+static void converter_cache_close(icu4lua_ConverterCache* api, UConverter* conv) {
+	ConverterCache* cache = (ConverterCache*)api;
+	UErrorCode status = U_ZERO_ERROR;
+	int i, slot;
+	const char* name;
+	const void* context;
+	UConverterToUCallback to_action;
+	UConverterFromUCallback from_action;
+	if (!conv) {
+		return;
+	}
+	// Put the converter back as ucnv_open would have given it
+	ucnv_reset(conv);
+	ucnv_setToUCallBack(conv, UCNV_TO_U_CALLBACK_SUBSTITUTE, NULL, &to_action, &context, &status);
+	ucnv_setFromUCallBack(conv, UCNV_FROM_U_CALLBACK_SUBSTITUTE, NULL, &from_action, &context, &status);
+	name = ucnv_getName(conv, &status);
+	if (U_FAILURE(status) || !name) {
+		ucnv_close(conv);
+		return;
+	}
+	if (cache->idle_count < CONVERTER_CACHE_SIZE) {
+		slot = cache->idle_count++;
+	}
+	else {
+		slot = 0;
+		for (i = 1; i < CONVERTER_CACHE_SIZE; i++) {
+			if (cache->idle[i].last_used - cache->idle[slot].last_used > UINT_MAX / 2) {
+				slot = i; // idle for longer (allowing for the clock wrapping round)
+			}
+		}
+		ucnv_close(cache->idle[slot].conv);
+	}
+	cache->idle[slot].conv = conv;
+	cache->idle[slot].name = name;
+	cache->idle[slot].last_used = ++cache->clock;
+}
+
+static void converter_cache_release(icu4lua_HeldConverters* held) {
+	int i;
+	for (i = 0; i < ICU4LUA_HELD_CONVERTERS; i++) {
+		if (held->conv[i]) {
+			converter_cache_close(held->cache, held->conv[i]);
+			held->conv[i] = NULL;
+		}
+	}
+}
+
+static icu4lua_HeldConverters* converter_cache_hold(lua_State *L, icu4lua_ConverterCache* api) {
+	ConverterCache* cache = (ConverterCache*)api;
+	icu4lua_HeldConverters* held = (icu4lua_HeldConverters*)lua_newuserdata(L, sizeof(icu4lua_HeldConverters));
+	int i;
+	held->cache = api;
+	for (i = 0; i < ICU4LUA_HELD_CONVERTERS; i++) {
+		held->conv[i] = NULL;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, cache->held_meta_ref);
+	lua_setmetatable(L,-2);
+	return held;
+}
+
+static int converter_cache_held__gc(lua_State *L) {
+	converter_cache_release((icu4lua_HeldConverters*)lua_touserdata(L,1));
+	return 0;
+}
+
+static int converter_cache__gc(lua_State *L) {
+	ConverterCache* cache = (ConverterCache*)lua_touserdata(L,1);
+	while (cache->idle_count > 0) {
+		ucnv_close(cache->idle[--cache->idle_count].conv);
+	}
+	return 0;
+}
+
+// The case map cache. Resolving a locale costs more than mapping a short string, so the
+// UCaseMaps for the last few locales used are kept, keyed by the locale as requested.
+
+#define CASEMAP_CACHE_SIZE	8
+
+typedef struct CaseMapCache {
+	icu4lua_CaseMapCache api;
+	struct {
+		char locale[ULOC_FULLNAME_CAPACITY]; // as requested, not canonicalized
+		UCaseMap* csm;
+		int ascii_simple;
+	} entries[CASEMAP_CACHE_SIZE];
+	int next; // the entry to replace next
+} CaseMapCache;
+
+static UCaseMap* casemap_cache_get(icu4lua_CaseMapCache* api, const char* locale, int* ascii_simple, UErrorCode* status) {
+	CaseMapCache* cache = (CaseMapCache*)api;
+	UCaseMap* csm;
+	char language[ULOC_LANG_CAPACITY];
+	int i;
+	if (!locale) {
+		locale = uloc_getDefault();
+	}
+	if (strlen(locale) >= ULOC_FULLNAME_CAPACITY) {
+		*status = U_ILLEGAL_ARGUMENT_ERROR;
+		return NULL;
+	}
+	for (i = 0; i < CASEMAP_CACHE_SIZE; i++) {
+		if (cache->entries[i].csm && strcmp(cache->entries[i].locale, locale) == 0) {
+			*ascii_simple = cache->entries[i].ascii_simple;
+			return cache->entries[i].csm;
+		}
+	}
+	csm = ucasemap_open(locale, 0, status);
+	if (U_FAILURE(*status)) {
+		return NULL;
+	}
+	i = cache->next;
+	cache->next = (i + 1) % CASEMAP_CACHE_SIZE;
+	if (cache->entries[i].csm) {
+		ucasemap_close(cache->entries[i].csm);
+	}
+	strcpy(cache->entries[i].locale, locale);
+	cache->entries[i].csm = csm;
+	uloc_getLanguage(ucasemap_getLocale(csm), language, ULOC_LANG_CAPACITY, status);
+	cache->entries[i].ascii_simple = U_FAILURE(*status)
+		|| (strcmp(language, "tr") != 0 && strcmp(language, "az") != 0 && strcmp(language, "lt") != 0);
+	*status = U_ZERO_ERROR;
+	*ascii_simple = cache->entries[i].ascii_simple;
+	return csm;
+}
+
+static int casemap_cache__gc(lua_State *L) {
+	CaseMapCache* cache = (CaseMapCache*)lua_touserdata(L,1);
+	int i;
+	for (i = 0; i < CASEMAP_CACHE_SIZE; i++) {
+		if (cache->entries[i].csm) {
+			ucasemap_close(cache->entries[i].csm);
+			cache->entries[i].csm = NULL;
+		}
+	}
+	return 0;
+}
+
+// The ustring pool. This is an open-addressing hash table (linear probing) on a hash of the
+// UChars themselves, so a ustring that is already pooled can be found without creating any Lua
+// objects. When the table needs to grow, entries are moved over to the bigger table a few at a
+// time on each pool operation rather than all at once.
+// Lua 5.1 has no way to push a full userdata given only its address, so each pooled ustring
+// also has a slot in a weak-valued back-reference array (the pool userdata's environment table)
+// - the GC clearing that slot is how we know a ustring is dead, and the ustring's __gc unlinks it
+// from the pool properly. Lua 5.1 walks every weak table again in the atomic phase of each
+// collection to clear dead values, so that step is still O(live pooled ustrings) however the
+// array is laid out. Only a strong reference could stand in for the weak one, and that would
+// keep every pooled ustring alive, so the pause stays for as long as Lua 5.1 is supported.
+// The intern limit (see icu.ustring.setinternlimit) is the way to keep the pool, and so that
+// pause, small.
+// A ustring longer than the pool's intern limit is "transient": it is never put in the pool, so
+// two transient ustrings with the same content are different objects and __eq has to compare them.
+// Only transient ustrings are ever created as views, so slicing never changes which ustrings are
+// the same object.
+
+#define USTRING_POOL_MIN_SLOTS		64
+#define USTRING_POOL_MIGRATE_STEP	8
+#define USTRING_FORMAT_CACHE_SIZE	16
+#define USTRING_VIEW_MIN_LENGTH		32
+
+typedef struct UStringPool {
+	icu4lua_UStringPool api;
+	icu4lua_UString** slots;
+	uint32_t slot_mask; // slot count - 1, the slot count is always a power of two
+	uint32_t used;
+	icu4lua_UString** old_slots; // non-NULL while a resize is in progress
+	uint32_t old_slot_mask;
+	uint32_t old_used;
+	uint32_t migrate_pos;
+	int count; // live ustrings
+	size_t uchar_count; // UChars in live ustrings
+	int* free_refs;
+	int free_refs_count;
+	int free_refs_size;
+	int next_ref;
+	int32_t intern_limit; // ustrings longer than this (in UChars) are left transient, -1 for no limit
+	icu4lua_ConverterCache* converters; // kept alive by the registry
+	icu4lua_CaseMapCache* casemaps; // kept alive by the registry
+	UBreakIterator* graphemes; // for reversing by grapheme cluster, opened when first needed
+	struct {
+		const icu4lua_UString* ustring; // kept alive by ustring_ref while it is in the cache
+		int ustring_ref;
+		int format_ref;
+	} formats[USTRING_FORMAT_CACHE_SIZE]; // most recently used first
+	int format_count;
+	UPatternCache patterns;
+} UStringPool;
+
+#define ustring_hash(ustr, ustr_len)	xxh32_uchars((ustr), (ustr_len), 0)
+
+static int ustring_pool_newref(lua_State *L, UStringPool* pool) {
+	if (pool->free_refs_count > 0) {
+		return pool->free_refs[--pool->free_refs_count];
+	}
+	if (pool->next_ref == INT_MAX) {
+		return luaL_error(L, "ustring pool is full");
+	}
+	return pool->next_ref++;
+}
+
+static void ustring_pool_freeref(UStringPool* pool, int ref) {
+	if (pool->free_refs_count == pool->free_refs_size) {
+		int new_size = pool->free_refs_size ? pool->free_refs_size * 2 : USTRING_POOL_MIN_SLOTS;
+		int* new_refs = (int*)realloc(pool->free_refs, sizeof(int) * new_size);
+		if (!new_refs) {
+			return; // the slot is leaked, but the pool is still consistent
+		}
+		pool->free_refs = new_refs;
+		pool->free_refs_size = new_size;
+	}
+	pool->free_refs[pool->free_refs_count++] = ref;
+}
+
+// Put an entry in the first free slot of its probe sequence
+static void ustring_slots_insert(icu4lua_UString** slots, uint32_t slot_mask, icu4lua_UString* ustring) {
+	uint32_t i = ustring->hash & slot_mask;
+	while (slots[i]) {
+		i = (i + 1) & slot_mask;
+	}
+	slots[i] = ustring;
+}
+
+// Empty slot i, then shift back any later entries of the same cluster that would no longer be
+// reachable from their home slot, so no tombstones are needed
+static void ustring_slots_removeat(icu4lua_UString** slots, uint32_t slot_mask, uint32_t i) {
+	uint32_t j = i;
+	uint32_t home;
+	for (;;) {
+		j = (j + 1) & slot_mask;
+		if (!slots[j]) {
+			break;
+		}
+		home = slots[j]->hash & slot_mask;
+		if ((j > i) ? (home <= i || home > j) : (home <= i && home > j)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i] = NULL;
+}
+
+static int ustring_slots_remove(icu4lua_UString** slots, uint32_t slot_mask, icu4lua_UString* ustring) {
+	uint32_t i;
+	for (i = ustring->hash & slot_mask; slots[i]; i = (i + 1) & slot_mask) {
+		if (slots[i] == ustring) {
+			ustring_slots_removeat(slots, slot_mask, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Move up to max_moves entries from the old table into the new one. Taking each entry out with
+// ustring_slots_removeat() keeps the rest of the old table valid for lookups in the meantime.
+static void ustring_pool_migrate(UStringPool* pool, uint32_t max_moves) {
+	while (pool->old_slots && max_moves-- > 0) {
+		icu4lua_UString* entry;
+		while (pool->migrate_pos <= pool->old_slot_mask && !pool->old_slots[pool->migrate_pos]) {
+			pool->migrate_pos++;
+		}
+		if (pool->migrate_pos > pool->old_slot_mask) {
+			free(pool->old_slots);
+			pool->old_slots = NULL;
+			pool->old_used = 0;
+			return;
+		}
+		entry = pool->old_slots[pool->migrate_pos];
+		ustring_slots_removeat(pool->old_slots, pool->old_slot_mask, pool->migrate_pos);
+		pool->old_used--;
+		ustring_slots_insert(pool->slots, pool->slot_mask, entry);
+		pool->used++;
+	}
+}
+
+// Make sure there is room for one more entry, starting a resize if the load factor gets over 3/4
+static void ustring_pool_reserve(lua_State *L, UStringPool* pool) {
+	icu4lua_UString** new_slots;
+	uint32_t slot_count = pool->slot_mask + 1;
+	if (pool->used + pool->old_used + 1 <= slot_count - (slot_count / 4)) {
+		return;
+	}
+	// Any resize that is still going has to be finished before the next can begin
+	ustring_pool_migrate(pool, UINT_MAX);
+	if (slot_count > (UINT_MAX / 2) / sizeof(icu4lua_UString*)) {
+		new_slots = NULL;
+	}
+	else {
+		new_slots = (icu4lua_UString**)calloc(slot_count * 2, sizeof(icu4lua_UString*));
+	}
+	if (!new_slots) {
+		if (pool->used + 1 < slot_count) {
+			return; // probe sequences just get longer
+		}
+		luaL_error(L, "unable to grow the ustring pool");
+	}
+	pool->old_slots = pool->slots;
+	pool->old_slot_mask = pool->slot_mask;
+	pool->old_used = pool->used;
+	pool->migrate_pos = 0;
+	pool->slots = new_slots;
+	pool->slot_mask = slot_count * 2 - 1;
+	pool->used = 0;
+}
+
+static void ustring_pool_unlink(UStringPool* pool, icu4lua_UString* ustring) {
+	if (!pool->slots) {
+		return; // the pool itself has already been finalized
+	}
+	if (pool->old_slots && ustring_slots_remove(pool->old_slots, pool->old_slot_mask, ustring)) {
+		pool->old_used--;
+	}
+	else if (ustring_slots_remove(pool->slots, pool->slot_mask, ustring)) {
+		pool->used--;
+	}
+	pool->count--;
+	pool->uchar_count -= ustring->length;
+	ustring_pool_freeref(pool, ustring->pool_ref);
+	ustring->pool_ref = 0;
+	ustring_pool_migrate(pool, USTRING_POOL_MIGRATE_STEP);
+}
+
+// Look for a live ustring with the given content in one table, leaving it on the stack if found
+static int ustring_slots_find(lua_State *L, icu4lua_UString** slots, uint32_t slot_mask,
+		const UChar* ustr, int32_t ustr_len, uint32_t hash) {
+	uint32_t i;
+	icu4lua_UString* entry;
+	for (i = hash & slot_mask; (entry = slots[i]) != NULL; i = (i + 1) & slot_mask) {
+		if (entry->hash == hash && entry->length == ustr_len
+				&& memcmp(entry->data, ustr, ustr_len * sizeof(UChar)) == 0) {
+			lua_rawgeti(L, -1, entry->pool_ref);
+			if (!lua_isnil(L,-1)) {
+				return 1;
+			}
+			// Already collected, just waiting for its __gc to unlink it
+			lua_pop(L,1);
+		}
+	}
+	return 0;
+}
+
+// Push a new ustring userdata with room for ustr_len UChars, which the caller must fill in.
+// It is not (yet) linked into the pool.
+static icu4lua_UString* ustring_allocuserdata(lua_State *L, int32_t ustr_len, int meta_idx) {
+	icu4lua_UString* new_ustring = (icu4lua_UString*)lua_newuserdata(L, sizeof(icu4lua_UString) + ustr_len * sizeof(UChar));
+	new_ustring->data = (const UChar*)(new_ustring + 1);
+	new_ustring->length = ustr_len;
+	new_ustring->hash = 0;
+	new_ustring->hash_valid = 0;
+	new_ustring->pool_ref = 0;
+	new_ustring->cp_length = -1;
+	new_ustring->cp_index = NULL;
+	new_ustring->view_ref = LUA_NOREF;
+	new_ustring->fold_ref = LUA_NOREF;
+	lua_pushvalue(L, meta_idx);
+	lua_setmetatable(L, -2);
+	return new_ustring;
+}
+
+static icu4lua_UString* ustring_newuserdata(lua_State *L, const UChar* ustr, int32_t ustr_len, int meta_idx) {
+	icu4lua_UString* new_ustring = ustring_allocuserdata(L, ustr_len, meta_idx);
+	memcpy(new_ustring + 1, ustr, ustr_len * sizeof(UChar));
+	return new_ustring;
+}
+
+// Link a new ustring into the pool. The pool's back-reference table must be just below it on the
+// stack, and there must already be room for it (see ustring_pool_reserve).
+static void ustring_pool_link(lua_State *L, UStringPool* pool, icu4lua_UString* new_ustring) {
+	int ref = ustring_pool_newref(L, pool);
+	new_ustring->pool_ref = ref;
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, ref);
+
+	ustring_slots_insert(pool->slots, pool->slot_mask, new_ustring);
+	pool->used++;
+	pool->count++;
+	pool->uchar_count += new_ustring->length;
+	ustring_pool_migrate(pool, USTRING_POOL_MIGRATE_STEP);
+}
+
+static void ustring_pooled(lua_State *L, const UChar* ustr, int32_t ustr_len, int meta_idx, int pool_idx) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, pool_idx);
+	uint32_t hash = ustring_hash(ustr, ustr_len);
+	icu4lua_UString* new_ustring;
+
+	lua_getfenv(L, pool_idx);
+	if ((pool->old_slots && ustring_slots_find(L, pool->old_slots, pool->old_slot_mask, ustr, ustr_len, hash))
+			|| ustring_slots_find(L, pool->slots, pool->slot_mask, ustr, ustr_len, hash)) {
+		lua_remove(L,-2);
+		return;
+	}
+
+	// The ustring must not be linked into the pool until it has its metatable (and so its __gc)
+	// and its back-reference, in case any of those steps raises a memory error
+	ustring_pool_reserve(L, pool);
+	new_ustring = ustring_newuserdata(L, ustr, ustr_len, meta_idx);
+	new_ustring->hash = hash;
+	new_ustring->hash_valid = 1;
+	ustring_pool_link(L, pool, new_ustring);
+	lua_remove(L, -2);
+}
+
+// Intern a new ustring that the caller has filled in place, from the top of the stack. If the
+// pool already has a ustring with the same content, that one replaces it on the stack. Like
+// ustring_intern(), it is left transient if it is longer than the intern limit.
+static void ustring_internnew(lua_State *L, int pool_idx) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, pool_idx);
+	icu4lua_UString* new_ustring = icu4lua_toustringheader(L,-1);
+	if (pool->intern_limit >= 0 && new_ustring->length > pool->intern_limit) {
+		return;
+	}
+	new_ustring->hash = ustring_hash(new_ustring->data, new_ustring->length);
+	new_ustring->hash_valid = 1;
+
+	lua_getfenv(L, pool_idx);
+	if ((pool->old_slots && ustring_slots_find(L, pool->old_slots, pool->old_slot_mask, new_ustring->data, new_ustring->length, new_ustring->hash))
+			|| ustring_slots_find(L, pool->slots, pool->slot_mask, new_ustring->data, new_ustring->length, new_ustring->hash)) {
+		lua_replace(L, -3);
+		lua_pop(L, 1);
+		return;
+	}
+	ustring_pool_reserve(L, pool);
+	lua_insert(L, -2);
+	ustring_pool_link(L, pool, new_ustring);
+	lua_remove(L, -2);
+}
+
+static void ustring_intern(lua_State *L, const UChar* ustr, int32_t ustr_len, int meta_idx, int pool_idx) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, pool_idx);
+	if (pool->intern_limit >= 0 && ustr_len > pool->intern_limit) {
+		ustring_newuserdata(L, ustr, ustr_len, meta_idx);
+		return;
+	}
+	ustring_pooled(L, ustr, ustr_len, meta_idx, pool_idx);
+}
+
+// Push a ustring with length UChars of the ustring at ustring_idx, from offset start. If the
+// result would be transient anyway and is not too short, it is created as a view that shares
+// the UChars of the original rather than copying them.
+static void ustring_slice(lua_State *L, int ustring_idx, int32_t start, int32_t length, int meta_idx, int pool_idx) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, pool_idx);
+	icu4lua_UString* ustring = icu4lua_toustringheader(L, ustring_idx);
+	icu4lua_UString* view;
+	if (start == 0 && length == ustring->length) {
+		lua_pushvalue(L, ustring_idx);
+		return;
+	}
+	if (pool->intern_limit < 0 || length <= pool->intern_limit || length < USTRING_VIEW_MIN_LENGTH) {
+		ustring_intern(L, ustring->data + start, length, meta_idx, pool_idx);
+		return;
+	}
+	if (ustring_idx < 0 && ustring_idx > LUA_REGISTRYINDEX) {
+		ustring_idx = lua_gettop(L) + ustring_idx + 1;
+	}
+	view = (icu4lua_UString*)lua_newuserdata(L, sizeof(icu4lua_UString));
+	view->data = ustring->data + start;
+	view->length = length;
+	view->hash = 0;
+	view->hash_valid = 0;
+	view->pool_ref = 0;
+	view->cp_length = -1;
+	view->cp_index = NULL;
+	view->view_ref = LUA_NOREF;
+	view->fold_ref = LUA_NOREF;
+	lua_pushvalue(L, meta_idx);
+	lua_setmetatable(L, -2);
+	// A view of a view refers straight to the ustring that really owns the UChars
+	if (ustring->view_ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ustring->view_ref);
+	}
+	else {
+		lua_pushvalue(L, ustring_idx);
+	}
+	view->view_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Content equality for two ustrings. Distinct pooled ustrings always have different content.
+static int ustring_equal(icu4lua_UString* a, icu4lua_UString* b) {
+	if (a == b) {
+		return 1;
+	}
+	if ((a->pool_ref && b->pool_ref) || a->length != b->length) {
+		return 0;
+	}
+	return memcmp(a->data, b->data, a->length * sizeof(UChar)) == 0;
+}
+
+static int32_t ustring_cplength(icu4lua_UString* ustring) {
+	if (ustring->cp_length < 0) {
+		ustring->cp_length = u_countChar32(ustring->data, ustring->length);
+	}
+	return ustring->cp_length;
+}
+
+// Get the UChar offset of code point cp_pos (counting from 0, and no more than the code point
+// length). Strings without surrogate pairs map directly, otherwise a sparse index is built the
+// first time it is needed so that no lookup has to step over more than ICU4LUA_CPINDEX_STEP
+// code points.
+static int32_t ustring_cpoffset(icu4lua_UString* ustring, int32_t cp_pos) {
+	int32_t offset;
+	int32_t i;
+	if (ustring_cplength(ustring) == ustring->length) {
+		return cp_pos;
+	}
+	if (!ustring->cp_index && ustring->cp_length >= ICU4LUA_CPINDEX_STEP) {
+		int32_t* cp_index = (int32_t*)malloc(sizeof(int32_t) * (ustring->cp_length / ICU4LUA_CPINDEX_STEP + 1));
+		if (cp_index) {
+			offset = 0;
+			for (i = 0; i < ustring->cp_length; i++) {
+				if (i % ICU4LUA_CPINDEX_STEP == 0) {
+					cp_index[i / ICU4LUA_CPINDEX_STEP] = offset;
+				}
+				U16_FWD_1(ustring->data, offset, ustring->length);
+			}
+			if (i % ICU4LUA_CPINDEX_STEP == 0) {
+				cp_index[i / ICU4LUA_CPINDEX_STEP] = offset;
+			}
+			ustring->cp_index = cp_index;
+		}
+	}
+	if (ustring->cp_index) {
+		offset = ustring->cp_index[cp_pos / ICU4LUA_CPINDEX_STEP];
+		i = cp_pos % ICU4LUA_CPINDEX_STEP;
+	}
+	else {
+		offset = 0;
+		i = cp_pos;
+	}
+	U16_FWD_N(ustring->data, offset, ustring->length, i);
+	return offset;
+}
+
+// UTF-8 fast path for decode and encode. Text is usually mostly ASCII, so both directions check
+// a block of characters at a time until they find a non-ASCII one. Anything ill-formed is left to
+// the converter, so substitutions and errors are always the same as going through ucnv.
+
+#define USTRING_STACK_UCHARS	256
+
+static int ustring_isutf8(icu4lua_ConverterCache* converters, const char* encoding) {
+	int is_utf8;
+	converter_cache_name((ConverterCache*)converters, encoding, &is_utf8);
+	return is_utf8;
+}
+
+static int utf8_isasciiblock(const uint8_t* s) {
+	uint32_t a, b;
+	memcpy(&a, s, 4);
+	memcpy(&b, s + 4, 4);
+	return ((a | b) & 0x80808080) == 0;
+}
+
+// Get the number of UChars that UTF-8 text will decode to, or -1 if it is not well-formed
+static int32_t utf8_countuchars(const uint8_t* s, int32_t len) {
+	int32_t i = 0;
+	int32_t count = 0;
+	UChar32 c;
+	while (i < len) {
+		if (len - i >= 8 && utf8_isasciiblock(s + i)) {
+			i += 8;
+			count += 8;
+		}
+		else if (s[i] < 0x80) {
+			i++;
+			count++;
+		}
+		else {
+			U8_NEXT(s, i, len, c);
+			if (c < 0) {
+				return -1;
+			}
+			count += U16_LENGTH(c);
+		}
+	}
+	return count;
+}
+
+// Decode UTF-8 text that utf8_countuchars() has already checked
+static void utf8_touchars(const uint8_t* s, int32_t len, UChar* target) {
+	int32_t i = 0;
+	int32_t j = 0;
+	UChar32 c;
+	while (i < len) {
+		if (len - i >= 8 && utf8_isasciiblock(s + i)) {
+			target[j] = s[i]; target[j+1] = s[i+1]; target[j+2] = s[i+2]; target[j+3] = s[i+3];
+			target[j+4] = s[i+4]; target[j+5] = s[i+5]; target[j+6] = s[i+6]; target[j+7] = s[i+7];
+			i += 8;
+			j += 8;
+		}
+		else if (s[i] < 0x80) {
+			target[j++] = s[i++];
+		}
+		else {
+			U8_NEXT_UNSAFE(s, i, c);
+			U16_APPEND_UNSAFE(target, j, c);
+		}
+	}
+}
+
+// Push the ustring for some UTF-8 text, returning 0 (with nothing pushed) if it is not well-formed
+static int ustring_pushutf8(lua_State *L, const char* s, size_t len, int meta_idx, int pool_idx) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, pool_idx);
+	UChar stack_buffer[USTRING_STACK_UCHARS];
+	UChar* temp_buffer;
+	int32_t uchar_len;
+	if (len > INT32_MAX) {
+		return 0;
+	}
+	uchar_len = utf8_countuchars((const uint8_t*)s, (int32_t)len);
+	if (uchar_len < 0) {
+		return 0;
+	}
+	if (pool->intern_limit >= 0 && uchar_len > pool->intern_limit) {
+		// Transient, so decode straight into the new ustring
+		utf8_touchars((const uint8_t*)s, (int32_t)len, (UChar*)(ustring_allocuserdata(L, uchar_len, meta_idx) + 1));
+	}
+	else if (uchar_len <= USTRING_STACK_UCHARS) {
+		utf8_touchars((const uint8_t*)s, (int32_t)len, stack_buffer);
+		ustring_intern(L, stack_buffer, uchar_len, meta_idx, pool_idx);
+	}
+	else {
+		temp_buffer = (UChar*)lua_newuserdata(L, uchar_len * sizeof(UChar));
+		utf8_touchars((const uint8_t*)s, (int32_t)len, temp_buffer);
+		ustring_intern(L, temp_buffer, uchar_len, meta_idx, pool_idx);
+		lua_remove(L,-2);
+	}
+	return 1;
+}
+
+static int utf16_isasciiblock(const UChar* s) {
+	return (s[0] | s[1] | s[2] | s[3]) < 0x80;
+}
+
+// Get the number of bytes that UTF-16 text will encode to in UTF-8, or -1 if it is not well-formed
+static int32_t utf16_countutf8(const UChar* s, int32_t len) {
+	int32_t i = 0;
+	int32_t count = 0;
+	int32_t n;
+	UChar32 c;
+	while (i < len) {
+		if (len - i >= 4 && utf16_isasciiblock(s + i)) {
+			i += 4;
+			n = 4;
+		}
+		else {
+			U16_NEXT(s, i, len, c);
+			if (U_IS_SURROGATE(c)) {
+				return -1;
+			}
+			n = U8_LENGTH(c);
+		}
+		if (count > INT32_MAX - n) {
+			return -1;
+		}
+		count += n;
+	}
+	return count;
+}
+
+// Encode UTF-16 text that utf16_countutf8() has already checked
+static void utf16_toutf8(const UChar* s, int32_t len, uint8_t* target) {
+	int32_t i = 0;
+	int32_t j = 0;
+	UChar32 c;
+	while (i < len) {
+		if (len - i >= 4 && utf16_isasciiblock(s + i)) {
+			target[j] = (uint8_t)s[i]; target[j+1] = (uint8_t)s[i+1];
+			target[j+2] = (uint8_t)s[i+2]; target[j+3] = (uint8_t)s[i+3];
+			i += 4;
+			j += 4;
+		}
+		else {
+			U16_NEXT_UNSAFE(s, i, c);
+			U8_APPEND_UNSAFE(target, j, c);
+		}
+	}
+}
+
+// Push the UTF-8 encoding of some UChars, returning 0 (with nothing pushed) if they are not well-formed
+static int ustring_pushasutf8(lua_State *L, const UChar* s, int32_t len) {
+	char stack_buffer[LUAL_BUFFERSIZE];
+	uint8_t* temp_buffer;
+	int32_t byte_len = utf16_countutf8(s, len);
+	if (byte_len < 0) {
+		return 0;
+	}
+	if (byte_len <= LUAL_BUFFERSIZE) {
+		utf16_toutf8(s, len, (uint8_t*)stack_buffer);
+		lua_pushlstring(L, stack_buffer, byte_len);
+	}
+	else {
+		temp_buffer = (uint8_t*)lua_newuserdata(L, byte_len);
+		utf16_toutf8(s, len, temp_buffer);
+		lua_pushlstring(L, (const char*)temp_buffer, byte_len);
+		lua_remove(L,-2);
+	}
+	return 1;
+}
+
+#define ustring_converters(L)	(((UStringPool*)lua_touserdata((L), USTRING_UV_POOL))->converters)
 
 static int icu_ustring_decode(lua_State *L) {
 	size_t byte_length;
@@ -22,11 +815,18 @@ static int icu_ustring_decode(lua_State *L) {
 	const char* source_limit = source + byte_length;
     UErrorCode status = U_ZERO_ERROR;
     UConverter* conv;
+	icu4lua_ConverterCache* converters = ustring_converters(L);
+	const char* encoding = luaL_optstring(L,2,"utf-8");
 	luaL_Buffer build_buffer;
 	UChar* temp_buffer;
 	UChar* target;
 	UChar* target_limit;
-	conv = ucnv_open(luaL_optstring(L,2,"utf-8"), &status);
+	icu4lua_HeldConverters* held;
+	if (ustring_isutf8(converters, encoding) && ustring_pushutf8(L, source, byte_length, USTRING_UV_META, USTRING_UV_POOL)) {
+		return 1;
+	}
+	held = icu4lua_holdconverters(L, converters);
+	conv = held->conv[0] = icu4lua_openconverter(converters, encoding, &status);
 	if (U_FAILURE(status)) {
 		lua_pushnil(L);
 		lua_pushstring(L, u_errorName(status));
@@ -42,7 +842,7 @@ static int icu_ustring_decode(lua_State *L) {
 		switch(status) {
 			case U_ZERO_ERROR:
 				icu4lua_addusize(&build_buffer, target - temp_buffer);
-				ucnv_close(conv);
+				icu4lua_releaseconverters(held);
 				icu4lua_pushuresult(&build_buffer, USTRING_UV_META, USTRING_UV_POOL);
 				return 1;
 			case U_BUFFER_OVERFLOW_ERROR:
@@ -52,7 +852,7 @@ static int icu_ustring_decode(lua_State *L) {
 				target_limit = target + ICU4LUA_UBUFFERSIZE;
 				break;
 			default:
-				ucnv_close(conv);
+				icu4lua_releaseconverters(held);
 				lua_pushnil(L);
 				lua_pushstring(L, u_errorName(status));
 				return 2;
@@ -72,21 +872,26 @@ static int icu_ustring_unescape(lua_State *L) {
 	return 1;
 }
 
-static int icu_ustring_encode(lua_State *L) {
+// Push a Lua string with the given UChars in the given encoding
+static int ustring_encode(lua_State *L, const UChar* source, int32_t source_len, const char* encoding) {
 	UErrorCode status;
 	UConverter* conv;
+	icu4lua_ConverterCache* converters = ustring_converters(L);
 	luaL_Buffer build_buffer;
 	char* temp_buffer;
 	char* target;
 	char* target_limit;
-	UChar* source = icu4lua_checkustring(L,1,USTRING_UV_META);
-	UChar* source_limit = source + icu4lua_ustrlen(L,1);
+	const UChar* source_limit = source + source_len;
+	icu4lua_HeldConverters* held;
 
-	lua_settop(L,2);
+	if (ustring_isutf8(converters, encoding) && ustring_pushasutf8(L, source, source_len)) {
+		return 1;
+	}
 
 	// Initialise the converter and string building buffer
 	status = U_ZERO_ERROR;
-	conv = ucnv_open(luaL_optstring(L,2,"utf-8"), &status);
+	held = icu4lua_holdconverters(L, converters);
+	conv = held->conv[0] = icu4lua_openconverter(converters, encoding, &status);
 	if (U_FAILURE(status)) {
 		lua_pushstring(L, u_errorName(status));
 		return lua_error(L);
@@ -110,257 +915,477 @@ static int icu_ustring_encode(lua_State *L) {
 				break;
 			case U_ZERO_ERROR:
 				luaL_addsize(&build_buffer, (const char*)target - (const char*)temp_buffer);
-				ucnv_close(conv);
+				icu4lua_releaseconverters(held);
 				luaL_pushresult(&build_buffer);
 				return 1;
 			default:
-				ucnv_close(conv);
+				icu4lua_releaseconverters(held);
 				lua_pushstring(L, u_errorName(status));
 				return lua_error(L);
 		}
 	}
 }
 
+static int icu_ustring_encode(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	lua_settop(L,2);
+	return ustring_encode(L, icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1), luaL_optstring(L,2,"utf-8"));
+}
+
 static int icu_ustring_len(lua_State *L) {
-	lua_pushinteger(L, u_countChar32(icu4lua_checkustring(L,1,USTRING_UV_META), (int32_t)icu4lua_ustrlen(L,1)));
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	lua_pushinteger(L, ustring_cplength(icu4lua_toustringheader(L,1)));
 	return 1;
 }
 
 static int icu_ustring_rep(lua_State *L) {
 	int reps;
-	luaL_Buffer concat_buffer;
+	int32_t uchar_len;
+	int32_t total_len;
+	int32_t done_len;
+	UChar* target;
 
 	icu4lua_checkustring(L,1,USTRING_UV_META);
 	reps = luaL_checkint(L,2);
-	luaL_buffinit(L, &concat_buffer);
-	for (; reps > 0; reps--) {
-		luaL_addlstring(&concat_buffer, lua_touserdata(L,1), lua_objlen(L,1));
+	uchar_len = (int32_t)icu4lua_ustrlen(L,1);
+	if (reps == 1) {
+		lua_settop(L,1);
+		return 1;
+	}
+	if (reps <= 0 || uchar_len == 0) {
+		ustring_intern(L, icu4lua_trustustring(L,1), 0, USTRING_UV_META, USTRING_UV_POOL);
+		return 1;
+	}
+	if (uchar_len > INT32_MAX / reps) {
+		return luaL_error(L, "resulting ustring is too long");
+	}
+
+	// Allocate the result once, then fill it by doubling up what has been copied so far
+	total_len = uchar_len * reps;
+	target = (UChar*)(ustring_allocuserdata(L, total_len, USTRING_UV_META) + 1);
+	memcpy(target, icu4lua_trustustring(L,1), sizeof(UChar) * uchar_len);
+	for (done_len = uchar_len; done_len < total_len; done_len *= 2) {
+		memcpy(target + done_len, target, sizeof(UChar) * ((total_len - done_len < done_len) ? total_len - done_len : done_len));
 	}
-	icu4lua_pushuresult(&concat_buffer, USTRING_UV_META, USTRING_UV_POOL);
+	ustring_internnew(L, USTRING_UV_POOL);
 	return 1;
 }
 
 static int icu_ustring_sub(lua_State *L) {
-	const UChar* ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
-    UCharIterator iter;
-    int start_pos;
-    int end_pos;
-    int i;
-    uint32_t start_ucharpos;
-    uint32_t end_ucharpos;
+	icu4lua_UString* ustring;
+	int32_t cp_len;
+	int32_t start_pos;
+	int32_t end_pos;
+	int32_t start_ucharpos;
 
-    start_pos = luaL_optint(L,2,1);
-    end_pos = luaL_optint(L,3,-1);
-
-    lua_settop(L,1);
-    uiter_setString(&iter, ustring, (int32_t)icu4lua_ustrlen(L,1));
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	ustring = icu4lua_toustringheader(L,1);
+	cp_len = ustring_cplength(ustring);
+	start_pos = luaL_optint(L,2,1);
+	end_pos = luaL_optint(L,3,-1);
+
+	// Same rules as string.sub
+	if (start_pos < 0) {
+		start_pos += cp_len + 1;
+	}
+	if (end_pos < 0) {
+		end_pos += cp_len + 1;
+	}
+	if (start_pos < 1) {
+		start_pos = 1;
+	}
+	if (end_pos > cp_len) {
+		end_pos = cp_len;
+	}
 
-    if (end_pos == 0) {
-        lua_pushliteral(L, "");
-		icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
-        return 1;
-    }
-    else if (end_pos < 0) {
-        iter.move(&iter, 0, UITER_LIMIT);
-        for (i = -1; i > end_pos; i--) {
-            if (!iter.hasPrevious(&iter)) {
-                lua_pushliteral(L, "");
-				icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
-                return 1;
-            }
-            iter.move(&iter, -1, UITER_CURRENT);
-        }
-    }
-    else {
-        iter.move(&iter, end_pos, UITER_START);
-    }
-    end_ucharpos = iter.getState(&iter);
-
-    if (start_pos < 0) {
-        iter.move(&iter, start_pos, UITER_LIMIT);
-    }
-    else {
-        iter.move(&iter, 0, UITER_START);
-        for (i = 1; i < start_pos; i++) {
-            if (!iter.hasNext(&iter)) {
-				lua_pushliteral(L,"");
-				icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
-                return 1;
-            }
-            iter.move(&iter, 1, UITER_CURRENT);
-        }
-    }
-    start_ucharpos = iter.getState(&iter);
-
-	if (start_ucharpos > end_ucharpos) {
+	lua_settop(L,1);
+	if (start_pos > end_pos) {
 		lua_pushliteral(L,"");
 		icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
 	}
 	else {
-		icu4lua_pushustring(L,
-			ustring + start_ucharpos, end_ucharpos - start_ucharpos,
+		start_ucharpos = ustring_cpoffset(ustring, start_pos - 1);
+		icu4lua_pushustringslice(L, 1,
+			start_ucharpos, ustring_cpoffset(ustring, end_pos) - start_ucharpos,
 			USTRING_UV_META, USTRING_UV_POOL);
 	}
-    return 1;
+	return 1;
 }
 
 static int icu_ustring_reverse(lua_State *L) {
 	UChar* ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
 	int32_t uchar_len = (int32_t)icu4lua_ustrlen(L,1);
-	UChar* new_ustring;
-	UCharIterator iter;
-	UChar32 uc;
-	UErrorCode status;
+	int graphemes = lua_toboolean(L,2);
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	UChar* target;
+	int32_t i, j, start;
+	UErrorCode status = U_ZERO_ERROR;
 
-    uiter_setString(&iter, ustring, uchar_len);
-	
-	new_ustring = (UChar*)lua_newuserdata(L, lua_objlen(L,1));
-	
-    iter.move(&iter, 0, UITER_LIMIT);
-	for (uc = uiter_previous32(&iter); uc != U_SENTINEL; uc = uiter_previous32(&iter)) {
-		status = U_ZERO_ERROR;
-		u_strFromUTF32(new_ustring, uchar_len, NULL, &uc, 1, &status);
+	if (uchar_len <= 1) {
+		lua_settop(L,1);
+		return 1;
+	}
+	if (graphemes && !pool->graphemes) {
+		pool->graphemes = ubrk_open(UBRK_CHARACTER, NULL, NULL, 0, &status);
 		if (U_FAILURE(status)) {
+			pool->graphemes = NULL;
 			lua_pushnil(L);
 			lua_pushstring(L, u_errorName(status));
 			return 2;
 		}
-		new_ustring++;
-		uchar_len--;
 	}
-	
-	lua_pushlstring(L, (const char*)lua_touserdata(L,-1), lua_objlen(L,-1));
-	icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
+
+	// Write straight into the result, keeping surrogate pairs (or whole grapheme clusters) in order
+	target = (UChar*)(ustring_allocuserdata(L, uchar_len, USTRING_UV_META) + 1);
+	if (graphemes) {
+		ubrk_setText(pool->graphemes, ustring, uchar_len, &status);
+		if (U_FAILURE(status)) {
+			lua_pushnil(L);
+			lua_pushstring(L, u_errorName(status));
+			return 2;
+		}
+		start = ubrk_first(pool->graphemes);
+		for (i = ubrk_next(pool->graphemes); i != UBRK_DONE; start = i, i = ubrk_next(pool->graphemes)) {
+			memcpy(target + uchar_len - i, ustring + start, sizeof(UChar) * (i - start));
+		}
+		// Don't leave the break iterator pointing at this ustring's UChars
+		ubrk_setText(pool->graphemes, NULL, 0, &status);
+	}
+	else {
+		for (i = 0, j = uchar_len; i < uchar_len; ) {
+			if (U16_IS_LEAD(ustring[i]) && i + 1 < uchar_len && U16_IS_TRAIL(ustring[i+1])) {
+				target[j-2] = ustring[i];
+				target[j-1] = ustring[i+1];
+				i += 2;
+				j -= 2;
+			}
+			else {
+				target[--j] = ustring[i++];
+			}
+		}
+	}
+	ustring_internnew(L, USTRING_UV_POOL);
 	return 1;
 }
 
-static int icu_ustring_upper(lua_State *L) {
-    UChar* ustring;
-    int32_t uchar_len;
-    UChar* new_ustring;
+typedef int32_t UStrCaseFunc(UChar *dest, int32_t destCapacity, const UChar *src, int32_t srcLength,
+	const char *locale, UErrorCode *pErrorCode);
+
+static int ustring_mapcase(lua_State *L, UStrCaseFunc* map_case, int upper) {
+	const UChar* ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
+	int32_t uchar_len = (int32_t)icu4lua_ustrlen(L,1);
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	UChar stack_buffer[USTRING_STACK_UCHARS];
+	UChar* new_ustring = stack_buffer;
 	int32_t new_uchar_len;
-    UErrorCode status;
+	UErrorCode status = U_ZERO_ERROR;
+	int ascii_simple;
+	UCaseMap* csm = icu4lua_getcasemap(pool->casemaps, luaL_optstring(L,2,NULL), &ascii_simple, &status);
+	int32_t i;
+	UChar c;
 
-	lua_settop(L,2);
-	luaL_argcheck(L, lua_getmetatable(L,1) && lua_rawequal(L,-1,USTRING_UV_META), 1, "expecting ustring");
-	lua_pop(L,1);
-
-    ustring = icu4lua_trustustring(L,1);
-	uchar_len = (int32_t)icu4lua_ustrlen(L,1);
+	if (U_FAILURE(status)) {
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
 
-	// Calculate new length by pre-flighting
-	// ICU's manual warns that the result *can* be a different length, but I don't know of any actual test cases
-    status = U_ZERO_ERROR;
-    new_uchar_len = u_strToUpper(NULL, 0, ustring, uchar_len, lua_isnoneornil(L,2) ? NULL : lua_tostring(L,2), &status);
-    if (status != U_BUFFER_OVERFLOW_ERROR && U_FAILURE(status)) {
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-	
-	// Allocate new ustring
-	new_ustring = (UChar*)malloc(sizeof(UChar) * new_uchar_len);
-	status = U_ZERO_ERROR;
-	u_strToUpper(new_ustring, new_uchar_len, ustring, uchar_len, lua_isnoneornil(L,2) ? NULL : lua_tostring(L,2), &status);
-    if (U_FAILURE(status)) {
-		free(new_ustring);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
+	// ASCII-only text maps one to one, unless the locale has special rules for I and i
+	if (ascii_simple) {
+		for (i = 0; i < uchar_len && ustring[i] < 0x80; i++) {
+			c = ustring[i];
+			if (upper ? (c >= 'a' && c <= 'z') : (c >= 'A' && c <= 'Z')) {
+				break;
+			}
+		}
+		if (i == uchar_len) {
+			// Nothing to change
+			lua_settop(L,1);
+			return 1;
+		}
+		for (; i < uchar_len && ustring[i] < 0x80; i++);
+		if (i == uchar_len) {
+			if (uchar_len > USTRING_STACK_UCHARS) {
+				new_ustring = (UChar*)lua_newuserdata(L, sizeof(UChar) * uchar_len);
+			}
+			for (i = 0; i < uchar_len; i++) {
+				c = ustring[i];
+				new_ustring[i] = (upper ? (c >= 'a' && c <= 'z') : (c >= 'A' && c <= 'Z')) ? (c ^ 0x20) : c;
+			}
+			icu4lua_pushustring(L, new_ustring, uchar_len, USTRING_UV_META, USTRING_UV_POOL);
+			return 1;
+		}
+	}
 
+	// Try the stack buffer first, and only allocate if the result turns out to be too long for it
+	new_uchar_len = map_case(new_ustring, USTRING_STACK_UCHARS, ustring, uchar_len,
+		ucasemap_getLocale(csm), &status);
+	if (status == U_BUFFER_OVERFLOW_ERROR) {
+		new_ustring = (UChar*)lua_newuserdata(L, sizeof(UChar) * new_uchar_len);
+		status = U_ZERO_ERROR;
+		map_case(new_ustring, new_uchar_len, ustring, uchar_len,
+			ucasemap_getLocale(csm), &status);
+	}
+	if (U_FAILURE(status)) {
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+	if (new_uchar_len == uchar_len && memcmp(new_ustring, ustring, sizeof(UChar) * uchar_len) == 0) {
+		lua_settop(L,1);
+		return 1;
+	}
 	icu4lua_pushustring(L, new_ustring, new_uchar_len, USTRING_UV_META, USTRING_UV_POOL);
-	free(new_ustring);
-    return 1;
+	return 1;
 }
 
-static int icu_ustring_lower(lua_State *L) {
-    UChar* ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
-    int32_t uchar_len = (int32_t)icu4lua_ustrlen(L,1);
-    UChar* new_ustring;
+// Push the case-folded form of the ustring at the given index and return its header. The first
+// fold is remembered on the ustring (and the result marked as already folded), so sorting or
+// comparing the same ustrings case-insensitively over and over only folds each one once.
+static icu4lua_UString* ustring_pushfold(lua_State *L, int idx) {
+	icu4lua_UString* ustring = icu4lua_toustringheader(L, idx);
+	icu4lua_UString* folded;
+	UChar stack_buffer[USTRING_STACK_UCHARS];
+	UChar* new_ustring = stack_buffer;
 	int32_t new_uchar_len;
-    UErrorCode status;
-
-	// Calculate new length by pre-flighting
-	// ICU's manual warns that the result *can* be a different length, but I don't know of any actual test cases
-    status = U_ZERO_ERROR;
-    new_uchar_len = u_strToLower(NULL, 0, ustring, uchar_len, lua_isnoneornil(L,2) ? NULL : lua_tostring(L,2), &status);
-    if (status != U_BUFFER_OVERFLOW_ERROR && U_FAILURE(status)) {
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-	
-	// Allocate new ustring
-	new_ustring = (UChar*)malloc(sizeof(UChar) * new_uchar_len);
-	status = U_ZERO_ERROR;
-	u_strToLower(new_ustring, new_uchar_len, ustring, uchar_len, lua_isnoneornil(L,2) ? NULL : lua_tostring(L,2), &status);
-    if (U_FAILURE(status)) {
-		free(new_ustring);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
+	UErrorCode status = U_ZERO_ERROR;
 
-	icu4lua_pushustring(L, new_ustring, new_uchar_len, USTRING_UV_META, USTRING_UV_POOL);
-    return 1;
+	if (ustring->fold_ref == LUA_REFNIL) {
+		lua_pushvalue(L, idx);
+		return ustring;
+	}
+	if (ustring->fold_ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ustring->fold_ref);
+		return icu4lua_toustringheader(L, -1);
+	}
+	if (idx < 0 && idx > LUA_REGISTRYINDEX) {
+		idx = lua_gettop(L) + idx + 1;
+	}
+
+	new_uchar_len = u_strFoldCase(new_ustring, USTRING_STACK_UCHARS, ustring->data, ustring->length,
+		U_FOLD_CASE_DEFAULT, &status);
+	if (status == U_BUFFER_OVERFLOW_ERROR) {
+		new_ustring = (UChar*)lua_newuserdata(L, sizeof(UChar) * new_uchar_len);
+		status = U_ZERO_ERROR;
+		u_strFoldCase(new_ustring, new_uchar_len, ustring->data, ustring->length, U_FOLD_CASE_DEFAULT, &status);
+	}
+	if (U_FAILURE(status)) {
+		lua_pushstring(L, u_errorName(status));
+		lua_error(L);
+	}
+	if (new_uchar_len == ustring->length && memcmp(new_ustring, ustring->data, sizeof(UChar) * new_uchar_len) == 0) {
+		if (new_ustring != stack_buffer) {
+			lua_pop(L,1);
+		}
+		ustring->fold_ref = LUA_REFNIL;
+		lua_pushvalue(L, idx);
+		return ustring;
+	}
+	ustring_intern(L, new_ustring, new_uchar_len, USTRING_UV_META, USTRING_UV_POOL);
+	if (new_ustring != stack_buffer) {
+		lua_remove(L,-2);
+	}
+	folded = icu4lua_toustringheader(L, -1);
+	folded->fold_ref = LUA_REFNIL;
+	lua_pushvalue(L,-1);
+	ustring->fold_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return folded;
+}
+
+// Compare two ustrings case-insensitively, in code unit order as u_strCaseCompare does
+static int ustring_casecompare(lua_State *L, int idx1, int idx2) {
+	icu4lua_UString* a = ustring_pushfold(L, idx1);
+	icu4lua_UString* b = ustring_pushfold(L, idx2);
+	int result = (a == b) ? 0 : u_strCompare(a->data, a->length, b->data, b->length, FALSE);
+	lua_pop(L,2);
+	return result;
+}
+
+// Hashing. Text is folded or normalized a chunk at a time, so the whole folded or normalized
+// form never has to be put together. Chunks end on a code point boundary for folding, which
+// works on each code point by itself, and on a normalization boundary for NFC.
+
+#define USTRING_HASH_CHUNK	256
+
+static const char* const ustring_hash_forms[] = {"none", "nfc", "fold", NULL};
+
+// The hash of a ustring's UChars. With the default seed, it is worked out once and kept.
+static uint32_t ustring_hashseeded(icu4lua_UString* ustring, uint32_t seed) {
+	if (seed != 0) {
+		return xxh32_uchars(ustring->data, ustring->length, seed);
+	}
+	if (!ustring->hash_valid) {
+		ustring->hash = ustring_hash(ustring->data, ustring->length);
+		ustring->hash_valid = 1;
+	}
+	return ustring->hash;
+}
+
+static void ustring_hashfolded(XXH32State* state, const UChar* ustr, int32_t ustr_len, UErrorCode* status) {
+	// Full case folding turns one UChar into at most three
+	UChar folded[(USTRING_HASH_CHUNK + 1) * 3];
+	int32_t pos, end, folded_len;
+	for (pos = 0; pos < ustr_len; pos = end) {
+		end = (ustr_len - pos > USTRING_HASH_CHUNK) ? pos + USTRING_HASH_CHUNK : ustr_len;
+		if (end < ustr_len && U16_IS_LEAD(ustr[end-1]) && U16_IS_TRAIL(ustr[end])) {
+			end++;
+		}
+		folded_len = u_strFoldCase(folded, sizeof(folded) / sizeof(UChar), ustr + pos, end - pos, U_FOLD_CASE_DEFAULT, status);
+		if (U_FAILURE(*status)) {
+			return;
+		}
+		xxh32_updateuchars(state, folded, folded_len);
+	}
+}
+
+static void ustring_hashnfc(XXH32State* state, const UChar* ustr, int32_t ustr_len, UErrorCode* status) {
+	const UNormalizer2* nfc = unorm2_getNFCInstance(status);
+	UChar stack_buffer[USTRING_HASH_CHUNK * 3];
+	UChar* normalized;
+	int32_t capacity, pos, end, normalized_len;
+	UChar32 c;
+
+	if (U_FAILURE(*status)) {
+		return;
+	}
+	// Most text is already in NFC, so hash as much as possible straight away
+	pos = unorm2_spanQuickCheckYes(nfc, ustr, ustr_len, status);
+	if (U_FAILURE(*status)) {
+		return;
+	}
+	xxh32_updateuchars(state, ustr, pos);
+	for (; pos < ustr_len; pos = end) {
+		end = (ustr_len - pos > USTRING_HASH_CHUNK) ? pos + USTRING_HASH_CHUNK : ustr_len;
+		while (end < ustr_len) {
+			U16_GET(ustr, 0, end, ustr_len, c);
+			if (U16_IS_TRAIL(ustr[end]) && end > 0 && U16_IS_LEAD(ustr[end-1])) {
+				end++;
+			}
+			else if (unorm2_hasBoundaryBefore(nfc, c)) {
+				break;
+			}
+			else {
+				U16_FWD_1(ustr, end, ustr_len);
+			}
+		}
+		// A very long run of combining marks may not fit in the stack buffer
+		capacity = (end - pos) * 3;
+		normalized = (capacity <= USTRING_HASH_CHUNK * 3) ? stack_buffer : (UChar*)malloc(sizeof(UChar) * capacity);
+		if (!normalized) {
+			*status = U_MEMORY_ALLOCATION_ERROR;
+			return;
+		}
+		if (normalized == stack_buffer) {
+			capacity = USTRING_HASH_CHUNK * 3;
+		}
+		normalized_len = unorm2_normalize(nfc, ustr + pos, end - pos, normalized, capacity, status);
+		if (U_SUCCESS(*status)) {
+			xxh32_updateuchars(state, normalized, normalized_len);
+		}
+		if (normalized != stack_buffer) {
+			free(normalized);
+		}
+		if (U_FAILURE(*status)) {
+			return;
+		}
+	}
+}
+
+static int icu_ustring_hash(lua_State *L) {
+	icu4lua_UString* ustring;
+	uint32_t seed;
+	uint32_t h;
+	XXH32State state;
+	UErrorCode status = U_ZERO_ERROR;
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	ustring = icu4lua_toustringheader(L,1);
+	seed = (uint32_t)luaL_optinteger(L,2,0);
+	switch (luaL_checkoption(L,3,"none",ustring_hash_forms)) {
+		case 1: // nfc
+			if (unorm2_spanQuickCheckYes(unorm2_getNFCInstance(&status), ustring->data, ustring->length, &status) == ustring->length
+					&& U_SUCCESS(status)) {
+				h = ustring_hashseeded(ustring, seed);
+				break;
+			}
+			status = U_ZERO_ERROR;
+			xxh32_reset(&state, seed);
+			ustring_hashnfc(&state, ustring->data, ustring->length, &status);
+			h = xxh32_digest(&state);
+			break;
+		case 2: // fold
+			if (ustring->fold_ref == LUA_REFNIL) {
+				h = ustring_hashseeded(ustring, seed);
+			}
+			else if (ustring->fold_ref != LUA_NOREF) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, ustring->fold_ref);
+				h = ustring_hashseeded(icu4lua_toustringheader(L,-1), seed);
+				lua_pop(L,1);
+			}
+			else {
+				xxh32_reset(&state, seed);
+				ustring_hashfolded(&state, ustring->data, ustring->length, &status);
+				h = xxh32_digest(&state);
+			}
+			break;
+		default:
+			h = ustring_hashseeded(ustring, seed);
+			break;
+	}
+	if (U_FAILURE(status)) {
+		lua_pushstring(L, u_errorName(status));
+		return lua_error(L);
+	}
+	lua_pushnumber(L, (lua_Number)h);
+	return 1;
+}
+
+static int icu_ustring_upper(lua_State *L) {
+	return ustring_mapcase(L, u_strToUpper, 1);
+}
+
+static int icu_ustring_lower(lua_State *L) {
+	return ustring_mapcase(L, u_strToLower, 0);
 }
 
 static int icu_ustring_codepoint(lua_State *L) {
-    UChar* ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
-    int32_t uchar_len = (int32_t)icu4lua_ustrlen(L,2);
-    UCharIterator iter;
-    int start_pos;
-    int end_pos;
-    int i;
-    UChar32 ch;
-    uint32_t end_ucharpos;
-
-    start_pos = luaL_optint(L,2,1);
-    end_pos = luaL_optint(L,3,start_pos);
+	icu4lua_UString* ustring;
+	int32_t cp_len;
+	int32_t start_pos;
+	int32_t end_pos;
+	int32_t offset;
+	int32_t i;
+	UChar32 ch;
 
-	lua_settop(L,1);
-	uiter_setString(&iter, ustring, uchar_len);
-
-    if (end_pos == 0) {
-        return 0;
-    }
-    else if (end_pos < 0) {
-        iter.move(&iter, 0, UITER_LIMIT);
-        for (i = 0; i > end_pos; i--) {
-            if (!iter.hasPrevious(&iter)) {
-                return 0;
-            }
-            iter.move(&iter, -1, UITER_CURRENT);
-        }
-    }
-    else {
-        iter.move(&iter, end_pos-1, UITER_START);
-    }
-    end_ucharpos = iter.getState(&iter);
-
-    if (start_pos < 0) {
-        iter.move(&iter, start_pos, UITER_LIMIT);
-    }
-    else {
-        iter.move(&iter, 0, UITER_START);
-        for (i = 1; i < start_pos; i++) {
-            if (!iter.hasNext(&iter)) {
-                return 0;
-            }
-            iter.move(&iter, 1, UITER_CURRENT);
-        }
-    }
-
-	while ((iter.getState(&iter)) <= end_ucharpos) {
-        ch = iter.next(&iter);
-        if (ch == U_SENTINEL) {
-            break;
-        }
-        luaL_checkstack(L,1,"error growing the stack");
-        lua_pushinteger(L,ch);
-    }
-    return lua_gettop(L)-1;
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	ustring = icu4lua_toustringheader(L,1);
+	cp_len = ustring_cplength(ustring);
+	start_pos = luaL_optint(L,2,1);
+	end_pos = luaL_optint(L,3,start_pos);
+
+	// Same rules as string.byte
+	if (start_pos < 0) {
+		start_pos += cp_len + 1;
+	}
+	if (end_pos < 0) {
+		end_pos += cp_len + 1;
+	}
+	if (start_pos < 1) {
+		start_pos = 1;
+	}
+	if (end_pos > cp_len) {
+		end_pos = cp_len;
+	}
+	if (start_pos > end_pos) {
+		return 0;
+	}
+
+	luaL_checkstack(L, end_pos - start_pos + 1, "string slice too long");
+	offset = ustring_cpoffset(ustring, start_pos - 1);
+	for (i = start_pos; i <= end_pos; i++) {
+		U16_NEXT(ustring->data, offset, ustring->length, ch);
+		lua_pushinteger(L, ch);
+	}
+	return end_pos - start_pos + 1;
 }
 
 static int icu_ustring_char(lua_State *L) {
@@ -403,82 +1428,127 @@ static int icu_ustring_char(lua_State *L) {
 	return 1;
 }
 
-static void ustring_pushrange(UMatchState* ms, uint32_t start_state, uint32_t end_state) {
-	icu4lua_pushustring(ms->L,
-		(const UChar*)(ms->context) + start_state,
-		(end_state - start_state),
+static void ustring_pushrange(UMatchState* ms, int32_t start, int32_t end) {
+	icu4lua_pushustringslice(ms->L, ms->source_idx,
+		start, (end - start),
 		USTRING_UV_META, USTRING_UV_POOL);
 }
 
-static int icu_ustring_match(lua_State *L) {
-	UCharIterator sourceIter;
+static int ustring_ispattern(lua_State *L, int arg) {
+	int is_pattern = 0;
+	if (lua_getmetatable(L,arg)) {
+		is_pattern = lua_rawequal(L,-1,USTRING_UV_PATTERN_META);
+		lua_pop(L,1);
+	}
+	return is_pattern;
+}
+
+// The limit set by icu.ustring.setmatchlimit
+static int32_t ustring_matchlimit(lua_State *L) {
+	return ((UStringPool*)lua_touserdata(L, USTRING_UV_POOL))->patterns.match_limit;
+}
+
+// Push the compiled form of the pattern at arg. That is either the value itself, or, if it is an
+// interned ustring, what the pool has cached for it (compiling it and adding it if needs be).
+// Transient ustrings are compiled each time, rather than pushing useful patterns out of the cache.
+static UPattern* ustring_pushpattern(lua_State *L, int arg) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	const icu4lua_UString* ustring;
 	UCharIterator pattIter;
+	UPattern* patt;
+
+	if (ustring_ispattern(L,arg)) {
+		lua_pushvalue(L,arg);
+		return (UPattern*)lua_touserdata(L,-1);
+	}
+	uiter_setString(&pattIter, icu4lua_checkustring(L,arg,USTRING_UV_META), (int32_t)icu4lua_ustrlen(L,arg));
+	ustring = icu4lua_toustringheader(L,arg);
+	if (ustring->pool_ref) {
+		patt = upattern_pushcached(L, &pool->patterns, ustring);
+		if (patt) {
+			return patt;
+		}
+	}
+	patt = upattern_compile(L, &pattIter);
+	lua_pushvalue(L, USTRING_UV_PATTERN_META);
+	lua_setmetatable(L,-2);
+	if (ustring->pool_ref) {
+		upattern_addcached(L, &pool->patterns, ustring, arg);
+	}
+	return patt;
+}
+
+static int icu_ustring_pattern(lua_State *L) {
+	ustring_pushpattern(L,1);
+	return 1;
+}
+
+static int icu_ustring_match(lua_State *L) {
 	const UChar* string_ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
-	const UChar* patt_ustring = icu4lua_checkustring(L,2,USTRING_UV_META);
 	UMatchState ms;
 	int init;
 
-	uiter_setString(&sourceIter, string_ustring, (int32_t)icu4lua_ustrlen(L,1));
-	uiter_setString(&pattIter, patt_ustring, (int32_t)icu4lua_ustrlen(L,2));
+	umatch_setsource(&ms, string_ustring, (int32_t)icu4lua_ustrlen(L,1));
 	init = luaL_optint(L,3,0);
 	ms.L = L;
+	umatch_setpattern(&ms, ustring_pushpattern(L,2), ustring_matchlimit(L));
 	ms.pushRange = ustring_pushrange;
-	ms.context = (void*)string_ustring;
+	ms.source_idx = 1;
+
+	return umatch_find_u16(&ms, init, 0);
+}
 
-	return iter_match(&ms, &pattIter, &sourceIter, init, 0);
+// A pattern with none of the special characters in it can only match itself
+static int ustring_isplainpattern(const UChar* patt, int32_t patt_len) {
+	int32_t i;
+	for (i = 0; i < patt_len; i++) {
+		if (patt[i] < 0x80 && patt[i] != 0 && strchr(SPECIALS, (char)patt[i])) {
+			return 0;
+		}
+	}
+	return 1;
 }
 
 static int icu_ustring_find(lua_State *L) {
 	UChar* source_ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
 	int32_t source_uchar_len = (int32_t)icu4lua_ustrlen(L,1);
-	UChar* patt_ustring = icu4lua_checkustring(L,2,USTRING_UV_META);
-	int32_t patt_uchar_len = (int32_t)icu4lua_ustrlen(L,2);
-	UCharIterator sourceIter, pattIter;
 	UMatchState ms;
-
-	if (lua_toboolean(L,4)) {
-		UErrorCode status;
-		int init = luaL_optint(L,3,0);
-		int offset = 0;
-		UChar* found;
-		uiter_setString(&sourceIter, source_ustring, source_uchar_len);
-		if (init) {
-			if (init < 0) {
-				sourceIter.move(&sourceIter, init, UITER_LIMIT);
+	int init = luaL_optint(L,3,0);
+
+	if (lua_toboolean(L,4) || !ustring_ispattern(L,2)) {
+		UChar* patt_ustring = icu4lua_checkustring(L,2,USTRING_UV_META);
+		int32_t patt_uchar_len = (int32_t)icu4lua_ustrlen(L,2);
+		if (lua_toboolean(L,4) || ustring_isplainpattern(patt_ustring, patt_uchar_len)) {
+			int32_t offset = 0;
+			const UChar* found;
+			if (init > 0) {
+				offset = (init - 1 < source_uchar_len) ? init - 1 : source_uchar_len;
 			}
-			else {
-				sourceIter.move(&sourceIter, init-1, UITER_ZERO);
+			else if (init < 0) {
+				offset = (-init < source_uchar_len) ? source_uchar_len + init : 0;
 			}
-			offset = uiter_getState(&sourceIter);
-		}
-		found = u_strFindFirst(source_ustring + offset, source_uchar_len - offset, patt_ustring, patt_uchar_len);
-		if (!found) {
-			lua_pushnil(L);
-			return 1;
+			found = search_uchars(source_ustring + offset, source_uchar_len - offset, patt_ustring, patt_uchar_len);
+			if (!found) {
+				lua_pushnil(L);
+				return 1;
+			}
+			lua_pushinteger(L, 1 + (found - source_ustring));
+			lua_pushinteger(L, (found - source_ustring) + patt_uchar_len);
+			return 2;
 		}
-
-		status = U_ZERO_ERROR;
-		uiter_setState(&sourceIter, (uint32_t)(found - source_ustring), &status);
-		lua_pushinteger(L, 1 + sourceIter.getIndex(&sourceIter, UITER_CURRENT));
-
-		status = U_ZERO_ERROR;
-		uiter_setState(&sourceIter, (uint32_t)((found + patt_uchar_len) - source_ustring), &status);
-		lua_pushinteger(L, sourceIter.getIndex(&sourceIter, UITER_CURRENT));
-
-		return 2;
 	}
 
-	uiter_setString(&sourceIter, source_ustring, source_uchar_len);
-	uiter_setString(&pattIter, patt_ustring, patt_uchar_len);
+	umatch_setsource(&ms, source_ustring, source_uchar_len);
 	ms.L = L;
+	umatch_setpattern(&ms, ustring_pushpattern(L,2), ustring_matchlimit(L));
 	ms.pushRange = ustring_pushrange;
-	ms.context = (void*)source_ustring;
+	ms.source_idx = 1;
 
-	return iter_match(&ms, &pattIter, &sourceIter, luaL_optint(L,3,0), 1);
+	return umatch_find_u16(&ms, init, 1);
 }
 
-static void ustring_addrange(UMatchState* ms, uint32_t start_state, uint32_t end_state) {
-	icu4lua_addustring(ms->b, (UChar*)ms->context + start_state, end_state - start_state);
+static void ustring_addrange(UMatchState* ms, int32_t start, int32_t end) {
+	icu4lua_addustring(ms->b, (UChar*)ms->context + start, end - start);
 }
 
 static void ustring_addmatch(UMatchState* ms) {
@@ -504,7 +1574,7 @@ static void ustring_addmatch(UMatchState* ms) {
 					c = uiter_current32(&replaceIter);
 					if (c == '0') {
 						uiter_next32(&replaceIter);
-						ms->addRange(ms, ms->capture[0].start_state, ms->end_state);
+						ms->addRange(ms, ms->start, ms->end);
 						start_state = uiter_getState(&replaceIter);
 					}
 					else if (isdigit(c)) {
@@ -512,7 +1582,7 @@ static void ustring_addmatch(UMatchState* ms) {
 						if (num >= ms->level) {
 							luaL_error(L, "invalid capture index");
 						}
-						ms->addRange(ms, ms->capture[num].start_state, ms->capture[num].end_state);
+						ms->addRange(ms, ms->capture[num].start, ms->capture[num].end);
 						uiter_next32(&replaceIter);
 						start_state = uiter_getState(&replaceIter);
 					}
@@ -527,20 +1597,20 @@ static void ustring_addmatch(UMatchState* ms) {
 		case LUA_TFUNCTION:
 			if (ms->level == 0) {
 				lua_pushvalue(L, 3);
-				ms->pushRange(ms, ms->capture[0].start_state, ms->end_state);
+				ms->pushRange(ms, ms->start, ms->end);
 				lua_call(L,1,1);
 			}
 			else {
 				int i;
 				lua_pushvalue(L, 3);
 				for (i = 0; i < ms->level; i++) {
-					ms->pushRange(ms, ms->capture[i].start_state, ms->capture[i].end_state);
+					ms->pushRange(ms, ms->capture[i].start, ms->capture[i].end);
 				}
 				lua_call(L,ms->level,1);
 			}
 			break;
-		case LUA_TTABLE:
-			ms->pushRange(ms, ms->capture[0].start_state, ms->end_state);
+		case LUA_TTABLE: // keyed by the first capture (the whole match, if there are none)
+			ms->pushRange(ms, ms->capture[0].start, ms->capture[0].end);
 			lua_gettable(L,3);
 			break;
 		default:
@@ -549,25 +1619,21 @@ static void ustring_addmatch(UMatchState* ms) {
 	}
 	if (!lua_toboolean(L,-1)) {
 		lua_pop(L,1);
-		ms->addRange(ms, ms->capture[0].start_state, ms->end_state);
+		ms->addRange(ms, ms->start, ms->end);
 	}
 	else {
 		if (!(lua_getmetatable(L,-1) && lua_rawequal(L,-1,USTRING_UV_META))) {
 			luaL_error(L, "replacement function/table must either yield a ustring or nil/false");
 		}
 		lua_pop(L,1);
-		luaL_addlstring(b, (const char*)lua_touserdata(L,-1), lua_objlen(L,-1));
+		icu4lua_addustring(b, icu4lua_trustustring(L,-1), icu4lua_ustrlen(L,-1));
 		lua_pop(L,1);
 	}
 }
 
 static int icu_ustring_gsub(lua_State *L) {
-	UCharIterator sourceIter;
-	UCharIterator pattIter;
 	UChar* string_ustring = icu4lua_checkustring(L,1,USTRING_UV_META);
-	UChar* patt_ustring = icu4lua_checkustring(L,2,USTRING_UV_META);
 	size_t string_uchar_len = icu4lua_ustrlen(L,1);
-	size_t patt_uchar_len = icu4lua_ustrlen(L,2);
 	UMatchState ms;
 	int max_s;
 	int replacements;
@@ -579,18 +1645,19 @@ static int icu_ustring_gsub(lua_State *L) {
 
 	max_s = luaL_optint(L, 4, string_uchar_len+1);
 
-	uiter_setString(&sourceIter, string_ustring, (int32_t)string_uchar_len);
-	uiter_setString(&pattIter, patt_ustring, (int32_t)patt_uchar_len);
+	umatch_setsource(&ms, string_ustring, (int32_t)string_uchar_len);
 
+	lua_settop(L, 4); // the compiled pattern (and any frames) go above the replacement and count
 	ms.L = L;
-	ms.context = (void*)string_ustring;
+	umatch_setpattern(&ms, ustring_pushpattern(L,2), ustring_matchlimit(L));
 	ms.b = &b;
 	ms.pushRange = ustring_pushrange;
+	ms.source_idx = 1;
 	ms.addRange = ustring_addrange;
 
 	luaL_buffinit(L, &b);
 
-	replacements = uiter_gsub_aux(&ms, &pattIter, &sourceIter, ustring_addmatch, max_s);
+	replacements = umatch_gsub_u16(&ms, ustring_addmatch, max_s);
 
 	icu4lua_pushuresult(&b, USTRING_UV_META, USTRING_UV_POOL);
 
@@ -600,10 +1667,13 @@ static int icu_ustring_gsub(lua_State *L) {
 
 static int icu_ustring_gmatch(lua_State *L) {
 	UChar* source_ustring = icu4lua_checkustring(L, 1, USTRING_UV_META);
-	UChar* patt_ustring = icu4lua_checkustring(L, 2, USTRING_UV_META);
 	size_t source_uchar_len = icu4lua_ustrlen(L, 1);
-	size_t patt_uchar_len = icu4lua_ustrlen(L, 2);
+	UPattern* patt;
 	GmatchState* gms;
+	int upvalues = 5;
+	patt = ustring_pushpattern(L, 2);
+	lua_replace(L, 2);
+	lua_settop(L, 2);
 	lua_pushvalue(L, USTRING_UV_META);
 	lua_insert(L,1);
 	lua_pushvalue(L, USTRING_UV_POOL);
@@ -611,24 +1681,24 @@ static int icu_ustring_gmatch(lua_State *L) {
 	gms = (GmatchState*)lua_newuserdata(L, sizeof(GmatchState));
 	lua_insert(L,3);
 	// [meta] [pool] [gms] [source] [patt]
-	gms->matched_empty_end = 0;
+	gms->position = 0;
 	gms->ms.L = L;
 	gms->ms.pushRange = ustring_pushrange;
-	gms->ms.context = (void*)source_ustring;
-	uiter_setString(&(gms->sourceIter), source_ustring, (int32_t)source_uchar_len);
-	uiter_setString(&(gms->pattIter), patt_ustring, (int32_t)patt_uchar_len);
-	gms->source_state = uiter_getState(&(gms->sourceIter));
-	lua_pushcclosure(L, gmatch_aux, 5);
+	gms->ms.source_idx = lua_upvalueindex(4); // only used from inside umatch_gmatch_aux_u16
+	umatch_setsource(&gms->ms, source_ustring, (int32_t)source_uchar_len);
+	upvalues += umatch_setpattern(&gms->ms, patt, ustring_matchlimit(L)); // [frames]
+	lua_pushcclosure(L, umatch_gmatch_aux_u16, upvalues);
 	return 1;
 }
 
 static int icu_ustring_tconcat(lua_State *L) {
-	luaL_Buffer b;
-	int i;
+	int i, n;
 	UChar* join;
 	int32_t join_len;
+	int32_t total_len = 0;
+	int32_t element_len;
+	UChar* target;
 	luaL_checktype(L, 1, LUA_TTABLE);
-	luaL_buffinit(L, &b);
 	if (lua_isnoneornil(L,2)) {
 		join = NULL;
 		join_len = 0;
@@ -637,312 +1707,1632 @@ static int icu_ustring_tconcat(lua_State *L) {
 		join = icu4lua_checkustring(L,2,USTRING_UV_META);
 		join_len = (int32_t)icu4lua_ustrlen(L,2);
 	}
+	lua_settop(L,2);
+
+	// Check the elements and add up the length first, so the result is only allocated once
 	for (i=1;;i++) {
-		lua_pushinteger(L,i);
-		lua_gettable(L,1);
+		lua_rawgeti(L,1,i);
 		if (lua_isnil(L,-1)) {
+			lua_pop(L,1);
 			break;
 		}
-		if (join && i > 1) {
-			icu4lua_addustring(&b, join, join_len);
+		if (!(lua_getmetatable(L,-1) && lua_rawequal(L,-1,USTRING_UV_META) && (lua_pop(L,1),1))) {
+			return luaL_argerror(L, 1, "all elements must be ustrings");
+		}
+		element_len = (int32_t)icu4lua_ustrlen(L,-1) + ((i > 1) ? join_len : 0);
+		if (element_len > INT32_MAX - total_len) {
+			return luaL_error(L, "resulting ustring is too long");
+		}
+		total_len += element_len;
+		lua_pop(L,1);
+	}
+	n = i - 1;
+	if (n == 1) {
+		lua_rawgeti(L,1,1);
+		return 1;
+	}
+
+	target = (UChar*)(ustring_allocuserdata(L, total_len, USTRING_UV_META) + 1);
+	for (i=1; i<=n; i++) {
+		if (join && i > 1) {
+			memcpy(target, join, sizeof(UChar) * join_len);
+			target += join_len;
+		}
+		lua_rawgeti(L,1,i);
+		element_len = (int32_t)icu4lua_ustrlen(L,-1);
+		memcpy(target, icu4lua_trustustring(L,-1), sizeof(UChar) * element_len);
+		target += element_len;
+		lua_pop(L,1);
+	}
+	ustring_internnew(L, USTRING_UV_POOL);
+	return 1;
+}
+
+static int icu_ustring_toraw(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	icu4lua_pushrawustring(L,1);
+	return 1;
+}
+
+static int icu_ustring_fromraw(lua_State *L) {
+	luaL_checktype(L,1,LUA_TSTRING);
+	luaL_argcheck(L, 0 == (lua_objlen(L,1) % sizeof(UChar)), 1, "invalid length for a raw ustring");
+	lua_settop(L,1);
+	icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
+	return 1;
+}
+
+static int icu_ustring_lib__call(lua_State *L) {
+	lua_remove(L,1);
+	return icu_ustring_decode(L);
+}
+
+static int icu_ustring__concat(lua_State *L) {
+	if (!lua_getmetatable(L,1) || !lua_getmetatable(L,2) || !lua_rawequal(L,-2,-1)) {
+		return luaL_error(L, "ustrings can only be concatenated to other ustrings");
+	}
+	icu4lua_pushrawustring(L, 1);
+	icu4lua_pushrawustring(L, 2);
+	lua_concat(L,2);
+	icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
+	return 1;
+}
+
+static int icu_ustring__eq(lua_State *L) {
+	// Lua only calls this for two userdata that share the same __eq, so both must be ustrings
+	lua_pushboolean(L, ustring_equal(icu4lua_toustringheader(L,1), icu4lua_toustringheader(L,2)));
+	return 1;
+}
+
+static int icu_ustring__lt(lua_State *L) {
+	if (!lua_getmetatable(L,1) || !lua_getmetatable(L,2) || !lua_rawequal(L,-2,-1)) {
+		return luaL_error(L, "ustrings can only be compared to other ustrings");
+	}
+	lua_pushboolean(L, u_strCompare(
+		icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
+		icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
+		TRUE
+	) < 0);
+	return 1;
+}
+
+static int icu_ustring__le(lua_State *L) {
+	if (!lua_getmetatable(L,1) || !lua_getmetatable(L,2) || !lua_rawequal(L,-2,-1)) {
+		return luaL_error(L, "ustrings can only be compared to other ustrings");
+	}
+	lua_pushboolean(L, u_strCompare(
+		icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
+		icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
+		TRUE
+	) <= 0);
+	return 1;
+}
+
+static int icu_ustring_fold(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	ustring_pushfold(L,1);
+	return 1;
+}
+
+static int icu_ustring_isustring(lua_State *L) {
+	lua_pushboolean(L, lua_getmetatable(L,1) && lua_rawequal(L,-1,USTRING_UV_META));
+	return 1;
+}
+
+static int icu_ustring_lessthan(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	icu4lua_checkustring(L,2,USTRING_UV_META);
+	if (lua_isboolean(L,3)) {
+		lua_pushboolean(L, ustring_casecompare(L,1,2) < 0);
+	}
+	else {
+		lua_pushboolean(L, u_strCompare(
+			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
+			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
+			TRUE
+		) < 0);
+	}
+	return 1;
+}
+
+static int icu_ustring_lessorequal(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	icu4lua_checkustring(L,2,USTRING_UV_META);
+	if (lua_isboolean(L,3)) {
+		lua_pushboolean(L, ustring_casecompare(L,1,2) <= 0);
+	}
+	else {
+		lua_pushboolean(L, u_strCompare(
+			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
+			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
+			TRUE
+		) <= 0);
+	}
+	return 1;
+}
+
+static int icu_ustring_equals(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	icu4lua_checkustring(L,2,USTRING_UV_META);
+	if (lua_toboolean(L,3)) {
+		lua_pushboolean(L, ustring_casecompare(L,1,2) == 0);
+	}
+	else {
+		lua_pushboolean(L, ustring_equal(icu4lua_toustringheader(L,1), icu4lua_toustringheader(L,2)));
+	}
+	return 1;
+}
+
+static uint32_t uiter_scanformat(lua_State *L, uint32_t start_state, UCharIterator* pFrmtIter, const UChar* ustrfrmt, UChar *form) {
+	uint32_t end_state;
+	int flag_count = 0;
+	while (strchr(FLAGS, uiter_current32(pFrmtIter))) {
+		uiter_next32(pFrmtIter);
+		if (++flag_count >= (int)sizeof(FLAGS)) {
+			luaL_error(L, "invalid format (repeated flags)");
+		}
+	}
+	if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // skip width
+	if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // (2 digits at most)
+	if (uiter_current32(pFrmtIter) == '.') {
+		uiter_next32(pFrmtIter);
+		if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // skip precision
+		if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // (2 digits at most)
+	}
+	if (isdigit(uiter_current32(pFrmtIter))) {
+		luaL_error(L, "invalid format (width or precision too long)");
+	}
+	uiter_next32(pFrmtIter);
+	end_state = uiter_getState(pFrmtIter);
+	u_memcpy(form, ustrfrmt + start_state, end_state - start_state);
+	form[end_state - start_state] = '\0';
+	return end_state;
+}
+
+// Converted items are written to a sink, which is scratch space kept until the whole format has
+// gone through without an error. The scratch space starts out on the C stack, and moves to a
+// userdata at scratch_idx if it needs to be any bigger
+
+#define USTRING_FORMAT_SCRATCH	256
+
+typedef struct UStringSink {
+	UChar* scratch;
+	int32_t length; // in UChars
+	int32_t capacity;
+	int scratch_idx;
+} UStringSink;
+
+// Start a sink off in local_scratch, pushing a slot for the userdata it may move to
+static void ustring_sinkinit(lua_State *L, UStringSink* sink, UChar* local_scratch) {
+	lua_pushnil(L);
+	sink->scratch = local_scratch;
+	sink->length = 0;
+	sink->capacity = USTRING_FORMAT_SCRATCH;
+	sink->scratch_idx = lua_gettop(L);
+}
+
+static void ustring_sinkadd(lua_State *L, UStringSink* sink, const UChar* ustr, int32_t ustr_len) {
+	int32_t new_capacity;
+	UChar* new_scratch;
+	if (ustr_len > INT32_MAX - sink->length) {
+		luaL_error(L, "resulting ustring is too long");
+	}
+	if (sink->length + ustr_len > sink->capacity) {
+		new_capacity = sink->capacity;
+		while (new_capacity < sink->length + ustr_len) {
+			new_capacity = (new_capacity > INT32_MAX / 2) ? INT32_MAX : new_capacity * 2;
+		}
+		new_scratch = (UChar*)lua_newuserdata(L, sizeof(UChar) * new_capacity);
+		memcpy(new_scratch, sink->scratch, sizeof(UChar) * sink->length);
+		lua_replace(L, sink->scratch_idx);
+		sink->scratch = new_scratch;
+		sink->capacity = new_capacity;
+	}
+	memcpy(sink->scratch + sink->length, ustr, sizeof(UChar) * ustr_len);
+	sink->length += ustr_len;
+}
+
+static void addquoted(lua_State *L, UStringSink* sink, int arg) {
+	UChar* s = icu4lua_checkustring(L,arg,USTRING_UV_META);
+	int32_t l = (int32_t)icu4lua_ustrlen(L,arg);
+	int32_t i, run_start;
+	static const UChar quote = '"';
+	static const UChar escaped_zero[4] = {'\\', '0', '0', '0'};
+	ustring_sinkadd(L, sink, &quote, 1);
+	for (i = run_start = 0; i < l; i++) {
+		switch (s[i]) {
+			case '"': case '\\': case '\n': {
+				ustring_sinkadd(L, sink, s + run_start, i - run_start);
+				ustring_sinkadd(L, sink, escaped_zero, 1);
+				run_start = i;
+				break;
+			}
+			case '\0': {
+				ustring_sinkadd(L, sink, s + run_start, i - run_start);
+				ustring_sinkadd(L, sink, escaped_zero, 4);
+				run_start = i + 1;
+				break;
+			}
+		}
+	}
+	ustring_sinkadd(L, sink, s + run_start, l - run_start);
+	ustring_sinkadd(L, sink, &quote, 1);
+}
+
+#define U_LUA_INTFRMLEN_LENGTH 1
+U_STRING_DECL(U_LUA_INTFRMLEN, "l", 1);
+
+static void addintlen(UChar* form) {
+	size_t l = u_strlen(form);
+	UChar spec = form[l - 1];
+	u_strcpy(form + l - 1, U_LUA_INTFRMLEN);
+	form[l + U_LUA_INTFRMLEN_LENGTH - 2] = spec;
+	form[l + U_LUA_INTFRMLEN_LENGTH - 1] = '\0';
+}
+
+// A compiled format is a userdata holding a format ustring already split up into literal runs
+// and conversions, so that using it again does not mean scanning it again. The literal runs
+// (with "%%" already reduced to "%") are copied in after the items, so it stands on its own.
+// Conversions that u_sprintf_u would give plain output for are formatted directly.
+
+typedef struct UStringFormatItem {
+	int32_t literal_start; // the literal run that comes before the conversion
+	int32_t literal_length;
+	UChar32 conversion; // 0 for the last item, which is only a literal run
+	int direct; // formatted here, rather than by u_sprintf_u
+	int left_justify;
+	int width;
+	int precision; // -1 if not given
+	UChar form[MAX_FORMAT]; // for u_sprintf_u
+} UStringFormatItem;
+
+typedef struct UStringFormat {
+	UChar* literals;
+	int item_count;
+	UStringFormatItem items[1];
+} UStringFormat;
+
+// Work out how an item will be formatted from its form, once the form has been scanned
+static void ustring_prepareformatitem(lua_State *L, UStringFormatItem* item) {
+	const UChar* p = item->form + 1;
+	int plain_flags = 1; // no flags other than "-"
+	item->left_justify = 0;
+	item->width = 0;
+	item->precision = -1;
+	for (; *p && *p < 0x80 && strchr(FLAGS, (char)*p); p++) {
+		if (*p == '-') {
+			item->left_justify = 1;
+		}
+		else {
+			plain_flags = 0;
+		}
+	}
+	for (; *p >= '0' && *p <= '9'; p++) {
+		item->width = item->width * 10 + (*p - '0');
+	}
+	if (*p == '.') {
+		item->precision = 0;
+		for (p++; *p >= '0' && *p <= '9'; p++) {
+			item->precision = item->precision * 10 + (*p - '0');
+		}
+	}
+	switch (item->conversion) {
+		case 'c':
+			item->direct = (item->form[2] == '\0');
+			item->form[1] = 'C';
+			break;
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			item->direct = plain_flags && (item->precision == -1);
+			addintlen(item->form);
+			break;
+		case 'f':
+			item->direct = plain_flags;
+			break;
+		case 'e': case 'E': case 'g': case 'G':
+			item->direct = 0;
+			break;
+		case 'q': case 's':
+			item->direct = 1;
+			break;
+		default:
+			luaL_error(L, "invalid option to " LUA_QL("format"));
+	}
+}
+
+// Push a new compiled format for the format ustring at arg
+static UStringFormat* ustring_compileformat(lua_State *L, int arg) {
+	UChar* ustrfrmt = icu4lua_checkustring(L,arg,USTRING_UV_META);
+	int32_t ustrfrmt_len = (int32_t)icu4lua_ustrlen(L,arg);
+	int32_t i, literals_len;
+	int max_items;
+	UStringFormat* format;
+	UStringFormatItem* item;
+	UCharIterator frmtIter;
+	uint32_t start_state, end_state;
+	UChar32 c;
+
+	// Every conversion starts with an escape, so this is enough items
+	for (i = 0, max_items = 1; i < ustrfrmt_len; i++) {
+		if (ustrfrmt[i] == L_ESC) {
+			max_items++;
+		}
+	}
+	format = (UStringFormat*)lua_newuserdata(L,
+		sizeof(UStringFormat) + (max_items - 1) * sizeof(UStringFormatItem) + ustrfrmt_len * sizeof(UChar));
+	format->literals = (UChar*)(format->items + max_items);
+	lua_pushvalue(L, USTRING_UV_FORMAT_META);
+	lua_setmetatable(L,-2);
+
+	item = format->items;
+	item->literal_start = literals_len = 0;
+	uiter_setString(&frmtIter, ustrfrmt, ustrfrmt_len);
+	start_state = uiter_getState(&frmtIter);
+	for (c = uiter_next32(&frmtIter); c != U_SENTINEL; c = uiter_next32(&frmtIter)) {
+		if (c == L_ESC) {
+			uiter_previous32(&frmtIter);
+			end_state = uiter_getState(&frmtIter);
+			uiter_next32(&frmtIter);
+			u_memcpy(format->literals + literals_len, ustrfrmt + start_state, end_state - start_state);
+			literals_len += end_state - start_state;
+
+			c = uiter_current32(&frmtIter);
+			if (c == L_ESC) {
+				start_state = uiter_getState(&frmtIter);
+				uiter_next32(&frmtIter);
+			}
+			else {
+				start_state = uiter_scanformat(L, end_state, &frmtIter, ustrfrmt, item->form);
+				uiter_previous32(&frmtIter);
+				item->conversion = uiter_next32(&frmtIter);
+				item->literal_length = literals_len - item->literal_start;
+				ustring_prepareformatitem(L, item);
+				item++;
+				item->literal_start = literals_len;
+			}
+		}
+	}
+	u_memcpy(format->literals + literals_len, ustrfrmt + start_state, ustrfrmt_len - start_state);
+	literals_len += ustrfrmt_len - start_state;
+	item->literal_length = literals_len - item->literal_start;
+	item->conversion = 0;
+	format->item_count = (int)(item - format->items) + 1;
+	return format;
+}
+
+// Push the compiled form of the format at arg. That is either the value itself, or, if it is an
+// interned ustring, what the pool has cached for it (compiling it and adding it if needs be).
+// Transient ustrings are compiled each time, rather than pushing useful formats out of the cache.
+static UStringFormat* ustring_pushformat(lua_State *L, int arg) {
+	UStringPool* pool;
+	const icu4lua_UString* ustring;
+	UStringFormat* format;
+	int i, ustring_ref, format_ref;
+
+	if (lua_getmetatable(L,arg)) {
+		if (lua_rawequal(L,-1,USTRING_UV_FORMAT_META)) {
+			lua_pop(L,1);
+			lua_pushvalue(L,arg);
+			return (UStringFormat*)lua_touserdata(L,-1);
+		}
+		lua_pop(L,1);
+	}
+	icu4lua_checkustring(L,arg,USTRING_UV_META);
+	ustring = icu4lua_toustringheader(L,arg);
+	if (!ustring->pool_ref) {
+		return ustring_compileformat(L,arg);
+	}
+	pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	for (i = 0; i < pool->format_count; i++) {
+		if (pool->formats[i].ustring == ustring) {
+			format_ref = pool->formats[i].format_ref;
+			ustring_ref = pool->formats[i].ustring_ref;
+			memmove(pool->formats + 1, pool->formats, i * sizeof(pool->formats[0]));
+			pool->formats[0].ustring = ustring;
+			pool->formats[0].ustring_ref = ustring_ref;
+			pool->formats[0].format_ref = format_ref;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, format_ref);
+			return (UStringFormat*)lua_touserdata(L,-1);
+		}
+	}
+	format = ustring_compileformat(L,arg);
+	lua_pushvalue(L,arg);
+	ustring_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L,-1);
+	format_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (pool->format_count == USTRING_FORMAT_CACHE_SIZE) {
+		pool->format_count--;
+		luaL_unref(L, LUA_REGISTRYINDEX, pool->formats[pool->format_count].ustring_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, pool->formats[pool->format_count].format_ref);
+	}
+	memmove(pool->formats + 1, pool->formats, pool->format_count * sizeof(pool->formats[0]));
+	pool->formats[0].ustring = ustring;
+	pool->formats[0].ustring_ref = ustring_ref;
+	pool->formats[0].format_ref = format_ref;
+	pool->format_count++;
+	return format;
+}
+
+// Write the digits of n backwards, ending just before end, and return how many there are
+static int32_t ustring_formatdigits(UChar* end, uint32_t n, uint32_t base, const char* digits) {
+	UChar* p = end;
+	do {
+		*--p = digits[n % base];
+		n /= base;
+	} while (n != 0);
+	return (int32_t)(end - p);
+}
+
+// Integers go through the "l" length modifier, which u_sprintf_u takes as 32 bits wide
+static int32_t ustring_formatinteger(UChar* buff, UChar32 conversion, lua_Number n) {
+	UChar digits[16];
+	UChar* end = digits + sizeof(digits)/sizeof(UChar);
+	int32_t digits_len, len = 0;
+	uint32_t u;
+	switch (conversion) {
+		case 'd': case 'i': {
+			int32_t value = (int32_t)(LUA_INTFRM_T)n;
+			if (value < 0) {
+				buff[len++] = '-';
+				u = 0u - (uint32_t)value;
+			}
+			else {
+				u = (uint32_t)value;
+			}
+			digits_len = ustring_formatdigits(end, u, 10, "0123456789");
+			break;
+		}
+		case 'o':
+			digits_len = ustring_formatdigits(end, (uint32_t)(unsigned LUA_INTFRM_T)n, 8, "01234567");
+			break;
+		case 'x':
+			digits_len = ustring_formatdigits(end, (uint32_t)(unsigned LUA_INTFRM_T)n, 16, "0123456789abcdef");
+			break;
+		case 'X':
+			digits_len = ustring_formatdigits(end, (uint32_t)(unsigned LUA_INTFRM_T)n, 16, "0123456789ABCDEF");
+			break;
+		default: // 'u'
+			digits_len = ustring_formatdigits(end, (uint32_t)(unsigned LUA_INTFRM_T)n, 10, "0123456789");
+			break;
+	}
+	u_memcpy(buff + len, end - digits_len, digits_len);
+	return len + digits_len;
+}
+
+#define USTRING_FIXED_LIMIT	1e15
+
+// u_sprintf_u formats "%f" by taking the shortest decimal that reads back as the same double and
+// rounding that, half to even, to the precision. This does the same, getting the shortest digits
+// from sprintf by trying 15, 16 and then 17 significant digits. Returns -1 for values it leaves
+// to u_sprintf_u (infinities, NaN and anything large).
+static int32_t ustring_formatfixed(UChar* buff, double n, int precision) {
+	char temp[32];
+	char digits[20];
+	int digits_len, significant, exponent, keep, i;
+	int32_t len = 0;
+	const char* p;
+	if (!(n > -USTRING_FIXED_LIMIT && n < USTRING_FIXED_LIMIT)) {
+		return -1;
+	}
+	if (n < 0 || (n == 0 && 1/n < 0)) {
+		buff[len++] = '-';
+		n = -n;
+	}
+	for (significant = 15; significant < 17; significant++) {
+		sprintf(temp, "%.*e", significant - 1, n);
+		if (strtod(temp, NULL) == n) {
+			break;
+		}
+	}
+	if (significant == 17) {
+		sprintf(temp, "%.*e", significant - 1, n);
+	}
+	// Pick the digits out, whatever the decimal point is in the current locale
+	for (p = temp, digits_len = 0; *p != 'e'; p++) {
+		if (*p >= '0' && *p <= '9') {
+			digits[digits_len++] = *p;
+		}
+	}
+	exponent = atoi(p + 1);
+	while (digits_len > 1 && digits[digits_len - 1] == '0') {
+		digits_len--;
+	}
+	if (digits_len == 1 && digits[0] == '0') {
+		digits_len = 0;
+	}
+	// Round to the precision: digit i is worth 10^(exponent - i)
+	keep = exponent + precision + 1;
+	if (keep < 0) {
+		digits_len = 0;
+	}
+	else if (keep < digits_len) {
+		int round_up = (digits[keep] > '5') || (digits[keep] == '5' &&
+			((keep + 1 < digits_len) || (keep > 0 && ((digits[keep - 1] - '0') & 1))));
+		digits_len = keep;
+		if (round_up) {
+			for (i = keep - 1; i >= 0 && digits[i] == '9'; i--) {
+				digits[i] = '0';
+			}
+			if (i >= 0) {
+				digits[i]++;
+			}
+			else {
+				memmove(digits + 1, digits, digits_len);
+				digits[0] = '1';
+				digits_len++;
+				exponent++;
+			}
+		}
+	}
+	// Integer part, then the fraction
+	if (exponent < 0) {
+		buff[len++] = '0';
+	}
+	else {
+		for (i = 0; i <= exponent; i++) {
+			buff[len++] = (i < digits_len) ? digits[i] : '0';
+		}
+	}
+	if (precision > 0) {
+		buff[len++] = '.';
+		for (i = exponent + 1; i <= exponent + precision; i++) {
+			buff[len++] = (i >= 0 && i < digits_len) ? digits[i] : '0';
+		}
+	}
+	return len;
+}
+
+// Add one directly formatted item, padded out to its width
+static void ustring_sinkaddpadded(lua_State *L, UStringSink* sink, const UStringFormatItem* item, const UChar* buff, int32_t len) {
+	static const UChar spaces[16] = {' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '};
+	int32_t padding = item->width - len;
+	if (item->left_justify) {
+		ustring_sinkadd(L, sink, buff, len);
+	}
+	for (; padding > 0; padding -= 16) {
+		ustring_sinkadd(L, sink, spaces, (padding < 16) ? padding : 16);
+	}
+	if (!item->left_justify) {
+		ustring_sinkadd(L, sink, buff, len);
+	}
+}
+
+static void ustring_addformatitem(lua_State *L, UStringSink* sink, const UStringFormatItem* item, int arg) {
+	UChar buff[MAX_ITEM];  /* to store the formatted item */
+	int32_t len;
+	switch (item->conversion) {
+		case 'c':
+			if (item->direct) {
+				buff[0] = (UChar)(int)luaL_checknumber(L, arg);
+				ustring_sinkadd(L, sink, buff, buff[0] ? 1 : 0);
+				return;
+			}
+			u_sprintf_u(buff, item->form, (int)luaL_checknumber(L, arg));
+			break;
+		case 'd': case 'i':
+			if (item->direct) {
+				len = ustring_formatinteger(buff, item->conversion, luaL_checknumber(L, arg));
+				ustring_sinkaddpadded(L, sink, item, buff, len);
+				return;
+			}
+			u_sprintf_u(buff, item->form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
+			break;
+		case 'o': case 'u': case 'x': case 'X':
+			if (item->direct) {
+				len = ustring_formatinteger(buff, item->conversion, luaL_checknumber(L, arg));
+				ustring_sinkaddpadded(L, sink, item, buff, len);
+				return;
+			}
+			u_sprintf_u(buff, item->form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
+			break;
+		case 'f':
+			if (item->direct) {
+				len = ustring_formatfixed(buff, (double)luaL_checknumber(L, arg),
+					(item->precision == -1) ? 6 : item->precision);
+				if (len != -1) {
+					ustring_sinkaddpadded(L, sink, item, buff, len);
+					return;
+				}
+			}
+			u_sprintf_u(buff, item->form, (double)luaL_checknumber(L, arg));
+			break;
+		case 'e': case 'E': case 'g': case 'G':
+			u_sprintf_u(buff, item->form, (double)luaL_checknumber(L, arg));
+			break;
+		case 'q':
+			addquoted(L, sink, arg);
+			return;
+		default: { // 's'
+			icu4lua_checkustring(L,arg,USTRING_UV_META);
+			ustring_sinkadd(L, sink, icu4lua_trustustring(L,arg), (int32_t)icu4lua_ustrlen(L,arg));
+			return;
+		}
+	}
+	ustring_sinkadd(L, sink, buff, u_strlen(buff));
+}
+
+// Add the result of formatting the arguments after arg with a compiled format
+static void ustring_applyformat(lua_State *L, UStringSink* sink, const UStringFormat* format, int arg) {
+	const UStringFormatItem* item;
+	for (item = format->items; ; item++) {
+		ustring_sinkadd(L, sink, format->literals + item->literal_start, item->literal_length);
+		if (!item->conversion) {
+			break;
+		}
+		ustring_addformatitem(L, sink, item, ++arg);
+	}
+}
+
+static int32_t ustring_addlength(lua_State *L, int32_t length, int32_t extra) {
+	if (extra > INT32_MAX - length) {
+		luaL_error(L, "resulting ustring is too long");
+	}
+	return length + extra;
+}
+
+// The literal runs and %s ustrings are only measured at first, and everything else is converted
+// into the scratch space, each item after its length (in two UChars). Then it is all copied
+// into the result once that has been allocated, so no item is converted more than once
+static int icu_ustring_format(lua_State *L) {
+	UStringFormat* format = ustring_pushformat(L,1);
+	const UStringFormatItem* item;
+	UChar local_scratch[USTRING_FORMAT_SCRATCH];
+	static const UChar no_length[2] = {0, 0};
+	UStringSink sink;
+	UChar* target;
+	const UChar* converted;
+	int32_t length = 0, item_length, start;
+	int arg;
+	ustring_sinkinit(L, &sink, local_scratch);
+	for (item = format->items, arg = 1; ; item++) {
+		length = ustring_addlength(L, length, item->literal_length);
+		if (!item->conversion) {
+			break;
+		}
+		arg++;
+		if (item->conversion == 's') {
+			icu4lua_checkustring(L,arg,USTRING_UV_META);
+			length = ustring_addlength(L, length, (int32_t)icu4lua_ustrlen(L,arg));
+			continue;
+		}
+		start = sink.length;
+		ustring_sinkadd(L, &sink, no_length, 2); // room for the length
+		ustring_addformatitem(L, &sink, item, arg);
+		item_length = sink.length - start - 2;
+		sink.scratch[start] = (UChar)(item_length >> 16);
+		sink.scratch[start + 1] = (UChar)(item_length & 0xffff);
+		length = ustring_addlength(L, length, item_length);
+	}
+	target = (UChar*)(ustring_allocuserdata(L, length, USTRING_UV_META) + 1);
+	converted = sink.scratch;
+	for (item = format->items, arg = 1; ; item++) {
+		memcpy(target, format->literals + item->literal_start, sizeof(UChar) * item->literal_length);
+		target += item->literal_length;
+		if (!item->conversion) {
+			break;
+		}
+		arg++;
+		if (item->conversion == 's') {
+			item_length = (int32_t)icu4lua_ustrlen(L,arg);
+			memcpy(target, icu4lua_trustustring(L,arg), sizeof(UChar) * item_length);
+		}
+		else {
+			item_length = ((int32_t)converted[0] << 16) | converted[1];
+			memcpy(target, converted + 2, sizeof(UChar) * item_length);
+			converted += 2 + item_length;
+		}
+		target += item_length;
+	}
+	ustring_internnew(L, USTRING_UV_POOL);
+	return 1;
+}
+
+static int icu_ustring_compileformat(lua_State *L) {
+	ustring_pushformat(L,1);
+	return 1;
+}
+
+// A ustring builder is a userdata holding a growable UChar buffer, for putting a ustring
+// together piece by piece without creating (and interning) all of the intermediate ustrings
+
+#define USTRING_BUILDER_MIN_CAPACITY	64
+
+typedef struct UStringBuilder {
+	UChar* buffer;
+	int32_t length; // in UChars
+	int32_t capacity; // in UChars
+	int32_t cp_length; // in code points
+} UStringBuilder;
+
+#define ustring_checkbuilder(L,i)																		\
+	(																									\
+		luaL_argcheck(																					\
+			(L),																						\
+			(lua_getmetatable((L),(i)) && lua_rawequal((L),-1,USTRING_UV_BUILDER_META) && (lua_pop(L,1),1)),	\
+			(i),																						\
+			"expecting ustring builder"																	\
+		),																								\
+		(UStringBuilder*)lua_touserdata((L),(i))														\
+	)
+
+// Make room for extra more UChars, returning where they should be written
+static UChar* ustring_builder_reserve(lua_State *L, UStringBuilder* builder, int32_t extra) {
+	int32_t new_capacity;
+	UChar* new_buffer;
+	if (extra > INT32_MAX - builder->length) {
+		luaL_error(L, "ustring builder is too long");
+	}
+	if (builder->length + extra > builder->capacity) {
+		new_capacity = builder->capacity;
+		while (new_capacity < builder->length + extra) {
+			new_capacity = (new_capacity > INT32_MAX / 2) ? INT32_MAX : new_capacity * 2;
+		}
+		new_buffer = (UChar*)realloc(builder->buffer, sizeof(UChar) * new_capacity);
+		if (!new_buffer) {
+			luaL_error(L, "unable to grow ustring builder");
+		}
+		builder->buffer = new_buffer;
+		builder->capacity = new_capacity;
+	}
+	return builder->buffer + builder->length;
+}
+
+static void ustring_builder_add(lua_State *L, UStringBuilder* builder, const UChar* ustr, int32_t ustr_len, int32_t cp_len) {
+	memcpy(ustring_builder_reserve(L, builder, ustr_len), ustr, sizeof(UChar) * ustr_len);
+	builder->length += ustr_len;
+	builder->cp_length += cp_len;
+}
+
+// Append the values from arg onwards: ustrings, UTF-8 Lua strings, or code points
+static void ustring_builder_addvalues(lua_State *L, UStringBuilder* builder, int arg) {
+	int top = lua_gettop(L);
+	for (; arg <= top; arg++) {
+		switch (lua_type(L,arg)) {
+			case LUA_TNUMBER: {
+				lua_Integer c = lua_tointeger(L,arg);
+				UChar* target;
+				int32_t offset = 0;
+				luaL_argcheck(L, c >= 0 && c <= UCHAR_MAX_VALUE, arg, "invalid code point");
+				target = ustring_builder_reserve(L, builder, U16_LENGTH((UChar32)c));
+				U16_APPEND_UNSAFE(target, offset, (UChar32)c);
+				builder->length += offset;
+				builder->cp_length++;
+				break;
+			}
+			case LUA_TSTRING: {
+				size_t byte_len;
+				const char* str = lua_tolstring(L, arg, &byte_len);
+				UChar* target;
+				int32_t uchar_len;
+				UErrorCode status = U_ZERO_ERROR;
+				luaL_argcheck(L, byte_len <= INT32_MAX, arg, "string is too long");
+				// UTF-8 never takes fewer bytes than UTF-16 takes UChars
+				target = ustring_builder_reserve(L, builder, (int32_t)byte_len);
+				u_strFromUTF8WithSub(target, builder->capacity - builder->length, &uchar_len,
+					str, (int32_t)byte_len, 0xFFFD, NULL, &status);
+				if (U_FAILURE(status)) {
+					lua_pushstring(L, u_errorName(status));
+					lua_error(L);
+				}
+				builder->length += uchar_len;
+				builder->cp_length += u_countChar32(target, uchar_len);
+				break;
+			}
+			default: {
+				icu4lua_UString* ustring;
+				luaL_argcheck(L, lua_getmetatable(L,arg) && lua_rawequal(L,-1,USTRING_UV_META) && (lua_pop(L,1),1),
+					arg, "expecting ustring, string or code point");
+				ustring = icu4lua_toustringheader(L,arg);
+				ustring_builder_add(L, builder, ustring->data, ustring->length, ustring_cplength(ustring));
+				break;
+			}
+		}
+	}
+}
+
+static int icu_ustring_builder(lua_State *L) {
+	UStringBuilder* builder = (UStringBuilder*)lua_newuserdata(L, sizeof(UStringBuilder));
+	builder->buffer = NULL;
+	builder->length = builder->cp_length = 0;
+	builder->capacity = USTRING_BUILDER_MIN_CAPACITY;
+	lua_pushvalue(L, USTRING_UV_BUILDER_META);
+	lua_setmetatable(L, -2);
+	builder->buffer = (UChar*)malloc(sizeof(UChar) * builder->capacity);
+	if (!builder->buffer) {
+		return luaL_error(L, "unable to allocate ustring builder");
+	}
+	lua_insert(L,1);
+	ustring_builder_addvalues(L, builder, 2);
+	lua_settop(L,1);
+	return 1;
+}
+
+static int icu_ustring_builder_append(lua_State *L) {
+	ustring_builder_addvalues(L, ustring_checkbuilder(L,1), 2);
+	lua_settop(L,1);
+	return 1;
+}
+
+// Formatted into scratch space first, so that a bad argument leaves the builder as it was
+static int icu_ustring_builder_appendformat(lua_State *L) {
+	UStringBuilder* builder = ustring_checkbuilder(L,1);
+	UStringFormat* format = ustring_pushformat(L,2);
+	UChar local_scratch[USTRING_FORMAT_SCRATCH];
+	UStringSink sink;
+	ustring_sinkinit(L, &sink, local_scratch);
+	ustring_applyformat(L, &sink, format, 2);
+	ustring_builder_add(L, builder, sink.scratch, sink.length, u_countChar32(sink.scratch, sink.length));
+	lua_settop(L,1);
+	return 1;
+}
+
+static int icu_ustring_builder_len(lua_State *L) {
+	lua_pushinteger(L, ustring_checkbuilder(L,1)->cp_length);
+	return 1;
+}
+
+static int icu_ustring_builder_reset(lua_State *L) {
+	UStringBuilder* builder = ustring_checkbuilder(L,1);
+	builder->length = builder->cp_length = 0;
+	lua_settop(L,1);
+	return 1;
+}
+
+static int icu_ustring_builder_toustring(lua_State *L) {
+	UStringBuilder* builder = ustring_checkbuilder(L,1);
+	icu4lua_pushustring(L, builder->buffer, builder->length, USTRING_UV_META, USTRING_UV_POOL);
+	return 1;
+}
+
+static int icu_ustring_builder_tostring(lua_State *L) {
+	UStringBuilder* builder = ustring_checkbuilder(L,1);
+	const char* encoding = luaL_optstring(L,2,"utf-8");
+	lua_settop(L,2);
+	return ustring_encode(L, builder->buffer, builder->length, encoding);
+}
+
+static int icu_ustring_builder__gc(lua_State *L) {
+	UStringBuilder* builder = (UStringBuilder*)lua_touserdata(L,1);
+	free(builder->buffer);
+	builder->buffer = NULL;
+	builder->length = builder->capacity = builder->cp_length = 0;
+	return 0;
+}
+
+
+// A ustring stream is a userdata holding a converter (from the cache) that keeps its state between
+// calls, so text that arrives in chunks can be decoded or encoded without splitting a character.
+// The output goes through one buffer that is only ever grown, not allocated for each chunk.
+
+#define USTRING_STREAM_MIN_CAPACITY	1024
+
+typedef struct UStringStream {
+	UConverter* conv;
+	icu4lua_ConverterCache* converters;
+	int decoding;
+	char* buffer;
+	size_t capacity; // in bytes
+} UStringStream;
+
+#define ustring_checkstream(L,i)																		\
+	(																									\
+		luaL_argcheck((L),																				\
+			(lua_getmetatable((L),(i)) && lua_rawequal((L),-1,USTRING_UV_STREAM_META) && (lua_pop(L,1),1)),	\
+			(i),																						\
+			"expecting ustring decoder or encoder"														\
+		),																								\
+		(UStringStream*)lua_touserdata((L),(i))															\
+	)
+
+// Make sure the buffer has room for at least the given number of bytes, keeping its contents
+static void ustring_stream_reserve(lua_State *L, UStringStream* stream, size_t size) {
+	size_t new_capacity;
+	char* new_buffer;
+	if (size <= stream->capacity) {
+		return;
+	}
+	new_capacity = stream->capacity;
+	while (new_capacity < size) {
+		if (new_capacity > ((size_t)-1) / 2) {
+			luaL_error(L, "ustring stream buffer is too large");
+		}
+		new_capacity *= 2;
+	}
+	new_buffer = (char*)realloc(stream->buffer, new_capacity);
+	if (!new_buffer) {
+		luaL_error(L, "unable to grow ustring stream buffer");
+	}
+	stream->buffer = new_buffer;
+	stream->capacity = new_capacity;
+}
+
+// Convert the chunk at the given argument index (if there is one) and push the output
+static int ustring_stream_convert(lua_State *L, UStringStream* stream, int arg, UBool flush) {
+	UErrorCode status;
+	size_t used = 0;
+	size_t byte_length;
+	const char* source;
+	const char* source_limit;
+	const UChar* usource;
+	const UChar* usource_limit;
+	UChar* utarget;
+	char* target;
+	static const UChar no_uchars = 0;
+
+	if (!stream->conv) {
+		return luaL_error(L, "ustring stream has no converter");
+	}
+	if (stream->decoding) {
+		source = luaL_optlstring(L, arg, "", &byte_length);
+		source_limit = source + byte_length;
+		ustring_stream_reserve(L, stream, (byte_length + 16) * sizeof(UChar));
+		for (;;) {
+			utarget = (UChar*)(stream->buffer + used);
+			status = U_ZERO_ERROR;
+			ucnv_toUnicode(stream->conv, &utarget, (UChar*)(stream->buffer + (stream->capacity & ~(size_t)1)),
+				&source, source_limit, NULL, flush, &status);
+			used = (char*)utarget - stream->buffer;
+			if (status != U_BUFFER_OVERFLOW_ERROR) {
+				break;
+			}
+			ustring_stream_reserve(L, stream, stream->capacity * 2);
+		}
+	}
+	else {
+		if (lua_isnoneornil(L, arg)) {
+			usource = usource_limit = &no_uchars;
+		}
+		else {
+			usource = icu4lua_checkustring(L, arg, USTRING_UV_META);
+			usource_limit = usource + icu4lua_ustrlen(L, arg);
+		}
+		ustring_stream_reserve(L, stream,
+			UCNV_GET_MAX_BYTES_FOR_STRING(usource_limit - usource, ucnv_getMaxCharSize(stream->conv)));
+		for (;;) {
+			target = stream->buffer + used;
+			status = U_ZERO_ERROR;
+			ucnv_fromUnicode(stream->conv, &target, stream->buffer + stream->capacity,
+				&usource, usource_limit, NULL, flush, &status);
+			used = target - stream->buffer;
+			if (status != U_BUFFER_OVERFLOW_ERROR) {
+				break;
+			}
+			ustring_stream_reserve(L, stream, stream->capacity * 2);
+		}
+	}
+	if (U_FAILURE(status)) {
+		ucnv_reset(stream->conv);
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+	if (stream->decoding) {
+		icu4lua_pushustring(L, (UChar*)stream->buffer, (int32_t)(used / sizeof(UChar)), USTRING_UV_META, USTRING_UV_POOL);
+	}
+	else {
+		lua_pushlstring(L, stream->buffer, used);
+	}
+	return 1;
+}
+
+// Push a new stream. If the converter cannot be opened, status is set and the stream has none.
+static UStringStream* ustring_pushstream(lua_State *L, const char* encoding, int decoding, UErrorCode* status) {
+	UStringStream* stream = (UStringStream*)lua_newuserdata(L, sizeof(UStringStream));
+	stream->conv = NULL;
+	stream->converters = ustring_converters(L);
+	stream->decoding = decoding;
+	stream->buffer = NULL;
+	stream->capacity = USTRING_STREAM_MIN_CAPACITY;
+	lua_pushvalue(L, USTRING_UV_STREAM_META);
+	lua_setmetatable(L,-2);
+	stream->buffer = (char*)malloc(stream->capacity);
+	if (!stream->buffer) {
+		luaL_error(L, "unable to allocate ustring stream buffer");
+	}
+	stream->conv = icu4lua_openconverter(stream->converters, encoding, status);
+	if (U_FAILURE(*status)) {
+		stream->conv = NULL;
+	}
+	return stream;
+}
+
+// Give the converter back to the cache and free the buffer
+static void ustring_stream_release(UStringStream* stream) {
+	if (stream->conv) {
+		icu4lua_closeconverter(stream->converters, stream->conv);
+		stream->conv = NULL;
+	}
+	free(stream->buffer);
+	stream->buffer = NULL;
+	stream->capacity = 0;
+}
+
+static int ustring_newstream(lua_State *L, int decoding) {
+	UErrorCode status = U_ZERO_ERROR;
+	ustring_pushstream(L, luaL_optstring(L,1,"utf-8"), decoding, &status);
+	if (U_FAILURE(status)) {
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+	return 1;
+}
+
+static int icu_ustring_decoder(lua_State *L) {
+	return ustring_newstream(L, 1);
+}
+
+static int icu_ustring_encoder(lua_State *L) {
+	return ustring_newstream(L, 0);
+}
+
+static int icu_ustring_stream_feed(lua_State *L) {
+	UStringStream* stream = ustring_checkstream(L,1);
+	if (stream->decoding) {
+		luaL_checkstring(L,2);
+	}
+	else {
+		icu4lua_checkustring(L, 2, USTRING_UV_META);
+	}
+	return ustring_stream_convert(L, stream, 2, FALSE);
+}
+
+static int icu_ustring_stream_finish(lua_State *L) {
+	// Flushing leaves the converter reset, ready for new input
+	return ustring_stream_convert(L, ustring_checkstream(L,1), 2, TRUE);
+}
+
+static int icu_ustring_stream_reset(lua_State *L) {
+	UStringStream* stream = ustring_checkstream(L,1);
+	if (stream->conv) {
+		ucnv_reset(stream->conv);
+	}
+	lua_settop(L,1);
+	return 1;
+}
+
+static int icu_ustring_stream__gc(lua_State *L) {
+	ustring_stream_release((UStringStream*)lua_touserdata(L,1));
+	return 0;
+}
+
+static int ustring_isustring(lua_State *L, int idx) {
+	int is_ustring;
+	if (!lua_getmetatable(L,idx)) {
+		return 0;
+	}
+	is_ustring = lua_rawequal(L,-1,USTRING_UV_META);
+	lua_pop(L,1);
+	return is_ustring;
+}
+
+// Convert every element of the array at index 1 with one converter, for decodeall and encodeall.
+// Results go into a new table, or the one at index 3 if given. An element that cannot be converted
+// gets false in the results, and its error message goes in a second table at the same index.
+static int ustring_convertall(lua_State *L, int decoding) {
+	UErrorCode status = U_ZERO_ERROR;
+	const char* encoding;
+	int utf8;
+	int n, i;
+	int IDX_OUT, IDX_ERRORS = 0, IDX_STREAM;
+	UStringStream* stream;
+	const char* source;
+	size_t byte_length;
+	int done;
+
+	luaL_checktype(L,1,LUA_TTABLE);
+	encoding = luaL_optstring(L,2,"utf-8");
+	if (!lua_isnoneornil(L,3)) {
+		luaL_checktype(L,3,LUA_TTABLE);
+	}
+	lua_settop(L,3);
+	n = (int)lua_objlen(L,1);
+	if (lua_isnil(L,3)) {
+		lua_createtable(L,n,0);
+		lua_replace(L,3);
+	}
+	IDX_OUT = 3;
+	utf8 = ustring_isutf8(ustring_converters(L), encoding);
+	// The stream holds the converter, so it still goes back to the cache if an element raises an error
+	stream = ustring_pushstream(L, encoding, decoding, &status);
+	IDX_STREAM = lua_gettop(L);
+	if (U_FAILURE(status)) {
+		ustring_stream_release(stream);
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 1, i);
+		if (decoding ? (lua_type(L,-1) != LUA_TSTRING) : !ustring_isustring(L,-1)) {
+			lua_pushfstring(L, "%s expected, got %s", decoding ? "string" : "ustring", luaL_typename(L,-1));
+			done = 2;
+		}
+		else if (decoding) {
+			source = lua_tolstring(L, -1, &byte_length);
+			done = (utf8 && ustring_pushutf8(L, source, byte_length, USTRING_UV_META, USTRING_UV_POOL))
+				? 1 : ustring_stream_convert(L, stream, IDX_STREAM + 1, TRUE);
+		}
+		else {
+			done = (utf8 && ustring_pushasutf8(L, icu4lua_trustustring(L,-1), (int32_t)icu4lua_ustrlen(L,-1)))
+				? 1 : ustring_stream_convert(L, stream, IDX_STREAM + 1, TRUE);
+		}
+		if (done == 1) {
+			lua_rawseti(L, IDX_OUT, i);
+		}
+		else {
+			if (!IDX_ERRORS) {
+				lua_newtable(L);
+				lua_replace(L, 2);
+				IDX_ERRORS = 2;
+			}
+			lua_rawseti(L, IDX_ERRORS, i);
+			lua_pushboolean(L, 0);
+			lua_rawseti(L, IDX_OUT, i);
+		}
+		lua_settop(L, IDX_STREAM);
+	}
+	ustring_stream_release(stream);
+
+	// Clear anything left over in a reused table
+	for (i = n + 1; ; i++) {
+		lua_rawgeti(L, IDX_OUT, i);
+		done = lua_isnil(L,-1);
+		lua_pop(L,1);
+		if (done) {
+			break;
+		}
+		lua_pushnil(L);
+		lua_rawseti(L, IDX_OUT, i);
+	}
+
+	lua_pushvalue(L, IDX_OUT);
+	if (IDX_ERRORS) {
+		lua_pushvalue(L, IDX_ERRORS);
+		return 2;
+	}
+	return 1;
+}
+
+static int icu_ustring_decodeall(lua_State *L) {
+	return ustring_convertall(L, 1);
+}
+
+static int icu_ustring_encodeall(lua_State *L) {
+	return ustring_convertall(L, 0);
+}
+
+// A multisearch is a userdata holding an Aho-Corasick automaton (see search.c) built from a set
+// of needles, for finding all of them in a text in one pass rather than one find each. The
+// automaton runs on UTF-8, so ustrings and UTF-8 strings can both be searched (and used as
+// needles), a character at a time. For caseless searches, needles and text are both folded a
+// character at a time (simple case folding), so a hit is always as many characters long as its needle.
+
+typedef struct UStringMultiSearch {
+	SearchAutomaton* automaton;
+	int caseless;
+} UStringMultiSearch;
+
+typedef struct UStringMultiScan {
+	const UStringMultiSearch* search;
+	const UChar* ustring; // if the text is a ustring
+	const char* utf8; // if the text is a UTF-8 string
+	int32_t length; // in UChars or bytes
+	int32_t pos; // likewise
+	int32_t index; // positions are counted in UTF-16 units, the same as for find
+	uint32_t char_count;
+	int32_t state;
+	int32_t hit_state; // -1 if there are no more hits at the current position
+	int32_t hit_needle;
+	uint32_t starts_mask;
+	int32_t starts[1]; // where each of the last few characters started, as a ring
+} UStringMultiScan;
+
+#define ustring_checkmultisearch(L,i)																			\
+	(																											\
+		luaL_argcheck((L),																						\
+			(lua_getmetatable((L),(i)) && lua_rawequal((L),-1,USTRING_UV_MULTISEARCH_META) && (lua_pop(L,1),1)),	\
+			(i),																								\
+			"expecting ustring multisearch"																		\
+		),																										\
+		(UStringMultiSearch*)lua_touserdata((L),(i))															\
+	)
+
+// Encode a needle as UTF-8, folding it first if the search is caseless. Returns the length in
+// bytes, and the length in characters through cp_len, or -1 for invalid UTF-8.
+static int32_t ustring_multisearch_encode(lua_State *L, int idx, int caseless, uint8_t* target, int32_t* cp_len) {
+	int32_t i = 0, length, target_len = 0;
+	UChar32 c;
+	*cp_len = 0;
+	if (lua_type(L,idx) == LUA_TSTRING) {
+		size_t byte_len;
+		const char* utf8 = lua_tolstring(L,idx,&byte_len);
+		length = (int32_t)byte_len;
+		while (i < length) {
+			U8_NEXT(utf8, i, length, c);
+			if (c < 0) {
+				return -1;
+			}
+			if (caseless) {
+				c = u_foldCase(c, U_FOLD_CASE_DEFAULT);
+			}
+			U8_APPEND_UNSAFE(target, target_len, c);
+			(*cp_len)++;
+		}
+	}
+	else {
+		const UChar* ustring = icu4lua_trustustring(L,idx);
+		length = (int32_t)icu4lua_ustrlen(L,idx);
+		while (i < length) {
+			U16_NEXT(ustring, i, length, c);
+			if (caseless) {
+				c = u_foldCase(c, U_FOLD_CASE_DEFAULT);
+			}
+			U8_APPEND_UNSAFE(target, target_len, c);
+			(*cp_len)++;
+		}
+	}
+	return target_len;
+}
+
+static int icu_ustring_multisearch(lua_State *L) {
+	UStringMultiSearch* search;
+	int n, i;
+	size_t scratch_size = 0, needle_size;
+	uint8_t* scratch;
+	int32_t needle_len, cp_len;
+
+	luaL_checktype(L,1,LUA_TTABLE);
+	lua_settop(L,2);
+	search = (UStringMultiSearch*)lua_newuserdata(L, sizeof(UStringMultiSearch));
+	search->automaton = NULL;
+	search->caseless = 0;
+	lua_pushvalue(L, USTRING_UV_MULTISEARCH_META);
+	lua_setmetatable(L,-2);
+	if (!lua_isnil(L,2)) {
+		luaL_checktype(L,2,LUA_TTABLE);
+		lua_getfield(L,2,"caseless");
+		search->caseless = lua_toboolean(L,-1);
+		lua_pop(L,1);
+	}
+
+	// Check the needles, and find out how much room the longest needs as (folded) UTF-8. Folding
+	// can turn a 2-byte UTF-8 character into a 3-byte one, so allow for it.
+	n = (int)lua_objlen(L,1);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L,1,i);
+		if (lua_type(L,-1) == LUA_TSTRING) {
+			needle_size = lua_objlen(L,-1) * 2;
+		}
+		else if (ustring_isustring(L,-1)) {
+			needle_size = icu4lua_ustrlen(L,-1) * 3;
+		}
+		else {
+			return luaL_error(L, "needle %d is not a ustring or string", i);
+		}
+		if (needle_size == 0) {
+			return luaL_error(L, "needle %d is empty", i);
+		}
+		if (needle_size > scratch_size) {
+			scratch_size = needle_size;
+		}
+		lua_pop(L,1);
+	}
+	scratch = (uint8_t*)lua_newuserdata(L, scratch_size);
+
+	search->automaton = search_automaton_new();
+	if (!search->automaton) {
+		return luaL_error(L, "unable to allocate ustring multisearch");
+	}
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L,1,i);
+		needle_len = ustring_multisearch_encode(L, -1, search->caseless, scratch, &cp_len);
+		if (needle_len == -1) {
+			return luaL_error(L, "needle %d is not valid UTF-8", i);
+		}
+		if (!search_automaton_add(search->automaton, (const char*)scratch, needle_len, cp_len)) {
+			return luaL_error(L, "unable to allocate ustring multisearch");
+		}
+		lua_pop(L,1);
+	}
+	if (!search_automaton_build(search->automaton)) {
+		return luaL_error(L, "unable to allocate ustring multisearch");
+	}
+	lua_pop(L,1);
+	return 1;
+}
+
+static int icu_ustring_multisearch__gc(lua_State *L) {
+	UStringMultiSearch* search = (UStringMultiSearch*)lua_touserdata(L,1);
+	search_automaton_free(search->automaton);
+	search->automaton = NULL;
+	return 0;
+}
+
+// Push a new scan of the text at text_idx (a ustring or UTF-8 string) from the optional start
+// index at text_idx + 1, counted the same way as for find
+static UStringMultiScan* ustring_pushmultiscan(lua_State *L, const UStringMultiSearch* search, int text_idx) {
+	int init = luaL_optint(L, text_idx + 1, 0);
+	uint32_t ring_size = 1;
+	UStringMultiScan* scan;
+	while (ring_size < (uint32_t)search_automaton_maxlength(search->automaton)) {
+		ring_size *= 2;
+	}
+	scan = (UStringMultiScan*)lua_newuserdata(L, sizeof(UStringMultiScan) + (ring_size - 1) * sizeof(int32_t));
+	scan->search = search;
+	scan->starts_mask = ring_size - 1;
+	scan->char_count = 0;
+	scan->state = 0;
+	scan->hit_state = -1;
+	scan->hit_needle = -1;
+	if (lua_type(L,text_idx) == LUA_TSTRING) {
+		size_t byte_len;
+		UCharIterator iter;
+		uint32_t state;
+		scan->ustring = NULL;
+		scan->utf8 = lua_tolstring(L, text_idx, &byte_len);
+		scan->length = (int32_t)byte_len;
+		uiter_setUTF8(&iter, scan->utf8, scan->length);
+		if (init > 0) {
+			iter.move(&iter, init-1, UITER_ZERO);
+		}
+		else if (init < 0) {
+			iter.move(&iter, init, UITER_LIMIT);
+		}
+		// An odd state is between the halves of a supplementary character, with the byte offset past it
+		state = uiter_getState(&iter);
+		scan->pos = (int32_t)(state >> 1);
+		scan->index = iter.getIndex(&iter, UITER_CURRENT) + (int32_t)(state & 1);
+	}
+	else {
+		scan->utf8 = NULL;
+		scan->ustring = icu4lua_checkustring(L, text_idx, USTRING_UV_META);
+		scan->length = (int32_t)icu4lua_ustrlen(L, text_idx);
+		scan->pos = 0;
+		if (init > 0) {
+			scan->pos = (init - 1 < scan->length) ? init - 1 : scan->length;
+		}
+		else if (init < 0) {
+			scan->pos = (-init < scan->length) ? scan->length + init : 0;
+		}
+		scan->index = scan->pos;
+	}
+	return scan;
+}
+
+// Get the next hit, in order of where they end (and longest first, where several end at the
+// same place). Returns 0 when there are no more.
+static int ustring_multiscan_next(UStringMultiScan* scan, int32_t* needle, int32_t* start, int32_t* end) {
+	const SearchAutomaton* automaton = scan->search->automaton;
+	uint8_t bytes[U8_MAX_LENGTH];
+	int32_t byte_len, i;
+	UChar32 c;
+	for (;;) {
+		if (scan->hit_state != -1) {
+			*needle = scan->hit_needle;
+			*start = scan->starts[(scan->char_count - search_automaton_needlelength(automaton, *needle)) & scan->starts_mask] + 1;
+			*end = scan->index;
+			scan->hit_state = search_automaton_nexthit(automaton, scan->hit_state, &scan->hit_needle);
+			return 1;
+		}
+		if (scan->pos >= scan->length) {
+			return 0;
 		}
-		if (!(lua_getmetatable(L,-1) && lua_rawequal(L,-1,USTRING_UV_META) && (lua_pop(L,1),1))) {
-			return luaL_argerror(L, 1, "all elements must be ustrings");
+		scan->starts[scan->char_count++ & scan->starts_mask] = scan->index;
+		if (scan->ustring) {
+			U16_NEXT(scan->ustring, scan->pos, scan->length, c);
+			scan->index += U16_LENGTH(c);
+		}
+		else {
+			U8_NEXT(scan->utf8, scan->pos, scan->length, c);
+			if (c < 0) {
+				// Nothing can match across invalid UTF-8
+				scan->index++;
+				scan->state = 0;
+				continue;
+			}
+			scan->index += U16_LENGTH(c);
+		}
+		if (scan->search->caseless) {
+			c = u_foldCase(c, U_FOLD_CASE_DEFAULT);
+		}
+		byte_len = 0;
+		U8_APPEND_UNSAFE(bytes, byte_len, c);
+		for (i = 0; i < byte_len; i++) {
+			scan->state = search_automaton_step(automaton, scan->state, bytes[i]);
+		}
+		scan->hit_state = search_automaton_hitstate(automaton, scan->state);
+		if (scan->hit_state != -1) {
+			scan->hit_needle = search_automaton_needle(automaton, scan->hit_state);
 		}
-		icu4lua_addustring(&b, icu4lua_trustustring(L,-1), icu4lua_ustrlen(L,-1));
 	}
-	icu4lua_pushuresult(&b, USTRING_UV_META, USTRING_UV_POOL);
-	return 1;
 }
 
-static int icu_ustring_toraw(lua_State *L) {
-	icu4lua_checkustring(L,1,USTRING_UV_META);
-	icu4lua_pushrawustring(L,1);
-	return 1;
+static int icu_ustring_multisearch_find(lua_State *L) {
+	UStringMultiScan* scan = ustring_pushmultiscan(L, ustring_checkmultisearch(L,1), 2);
+	int32_t needle, start, end;
+	if (!ustring_multiscan_next(scan, &needle, &start, &end)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, start);
+	lua_pushinteger(L, end);
+	lua_pushinteger(L, needle + 1);
+	return 3;
 }
 
-static int icu_ustring_fromraw(lua_State *L) {
-	luaL_checktype(L,1,LUA_TSTRING);
-	luaL_argcheck(L, 0 == (lua_objlen(L,1) % sizeof(UChar)), 1, "invalid length for a raw ustring");
-	lua_settop(L,1);
-	icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
+static int icu_ustring_multisearch_count(lua_State *L) {
+	UStringMultiScan* scan = ustring_pushmultiscan(L, ustring_checkmultisearch(L,1), 2);
+	int32_t needle, start, end;
+	lua_Integer count = 0;
+	while (ustring_multiscan_next(scan, &needle, &start, &end)) {
+		count++;
+	}
+	lua_pushinteger(L, count);
 	return 1;
 }
 
-static int icu_ustring_lib__call(lua_State *L) {
-	lua_remove(L,1);
-	return icu_ustring_decode(L);
+// Upvalues: the multisearch, the text, and the scan (the first two only to keep them alive)
+static int ustring_multisearch_gmatch_aux(lua_State *L) {
+	UStringMultiScan* scan = (UStringMultiScan*)lua_touserdata(L, lua_upvalueindex(3));
+	int32_t needle, start, end;
+	if (!ustring_multiscan_next(scan, &needle, &start, &end)) {
+		return 0;
+	}
+	lua_pushinteger(L, start);
+	lua_pushinteger(L, end);
+	lua_pushinteger(L, needle + 1);
+	return 3;
 }
 
-static int icu_ustring__concat(lua_State *L) {
-	if (!lua_getmetatable(L,1) || !lua_getmetatable(L,2) || !lua_rawequal(L,-2,-1)) {
-		return luaL_error(L, "ustrings can only be concatenated to other ustrings");
-	}
-	icu4lua_pushrawustring(L, 1);
-	icu4lua_pushrawustring(L, 2);
-	lua_concat(L,2);
-	icu4lua_internrawustring(L, USTRING_UV_META, USTRING_UV_POOL);
+static int icu_ustring_multisearch_gmatch(lua_State *L) {
+	UStringMultiSearch* search = ustring_checkmultisearch(L,1);
+	lua_settop(L,3);
+	lua_pushvalue(L,1);
+	lua_pushvalue(L,2);
+	ustring_pushmultiscan(L, search, 2);
+	lua_pushcclosure(L, ustring_multisearch_gmatch_aux, 3);
 	return 1;
 }
 
-static int icu_ustring__lt(lua_State *L) {
-	if (!lua_getmetatable(L,1) || !lua_getmetatable(L,2) || !lua_rawequal(L,-2,-1)) {
-		return luaL_error(L, "ustrings can only be compared to other ustrings");
+
+
+static int icu_ustring__gc(lua_State *L) {
+	icu4lua_UString* ustring = icu4lua_toustringheader(L,1);
+	if (ustring->pool_ref) {
+		ustring_pool_unlink((UStringPool*)lua_touserdata(L, USTRING_UV_POOL), ustring);
 	}
-	lua_pushboolean(L, u_strCompare(
-		icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-		icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-		TRUE
-	) < 0);
-	return 1;
+	free(ustring->cp_index);
+	ustring->cp_index = NULL;
+	if (ustring->view_ref != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ustring->view_ref);
+		ustring->view_ref = LUA_NOREF;
+	}
+	if (ustring->fold_ref != LUA_NOREF && ustring->fold_ref != LUA_REFNIL) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ustring->fold_ref);
+		ustring->fold_ref = LUA_NOREF;
+	}
+	return 0;
 }
 
-static int icu_ustring__le(lua_State *L) {
-	if (!lua_getmetatable(L,1) || !lua_getmetatable(L,2) || !lua_rawequal(L,-2,-1)) {
-		return luaL_error(L, "ustrings can only be compared to other ustrings");
+static int icu_ustring_pool__gc(lua_State *L) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L,1);
+	free(pool->slots);
+	free(pool->old_slots);
+	free(pool->free_refs);
+	pool->slots = pool->old_slots = NULL;
+	pool->free_refs = NULL;
+	pool->free_refs_count = pool->free_refs_size = 0;
+	if (pool->graphemes) {
+		ubrk_close(pool->graphemes);
+		pool->graphemes = NULL;
 	}
-	lua_pushboolean(L, u_strCompare(
-		icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-		icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-		TRUE
-	) <= 0);
-	return 1;
+	return 0;
 }
 
-static int icu_ustring_isustring(lua_State *L) {
-	lua_pushboolean(L, lua_getmetatable(L,1) && lua_rawequal(L,-1,USTRING_UV_META));
+static int icu_ustring_intern(lua_State *L) {
+	icu4lua_checkustring(L,1,USTRING_UV_META);
+	if (icu4lua_toustringheader(L,1)->pool_ref) {
+		lua_settop(L,1);
+		return 1;
+	}
+	ustring_pooled(L, icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1), USTRING_UV_META, USTRING_UV_POOL);
 	return 1;
 }
 
-static int icu_ustring_lessthan(lua_State *L) {
+static int icu_ustring_isinterned(lua_State *L) {
 	icu4lua_checkustring(L,1,USTRING_UV_META);
-	icu4lua_checkustring(L,2,USTRING_UV_META);
-	if (lua_isboolean(L,3)) {
-		UErrorCode status = U_ZERO_ERROR;
-		lua_pushboolean(L, u_strCaseCompare(
-			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-			U_FOLD_CASE_DEFAULT,
-			&status
-		) < 0);
-		if (U_FAILURE(status)) {
-			lua_pushstring(L, u_errorName(status));
-			return lua_error(L);
-		}
-	}
-	else {
-		lua_pushboolean(L, u_strCompare(
-			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-			TRUE
-		) < 0);
-	}
+	lua_pushboolean(L, icu4lua_toustringheader(L,1)->pool_ref != 0);
 	return 1;
 }
 
-static int icu_ustring_lessorequal(lua_State *L) {
-	icu4lua_checkustring(L,1,USTRING_UV_META);
-	icu4lua_checkustring(L,2,USTRING_UV_META);
-	if (lua_isboolean(L,3)) {
-		UErrorCode status = U_ZERO_ERROR;
-		lua_pushboolean(L, u_strCaseCompare(
-			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-			U_FOLD_CASE_DEFAULT,
-			&status
-		) <= 0);
-		if (U_FAILURE(status)) {
-			lua_pushstring(L, u_errorName(status));
-			return lua_error(L);
-		}
+static int icu_ustring_setinternlimit(lua_State *L) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	int32_t old_limit = pool->intern_limit;
+	if (lua_isnoneornil(L,1)) {
+		pool->intern_limit = -1;
 	}
 	else {
-		lua_pushboolean(L, u_strCompare(
-			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-			TRUE
-		) <= 0);
+		lua_Integer limit = luaL_checkinteger(L,1);
+		luaL_argcheck(L, limit >= 0, 1, "intern limit cannot be negative");
+		pool->intern_limit = (limit > INT32_MAX) ? INT32_MAX : (int32_t)limit;
 	}
-	return 1;
-}
-
-static int icu_ustring_equals(lua_State *L) {
-	icu4lua_checkustring(L,1,USTRING_UV_META);
-	icu4lua_checkustring(L,2,USTRING_UV_META);
-	if (lua_toboolean(L,3)) {
-		UErrorCode status = U_ZERO_ERROR;
-		lua_pushboolean(L, u_strCaseCompare(
-			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-			U_FOLD_CASE_DEFAULT,
-			&status
-		) == 0);
-		if (U_FAILURE(status)) {
-			lua_pushstring(L, u_errorName(status));
-			return lua_error(L);
-		}
+	if (old_limit < 0) {
+		lua_pushnil(L);
 	}
 	else {
-		lua_pushboolean(L, u_strCompare(
-			icu4lua_trustustring(L,1), (int32_t)icu4lua_ustrlen(L,1),
-			icu4lua_trustustring(L,2), (int32_t)icu4lua_ustrlen(L,2),
-			TRUE
-		) == 0);
+		lua_pushinteger(L, old_limit);
 	}
 	return 1;
 }
 
-static uint32_t uiter_scanformat(lua_State *L, uint32_t start_state, UCharIterator* pFrmtIter, const UChar* ustrfrmt, UChar *form) {
-	uint32_t end_state;
-	while (strchr(FLAGS, uiter_current32(pFrmtIter))) {
-		uiter_next32(pFrmtIter);
+static int icu_ustring_converterstats(lua_State *L) {
+	ConverterCache* cache = (ConverterCache*)ustring_converters(L);
+	lua_pushnumber(L, cache->hits);
+	lua_pushnumber(L, cache->misses);
+	lua_pushinteger(L, cache->idle_count);
+	return 3;
+}
+
+static int icu_ustring_setmatchlimit(lua_State *L) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	int32_t old_limit = pool->patterns.match_limit;
+	if (lua_isnoneornil(L,1)) {
+		pool->patterns.match_limit = -1;
 	}
-	// TODO: test for repeated flags, show "invalid format (repeated flags)" error
-	if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // skip width
-	if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // (2 digits at most)
-	if (uiter_current32(pFrmtIter) == '.') {
-		uiter_next32(pFrmtIter);
-		if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // skip precision
-		if (isdigit(uiter_current32(pFrmtIter))) uiter_next32(pFrmtIter); // (2 digits at most)
+	else {
+		lua_Integer limit = luaL_checkinteger(L,1);
+		luaL_argcheck(L, limit >= 0, 1, "match limit cannot be negative");
+		pool->patterns.match_limit = (limit > INT32_MAX) ? INT32_MAX : (int32_t)limit;
 	}
-	if (isdigit(uiter_current32(pFrmtIter))) {
-		luaL_error(L, "invalid format (width or precision too long)");
+	if (old_limit < 0) {
+		lua_pushnil(L);
 	}
-	uiter_next32(pFrmtIter);
-	end_state = uiter_getState(pFrmtIter);
-	u_memcpy(form, ustrfrmt + start_state, end_state - start_state);
-	form[end_state - start_state] = '\0';
-	return end_state;
+	else {
+		lua_pushinteger(L, old_limit);
+	}
+	return 1;
 }
 
-static void addquoted(lua_State *L, luaL_Buffer *b, int arg) {
-	UChar* s = icu4lua_checkustring(L,arg,USTRING_UV_META);
-	size_t l = icu4lua_ustrlen(L,arg);
-	UChar c = '"';
-	icu4lua_addustring(b, &c, 1);
-	while (l--) {
-		switch (*s) {
-			case '"': case '\\': case '\n': {
-				c = '\\'; icu4lua_addustring(b, &c, 1);
-				icu4lua_addustring(b, s, 1);
-				break;
-			}
-			case '\0': {
-				c = '\\'; icu4lua_addustring(b, &c, 1);
-				c = '0';
-				icu4lua_addustring(b, &c, 1);
-				icu4lua_addustring(b, &c, 1);
-				icu4lua_addustring(b, &c, 1);
-				break;
-			}
-			default: {
-				icu4lua_addustring(b, s, 1);
-				break;
-			}
-		}
-		s++;
-	}
-	c = '"';
-	icu4lua_addustring(b, &c, 1);
+static int icu_ustring_poolsize(lua_State* L) {
+	UStringPool* pool = (UStringPool*)lua_touserdata(L, USTRING_UV_POOL);
+	lua_pushinteger(L, pool->count);
+	lua_pushinteger(L, (lua_Integer)pool->uchar_count);
+	return 2;
 }
 
-#define U_LUA_INTFRMLEN_LENGTH 1
-U_STRING_DECL(U_LUA_INTFRMLEN, "l", 1);
+const static luaL_Reg icu_ustring_builder_methods[] = {
+	{"append", icu_ustring_builder_append},
+	{"appendformat", icu_ustring_builder_appendformat},
+	{"len", icu_ustring_builder_len},
+	{"reset", icu_ustring_builder_reset},
+	{"tostring", icu_ustring_builder_tostring},
+	{"toustring", icu_ustring_builder_toustring},
 
-static void addintlen(UChar* form) {
-	size_t l = u_strlen(form);
-	UChar spec = form[l - 1];
-	u_strcpy(form + l - 1, U_LUA_INTFRMLEN);
-	form[l + U_LUA_INTFRMLEN_LENGTH - 2] = spec;
-	form[l + U_LUA_INTFRMLEN_LENGTH - 1] = '\0';
-}
+	{NULL, NULL}
+};
 
-static int icu_ustring_format(lua_State *L) {
-	int arg = 1;
-	UChar* ustrfrmt = icu4lua_checkustring(L,1,USTRING_UV_META);
-	int32_t ustrfrmt_len = (int32_t)icu4lua_ustrlen(L,1);
-	UCharIterator frmtIter;
-	luaL_Buffer b;
-	uint32_t start_state, end_state;
-	UChar32 c;
-	
-	uiter_setString(&frmtIter, ustrfrmt, ustrfrmt_len);
+const static luaL_Reg icu_ustring_stream_methods[] = {
+	{"feed", icu_ustring_stream_feed},
+	{"finish", icu_ustring_stream_finish},
+	{"reset", icu_ustring_stream_reset},
 
-	luaL_buffinit(L, &b);
-	start_state = uiter_getState(&frmtIter);
-	for (c = uiter_next32(&frmtIter); c != U_SENTINEL; c = uiter_next32(&frmtIter)) {
-		if (c == L_ESC) {
-			uiter_previous32(&frmtIter);
-			end_state = uiter_getState(&frmtIter);
-			uiter_next32(&frmtIter);
-			icu4lua_addustring(&b, ustrfrmt + start_state, end_state - start_state);
+	{NULL, NULL}
+};
 
-			c = uiter_current32(&frmtIter);
-			if (c == L_ESC) {
-				start_state = uiter_getState(&frmtIter);
-				uiter_next32(&frmtIter);
-			}
-			else {
-				UChar form[MAX_FORMAT];  /* to store the format (`%...') */
-				UChar buff[MAX_ITEM];  /* to store the formatted item */
-				arg++;
-				start_state = uiter_scanformat(L, end_state, &frmtIter, ustrfrmt, form);
-				uiter_previous32(&frmtIter);
-				switch(uiter_next32(&frmtIter)) {
-					case 'c':
-						form[1] = 'C';
-						u_sprintf_u(buff, form, (int)luaL_checknumber(L, arg));
-						break;
-					case 'd': case 'i':
-						addintlen(form);
-						u_sprintf_u(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
-						break;
-					case 'o': case 'u': case 'x': case 'X':
-						addintlen(form);
-						u_sprintf_u(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
-						break;
-					case 'e': case 'E': case 'f': case 'g': case 'G':
-						u_sprintf_u(buff, form, (double)luaL_checknumber(L, arg));
-						break;
-					case 'q':
-						addquoted(L, &b, arg);
-						continue;
-					case 's': {
-						luaL_argcheck(L, lua_getmetatable(L,arg) && lua_rawequal(L,-1,USTRING_UV_META), arg, "expecting ustring");
-						luaL_addlstring(&b, (const char*)lua_touserdata(L,arg), lua_objlen(L,arg));
-						continue;
-					}
-					default:
-						return luaL_error(L, "invalid option to " LUA_QL("format"));
-				}
-				icu4lua_addustring(&b, buff, u_strlen(buff));
-			}
-		}
-	}
-	icu4lua_addustring(&b, ustrfrmt + start_state, ustrfrmt_len - start_state);
-	icu4lua_pushuresult(&b, USTRING_UV_META, USTRING_UV_POOL);
-	return 1;
-}
+const static luaL_Reg icu_ustring_multisearch_methods[] = {
+	{"count", icu_ustring_multisearch_count},
+	{"find", icu_ustring_multisearch_find},
+	{"gmatch", icu_ustring_multisearch_gmatch},
 
-static int icu_ustring_poolsize(lua_State* L) {
-	int ustrings = 0;
-	int32_t uchars = 0;
-	lua_gc(L, LUA_GCSTOP, 0);
-	lua_pushnil(L);
-	while (lua_next(L,USTRING_UV_POOL)) {
-		ustrings++;
-		uchars += (int32_t)icu4lua_ustrlen(L,-1);
-		lua_pop(L,1);
-	}
-	lua_gc(L, LUA_GCRESTART, 0);
-	lua_pushinteger(L, ustrings);
-	lua_pushinteger(L, uchars);
-	return 2;
-}
+	{NULL, NULL}
+};
 
 const static luaL_Reg icu_ustring_lib[] = {
 	{"decode", icu_ustring_decode},
 	{"encode", icu_ustring_encode},
+	{"decodeall", icu_ustring_decodeall},
+	{"encodeall", icu_ustring_encodeall},
 	{"unescape", icu_ustring_unescape},
 
 	{"isustring", icu_ustring_isustring},
@@ -957,59 +3347,240 @@ const static luaL_Reg icu_ustring_lib[] = {
 	{"reverse", icu_ustring_reverse},
 	{"upper", icu_ustring_upper},
 	{"lower", icu_ustring_lower},
+	{"fold", icu_ustring_fold},
+	{"hash", icu_ustring_hash},
 	{"codepoint", icu_ustring_codepoint},
 	{"char", icu_ustring_char},
 	{"format", icu_ustring_format},
+	{"compileformat", icu_ustring_compileformat},
 	{"match", icu_ustring_match},
 	{"gsub", icu_ustring_gsub},
 	{"find", icu_ustring_find},
 	{"gmatch", icu_ustring_gmatch},
+	{"pattern", icu_ustring_pattern},
+	{"setmatchlimit", icu_ustring_setmatchlimit},
 
 	{"tconcat", icu_ustring_tconcat},
 	{"toraw", icu_ustring_toraw},
 	{"fromraw", icu_ustring_fromraw},
 
+	{"builder", icu_ustring_builder},
+	{"decoder", icu_ustring_decoder},
+	{"encoder", icu_ustring_encoder},
+	{"multisearch", icu_ustring_multisearch},
+
+	{"intern", icu_ustring_intern},
+	{"isinterned", icu_ustring_isinterned},
+	{"setinternlimit", icu_ustring_setinternlimit},
 	{"poolsize", icu_ustring_poolsize},
+	{"converterstats", icu_ustring_converterstats},
 
 	{NULL, NULL}
 };
 
 int luaopen_icu_ustring(lua_State *L) {
-	int IDX_USTRING_META, IDX_USTRING_POOL, IDX_USTRING_LIB;
+	int IDX_USTRING_META, IDX_USTRING_POOL, IDX_USTRING_BUILDER_META, IDX_USTRING_STREAM_META, IDX_USTRING_FORMAT_META, IDX_USTRING_MULTISEARCH_META, IDX_USTRING_PATTERN_META, IDX_USTRING_LIB;
 	const luaL_Reg* lib_entry;
 	luaL_Reg null_entry = {NULL,NULL};
+	UStringPool* pool;
+	ConverterCache* converters;
+	CaseMapCache* casemaps;
+	static const UChar empty_uchar = 0;
+	int i;
 
 	// Create the ustring metatable
 	luaL_newmetatable(L, "icu.ustring");
 	IDX_USTRING_META = lua_gettop(L);
 
 	// Create the ustring pool
-	lua_newtable(L);
+	pool = (UStringPool*)lua_newuserdata(L, sizeof(UStringPool));
+	pool->api.intern = ustring_intern;
+	pool->api.slice = ustring_slice;
+	pool->slots = pool->old_slots = NULL;
+	pool->slot_mask = USTRING_POOL_MIN_SLOTS - 1;
+	pool->old_slot_mask = 0;
+	pool->used = pool->old_used = pool->migrate_pos = 0;
+	pool->count = 0;
+	pool->uchar_count = 0;
+	pool->free_refs = NULL;
+	pool->free_refs_count = pool->free_refs_size = 0;
+	pool->next_ref = 1;
+	pool->intern_limit = -1;
+	pool->converters = NULL;
+	pool->casemaps = NULL;
+	pool->graphemes = NULL;
+	pool->format_count = 0;
+	pool->patterns.count = 0;
+	pool->patterns.match_limit = -1;
 	IDX_USTRING_POOL = lua_gettop(L);
 
+	// Make sure the slot arrays are freed along with the pool
+	lua_newtable(L);
+	lua_pushcfunction(L, icu_ustring_pool__gc);
+	lua_setfield(L,-2,"__gc");
+	lua_setmetatable(L,IDX_USTRING_POOL);
+
+	pool->slots = (icu4lua_UString**)calloc(USTRING_POOL_MIN_SLOTS, sizeof(icu4lua_UString*));
+	if (!pool->slots) {
+		return luaL_error(L, "unable to allocate the ustring pool");
+	}
+
+	// Create the converter cache, and put it in the registry to share it with other modules
+	converters = (ConverterCache*)lua_newuserdata(L, sizeof(ConverterCache));
+	converters->api.open = converter_cache_open;
+	converters->api.close = converter_cache_close;
+	converters->api.hold = converter_cache_hold;
+	converters->api.release = converter_cache_release;
+	converters->idle_count = 0;
+	for (i = 0; i < CONVERTER_NAME_CACHE_SIZE; i++) {
+		converters->names[i].name = NULL;
+	}
+	converters->name_next = 0;
+	converters->clock = 0;
+	converters->hits = converters->misses = 0;
+	lua_newtable(L);
+	lua_pushcfunction(L, converter_cache__gc);
+	lua_setfield(L,-2,"__gc");
+	lua_setmetatable(L,-2);
+	lua_newtable(L);
+	lua_pushcfunction(L, converter_cache_held__gc);
+	lua_setfield(L,-2,"__gc");
+	converters->held_meta_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_setfield(L, LUA_REGISTRYINDEX, "icu.ustring converter cache");
+	pool->converters = &converters->api;
+
+	// Likewise the case map cache
+	casemaps = (CaseMapCache*)lua_newuserdata(L, sizeof(CaseMapCache));
+	casemaps->api.get = casemap_cache_get;
+	for (i = 0; i < CASEMAP_CACHE_SIZE; i++) {
+		casemaps->entries[i].csm = NULL;
+	}
+	casemaps->next = 0;
+	lua_newtable(L);
+	lua_pushcfunction(L, casemap_cache__gc);
+	lua_setfield(L,-2,"__gc");
+	lua_setmetatable(L,-2);
+	lua_setfield(L, LUA_REGISTRYINDEX, "icu.ustring casemap cache");
+	pool->casemaps = &casemaps->api;
+
 	// Put the ustring pool in the registry (to keep it from being garbage)
 	lua_pushvalue(L, IDX_USTRING_POOL);
 	lua_setfield(L, LUA_REGISTRYINDEX, "icu.ustring pool");
 
-	// Give the ustring pool weak values
+	// Give the ustring pool a back-reference table with weak values
+	lua_newtable(L);
 	lua_newtable(L);
 	lua_pushliteral(L, "v");
 	lua_setfield(L,-2,"__mode");
-	lua_setmetatable(L,IDX_USTRING_POOL);
+	lua_setmetatable(L,-2);
+	lua_setfenv(L,IDX_USTRING_POOL);
 	
+	// Create the ustring builder metatable
+	luaL_newmetatable(L, "icu.ustring.builder");
+	IDX_USTRING_BUILDER_META = lua_gettop(L);
+
+	// Create the ustring decoder/encoder metatable
+	luaL_newmetatable(L, "icu.ustring.stream");
+	IDX_USTRING_STREAM_META = lua_gettop(L);
+
+	// Create the compiled format metatable
+	luaL_newmetatable(L, "icu.ustring.format");
+	IDX_USTRING_FORMAT_META = lua_gettop(L);
+
+	// Create the multisearch metatable
+	luaL_newmetatable(L, "icu.ustring.multisearch");
+	IDX_USTRING_MULTISEARCH_META = lua_gettop(L);
+
+	// Create (or find) the compiled pattern metatable, which icu.utf8 shares
+	luaL_newmetatable(L, "icu.pattern");
+	IDX_USTRING_PATTERN_META = lua_gettop(L);
+
 	// Create the lib table
 	luaL_register(L, "icu.ustring", &null_entry);
 	IDX_USTRING_LIB = lua_gettop(L);
 
-	// Populate the lib table, adding in the upvalues for the metatable and pool
+	// Populate the lib table, adding in the upvalues for the metatables and pool
 	for (lib_entry = &icu_ustring_lib[0]; lib_entry->func; lib_entry++) {
 		lua_pushstring(L, lib_entry->name);
 		lua_pushvalue(L, IDX_USTRING_META);
 		lua_pushvalue(L, IDX_USTRING_POOL);
-		lua_pushcclosure(L, lib_entry->func, 2);
+		lua_pushvalue(L, IDX_USTRING_BUILDER_META);
+		lua_pushvalue(L, IDX_USTRING_STREAM_META);
+		lua_pushvalue(L, IDX_USTRING_FORMAT_META);
+		lua_pushvalue(L, IDX_USTRING_MULTISEARCH_META);
+		lua_pushvalue(L, IDX_USTRING_PATTERN_META);
+		lua_pushcclosure(L, lib_entry->func, 7);
 		lua_rawset(L, IDX_USTRING_LIB);
 	}
 
+	// Populate the ustring builder method table, with the same upvalues
+	lua_newtable(L);
+	for (lib_entry = &icu_ustring_builder_methods[0]; lib_entry->func; lib_entry++) {
+		lua_pushstring(L, lib_entry->name);
+		lua_pushvalue(L, IDX_USTRING_META);
+		lua_pushvalue(L, IDX_USTRING_POOL);
+		lua_pushvalue(L, IDX_USTRING_BUILDER_META);
+		lua_pushvalue(L, IDX_USTRING_STREAM_META);
+		lua_pushvalue(L, IDX_USTRING_FORMAT_META);
+		lua_pushvalue(L, IDX_USTRING_MULTISEARCH_META);
+		lua_pushvalue(L, IDX_USTRING_PATTERN_META);
+		lua_pushcclosure(L, lib_entry->func, 7);
+		lua_rawset(L, -3);
+	}
+	lua_setfield(L, IDX_USTRING_BUILDER_META, "__index");
+	lua_getfield(L, IDX_USTRING_BUILDER_META, "__index");
+	lua_getfield(L, -1, "tostring");
+	lua_setfield(L, IDX_USTRING_BUILDER_META, "__tostring");
+	lua_getfield(L, -1, "len");
+	lua_setfield(L, IDX_USTRING_BUILDER_META, "__len");
+	lua_pop(L,1);
+	lua_pushcfunction(L, icu_ustring_builder__gc);
+	lua_setfield(L, IDX_USTRING_BUILDER_META, "__gc");
+
+	// Populate the ustring decoder/encoder method table, with the same upvalues
+	lua_newtable(L);
+	for (lib_entry = &icu_ustring_stream_methods[0]; lib_entry->func; lib_entry++) {
+		lua_pushstring(L, lib_entry->name);
+		lua_pushvalue(L, IDX_USTRING_META);
+		lua_pushvalue(L, IDX_USTRING_POOL);
+		lua_pushvalue(L, IDX_USTRING_BUILDER_META);
+		lua_pushvalue(L, IDX_USTRING_STREAM_META);
+		lua_pushvalue(L, IDX_USTRING_FORMAT_META);
+		lua_pushvalue(L, IDX_USTRING_MULTISEARCH_META);
+		lua_pushvalue(L, IDX_USTRING_PATTERN_META);
+		lua_pushcclosure(L, lib_entry->func, 7);
+		lua_rawset(L, -3);
+	}
+	lua_setfield(L, IDX_USTRING_STREAM_META, "__index");
+	lua_pushcfunction(L, icu_ustring_stream__gc);
+	lua_setfield(L, IDX_USTRING_STREAM_META, "__gc");
+
+	// Populate the multisearch method table, with the same upvalues
+	lua_newtable(L);
+	for (lib_entry = &icu_ustring_multisearch_methods[0]; lib_entry->func; lib_entry++) {
+		lua_pushstring(L, lib_entry->name);
+		lua_pushvalue(L, IDX_USTRING_META);
+		lua_pushvalue(L, IDX_USTRING_POOL);
+		lua_pushvalue(L, IDX_USTRING_BUILDER_META);
+		lua_pushvalue(L, IDX_USTRING_STREAM_META);
+		lua_pushvalue(L, IDX_USTRING_FORMAT_META);
+		lua_pushvalue(L, IDX_USTRING_MULTISEARCH_META);
+		lua_pushvalue(L, IDX_USTRING_PATTERN_META);
+		lua_pushcclosure(L, lib_entry->func, 7);
+		lua_rawset(L, -3);
+	}
+	lua_setfield(L, IDX_USTRING_MULTISEARCH_META, "__index");
+	lua_pushcfunction(L, icu_ustring_multisearch__gc);
+	lua_setfield(L, IDX_USTRING_MULTISEARCH_META, "__gc");
+
+	// Compiled formats have a format method, which they can also be called as
+	lua_newtable(L);
+	lua_getfield(L, IDX_USTRING_LIB, "format");
+	lua_setfield(L, -2, "format");
+	lua_setfield(L, IDX_USTRING_FORMAT_META, "__index");
+	lua_getfield(L, IDX_USTRING_LIB, "format");
+	lua_setfield(L, IDX_USTRING_FORMAT_META, "__call");
+
 	// Set the "index" metamethod to lookup the lib table
 	lua_pushvalue(L, IDX_USTRING_LIB);
 	lua_setfield(L, IDX_USTRING_META, "__index");
@@ -1028,6 +3599,12 @@ int luaopen_icu_ustring(lua_State *L) {
 	lua_pushcclosure(L, icu_ustring__concat, 2);
 	lua_setfield(L, IDX_USTRING_META, "__concat");
 
+	// Set the "eq" metamethod, for transient ustrings
+	lua_pushvalue(L, IDX_USTRING_META);
+	lua_pushvalue(L, IDX_USTRING_POOL);
+	lua_pushcclosure(L, icu_ustring__eq, 2);
+	lua_setfield(L, IDX_USTRING_META, "__eq");
+
 	// Set the "lt" metamethod
 	lua_pushvalue(L, IDX_USTRING_META);
 	lua_pushvalue(L, IDX_USTRING_POOL);
@@ -1040,6 +3617,12 @@ int luaopen_icu_ustring(lua_State *L) {
 	lua_pushcclosure(L, icu_ustring__le, 2);
 	lua_setfield(L, IDX_USTRING_META, "__le");
 
+	// Set the "gc" metamethod, to remove dead ustrings from the pool
+	lua_pushvalue(L, IDX_USTRING_META);
+	lua_pushvalue(L, IDX_USTRING_POOL);
+	lua_pushcclosure(L, icu_ustring__gc, 2);
+	lua_setfield(L, IDX_USTRING_META, "__gc");
+
 	// Allow icu.ustring(...) to be equivalent to icu.ustring.decode(...)
 	lua_pushvalue(L, IDX_USTRING_META);
 	lua_pushvalue(L, IDX_USTRING_POOL);
@@ -1049,12 +3632,7 @@ int luaopen_icu_ustring(lua_State *L) {
 	lua_setmetatable(L, IDX_USTRING_LIB);
 
 	// Setting icu.ustring.empty
-	lua_newuserdata(L, 0);
-	lua_pushvalue(L, IDX_USTRING_META);
-	lua_setmetatable(L,-2);
-	lua_pushliteral(L, "");
-	lua_pushvalue(L,-2);
-	lua_rawset(L, IDX_USTRING_POOL);
+	ustring_pooled(L, &empty_uchar, 0, IDX_USTRING_META, IDX_USTRING_POOL);
 	lua_setfield(L, IDX_USTRING_LIB, "empty");
 
 	// Return the lib table
@@ -10,8 +10,14 @@
 #include <lauxlib.h>
 #include <unicode/ustring.h>
 #include <unicode/ucnv.h>
+#include <unicode/ucasemap.h>
+#include <unicode/uloc.h>
+#include <unicode/unorm2.h>
+#include "icu4lua.h"
 #include "matchengine.h"
 #include "formatting.h"
+#include "hashing.h"
+#include "search.h"
 
 static int icu_utf8_unescape(lua_State *L) {
 	UChar* temp_ustring;
@@ -102,120 +108,258 @@ static int icu_utf8_reverse(lua_State *L) {
     return 1;
 }
 
+// All icu.utf8 functions have these upvalues set
+#define UTF8_UV_CASEMAPS	lua_upvalueindex(1)
+#define UTF8_UV_PATTERN_META	lua_upvalueindex(2)
+#define UTF8_UV_PATTERNS	lua_upvalueindex(3)
+
+// Map the case of 4 ASCII bytes at once: (c + from_bias) and (c + to_bias) have their top bits
+// set for c >= first and c > last, so a letter in the range gets bit 0x20 flipped. No byte can
+// carry into the next, as they are all below 0x80.
+#define UTF8_ASCII_MAPCASE(w, from_bias, to_bias)	\
+	((w) ^ (((((w) + (from_bias)) & ~((w) + (to_bias))) & 0x80808080) >> 2))
+
+typedef int32_t UTF8CaseFunc(const UCaseMap *csm, char *dest, int32_t destCapacity, const char *src, int32_t srcLength,
+	UErrorCode *pErrorCode);
+
+static int utf8_mapcase(lua_State *L, UTF8CaseFunc* map_case, int upper) {
+	size_t byte_size;
+	const char* utf8 = luaL_checklstring(L,1,&byte_size);
+	int32_t byte_len = (int32_t)byte_size;
+	UErrorCode status = U_ZERO_ERROR;
+	int ascii_simple;
+	UCaseMap* csm = icu4lua_getcasemap(icu4lua_tocasemapcache(L, UTF8_UV_CASEMAPS), luaL_optstring(L,2,NULL), &ascii_simple, &status);
+	uint32_t from_bias = upper ? 0x1F1F1F1F : 0x3F3F3F3F; // 0x80 - 'a', 0x80 - 'A'
+	uint32_t to_bias = upper ? 0x05050505 : 0x25252525; // 0x80 - ('z' + 1), 0x80 - ('Z' + 1)
+	luaL_Buffer b;
+	char* target;
+	char* temp_buffer;
+	int32_t new_byte_len;
+	int32_t i, j, n;
+	int32_t changed_at = -1;
+	uint32_t w;
+	UChar32 c;
+
+	if (U_FAILURE(status)) {
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+
+	// Look for the first non-ASCII byte, and the first byte that needs mapping
+	for (i = 0; i < byte_len; i++) {
+		if (byte_len - i >= 4) {
+			memcpy(&w, utf8 + i, 4);
+			if (w & 0x80808080) {
+				for (; !(utf8[i] & 0x80); i++) {
+					if (changed_at < 0 && (upper ? (utf8[i] >= 'a' && utf8[i] <= 'z') : (utf8[i] >= 'A' && utf8[i] <= 'Z'))) {
+						changed_at = i;
+					}
+				}
+				break;
+			}
+			if (changed_at < 0 && UTF8_ASCII_MAPCASE(w, from_bias, to_bias) != w) {
+				changed_at = i;
+			}
+			i += 3;
+		}
+		else if (utf8[i] & 0x80) {
+			break;
+		}
+		else if (changed_at < 0 && (upper ? (utf8[i] >= 'a' && utf8[i] <= 'z') : (utf8[i] >= 'A' && utf8[i] <= 'Z'))) {
+			changed_at = i;
+		}
+	}
+
+	// Keep the old behaviour of failing on invalid UTF-8
+	for (j = i; j < byte_len; ) {
+		U8_NEXT(utf8, j, byte_len, c);
+		if (c < 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, u_errorName(U_INVALID_CHAR_FOUND));
+			return 2;
+		}
+	}
+
+	if (i == byte_len && ascii_simple) {
+		if (changed_at < 0) {
+			lua_settop(L,1);
+			return 1;
+		}
+		// All ASCII, so map straight into the buffer a word at a time
+		luaL_buffinit(L, &b);
+		for (i = 0; i < byte_len; i += n) {
+			target = luaL_prepbuffer(&b);
+			n = byte_len - i < LUAL_BUFFERSIZE ? byte_len - i : LUAL_BUFFERSIZE;
+			for (j = 0; j + 4 <= n; j += 4) {
+				memcpy(&w, utf8 + i + j, 4);
+				w = UTF8_ASCII_MAPCASE(w, from_bias, to_bias);
+				memcpy(target + j, &w, 4);
+			}
+			for (; j < n; j++) {
+				target[j] = (upper ? (utf8[i+j] >= 'a' && utf8[i+j] <= 'z') : (utf8[i+j] >= 'A' && utf8[i+j] <= 'Z'))
+					? (utf8[i+j] ^ 0x20) : utf8[i+j];
+			}
+			luaL_addsize(&b, n);
+		}
+		luaL_pushresult(&b);
+		return 1;
+	}
+
+	// Try mapping straight into the buffer, and only allocate if the result is too long for it
+	luaL_buffinit(L, &b);
+	target = luaL_prepbuffer(&b);
+	new_byte_len = map_case(csm, target, LUAL_BUFFERSIZE, utf8, byte_len, &status);
+	if (status == U_BUFFER_OVERFLOW_ERROR) {
+		luaL_pushresult(&b);
+		lua_pop(L,1);
+		temp_buffer = (char*)lua_newuserdata(L, new_byte_len);
+		status = U_ZERO_ERROR;
+		map_case(csm, temp_buffer, new_byte_len, utf8, byte_len, &status);
+		if (U_FAILURE(status)) {
+			lua_pushnil(L);
+			lua_pushstring(L, u_errorName(status));
+			return 2;
+		}
+		lua_pushlstring(L, temp_buffer, new_byte_len);
+		return 1;
+	}
+	if (U_FAILURE(status)) {
+		lua_pushnil(L);
+		lua_pushstring(L, u_errorName(status));
+		return 2;
+	}
+	luaL_addsize(&b, new_byte_len);
+	luaL_pushresult(&b);
+	return 1;
+}
+
 static int icu_utf8_upper(lua_State *L) {
-	int32_t byte_len;
-    size_t byte_size;
-    const char* utf8;
-    char* utf8_upper;
-    int32_t uchar_len;
-    UChar* ustring;
-    UErrorCode status;
-    int32_t buf_size;
-    utf8 = luaL_checklstring(L,1,&byte_size);
-	byte_len = (int32_t)byte_size;
-    status = U_ZERO_ERROR;
-    u_strFromUTF8(NULL, 0, &uchar_len, utf8, (int32_t)byte_len, &status);
-    if (U_FAILURE(status) && status != U_BUFFER_OVERFLOW_ERROR) {
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    status = U_ZERO_ERROR;
-    buf_size = sizeof(UChar) * uchar_len * 2; // i assume the worst case is every UChar needs to be 2?
-    ustring = (UChar*)malloc(buf_size);
-    u_strFromUTF8(ustring, uchar_len, NULL, utf8, (int32_t)byte_len, &status);
-    if (U_FAILURE(status)) {
-        free(ustring);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    status = U_ZERO_ERROR;
-    u_strToUpper(ustring, buf_size, ustring, uchar_len, lua_isnoneornil(L,2) ? NULL : lua_tostring(L,2), &status);
-    if (U_FAILURE(status)) {
-        free(ustring);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    status = U_ZERO_ERROR;
-    u_strToUTF8(NULL, 0, &byte_len, ustring, uchar_len, &status);
-    if (U_FAILURE(status) && status != U_BUFFER_OVERFLOW_ERROR) {
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    utf8_upper = (char*)malloc(byte_len);
-    status = U_ZERO_ERROR;
-    u_strToUTF8(utf8_upper, byte_len, NULL, ustring, uchar_len, &status);
-    free(ustring);
-    if (U_FAILURE(status)) {
-        free(utf8_upper);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    lua_pushlstring(L, utf8_upper, byte_len);
-    free(utf8_upper);
-    return 1;
+	return utf8_mapcase(L, ucasemap_utf8ToUpper, 1);
 }
 
 static int icu_utf8_lower(lua_State *L) {
-    size_t byte_size;
-	int32_t byte_len;
-    const char* utf8;
-    char* utf8_lower;
-    int32_t uchar_len;
-    UChar* ustring;
-    UErrorCode status;
-    int32_t buf_size;
-    utf8 = luaL_checklstring(L,1,&byte_size);
-	byte_len = (int32_t)byte_size;
-    status = U_ZERO_ERROR;
-    u_strFromUTF8(NULL, 0, &uchar_len, utf8, (int32_t)byte_len, &status);
-    if (U_FAILURE(status) && status != U_BUFFER_OVERFLOW_ERROR) {
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    status = U_ZERO_ERROR;
-    buf_size = sizeof(UChar) * uchar_len * 2;
-    ustring = (UChar*)malloc(buf_size); // i assume the worst case is every UChar needs to be 2
-    u_strFromUTF8(ustring, uchar_len, NULL, utf8, (int32_t)byte_len, &status);
-    if (U_FAILURE(status)) {
-        free(ustring);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    status = U_ZERO_ERROR;
-    u_strToLower(ustring, buf_size, ustring, uchar_len, lua_isnoneornil(L,2) ? NULL : lua_tostring(L,2), &status);
-    if (U_FAILURE(status)) {
-        free(ustring);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    status = U_ZERO_ERROR;
-    u_strToUTF8(NULL, 0, &byte_len, ustring, uchar_len, &status);
-    if (U_FAILURE(status) && status != U_BUFFER_OVERFLOW_ERROR) {
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    utf8_lower = (char*)malloc(byte_len);
-    status = U_ZERO_ERROR;
-    u_strToUTF8(utf8_lower, byte_len, NULL, ustring, uchar_len, &status);
-    free(ustring);
-    if (U_FAILURE(status)) {
-        free(utf8_lower);
-        lua_pushnil(L);
-        lua_pushstring(L, u_errorName(status));
-        return 2;
-    }
-    lua_pushlstring(L, utf8_lower, byte_len);
-    free(utf8_lower);
-    return 1;
+	return utf8_mapcase(L, ucasemap_utf8ToLower, 0);
+}
+
+// Hashing. Text is folded or normalized a chunk at a time, so the whole folded or normalized
+// form never has to be put together. Chunks end on a character boundary for folding, which
+// works on each character by itself, and on a normalization boundary for NFC.
+
+#define UTF8_HASH_CHUNK	256
+
+static const char* const utf8_hash_forms[] = {"none", "nfc", "fold", NULL};
+
+static void utf8_hashfolded(XXH32State* state, const UCaseMap* csm, const char* utf8, int32_t byte_len, UErrorCode* status) {
+	// Full case folding turns one character into at most three, each no longer in UTF-8
+	char folded[(UTF8_HASH_CHUNK + 4) * 3];
+	int32_t pos, end, folded_len;
+	for (pos = 0; pos < byte_len; pos = end) {
+		end = (byte_len - pos > UTF8_HASH_CHUNK) ? pos + UTF8_HASH_CHUNK : byte_len;
+		while (end < byte_len && U8_IS_TRAIL(utf8[end]) && end - pos < UTF8_HASH_CHUNK + 3) {
+			end++;
+		}
+		folded_len = ucasemap_utf8FoldCase(csm, folded, sizeof(folded), utf8 + pos, end - pos, status);
+		if (U_FAILURE(*status)) {
+			return;
+		}
+		xxh32_update(state, folded, folded_len);
+	}
+}
+
+static void utf8_hashnfc(XXH32State* state, const char* utf8, int32_t byte_len, UErrorCode* status) {
+	const UNormalizer2* nfc = unorm2_getNFCInstance(status);
+	UChar stack_buffer[UTF8_HASH_CHUNK * 4];
+	char stack_utf8[UTF8_HASH_CHUNK * 9];
+	UChar* buffer;
+	UChar* normalized;
+	char* normalized_utf8;
+	int32_t pos, end, next, uchar_len, normalized_len, out_len, i;
+	UChar32 c;
+
+	if (U_FAILURE(*status)) {
+		return;
+	}
+	for (pos = 0; pos < byte_len; pos = end) {
+		end = (byte_len - pos > UTF8_HASH_CHUNK) ? pos + UTF8_HASH_CHUNK : byte_len;
+		while (end < byte_len) {
+			if (U8_IS_TRAIL(utf8[end])) {
+				end++;
+				continue;
+			}
+			next = end;
+			U8_NEXT(utf8, next, byte_len, c);
+			if (c < 0 || unorm2_hasBoundaryBefore(nfc, c)) {
+				break;
+			}
+			end = next;
+		}
+
+		// ASCII is already in NFC, and the chunk ends on a boundary
+		for (i = pos; i < end && !(utf8[i] & 0x80); i++);
+		if (i == end) {
+			xxh32_update(state, utf8 + pos, end - pos);
+			continue;
+		}
+
+		// A very long run of combining marks may not fit in the stack buffers
+		if (end - pos <= UTF8_HASH_CHUNK) {
+			buffer = stack_buffer;
+			normalized_utf8 = stack_utf8;
+		}
+		else {
+			buffer = (UChar*)malloc(sizeof(UChar) * (end - pos) * 4 + (end - pos) * 9);
+			if (!buffer) {
+				*status = U_MEMORY_ALLOCATION_ERROR;
+				return;
+			}
+			normalized_utf8 = (char*)(buffer + (end - pos) * 4);
+		}
+		normalized = buffer + (end - pos);
+		u_strFromUTF8WithSub(buffer, end - pos, &uchar_len, utf8 + pos, end - pos, 0xFFFD, NULL, status);
+		normalized_len = unorm2_normalize(nfc, buffer, uchar_len, normalized, (end - pos) * 3, status);
+		u_strToUTF8(normalized_utf8, (end - pos) * 9, &out_len, normalized, normalized_len, status);
+		if (U_SUCCESS(*status)) {
+			xxh32_update(state, normalized_utf8, out_len);
+		}
+		if (buffer != stack_buffer) {
+			free(buffer);
+		}
+		if (U_FAILURE(*status)) {
+			return;
+		}
+	}
+}
+
+static int icu_utf8_hash(lua_State *L) {
+	size_t byte_size;
+	const char* utf8 = luaL_checklstring(L,1,&byte_size);
+	uint32_t seed = (uint32_t)luaL_optinteger(L,2,0);
+	XXH32State state;
+	UErrorCode status = U_ZERO_ERROR;
+	UCaseMap* csm;
+	int ascii_simple;
+	xxh32_reset(&state, seed);
+	switch (luaL_checkoption(L,3,"none",utf8_hash_forms)) {
+		case 1: // nfc
+			utf8_hashnfc(&state, utf8, (int32_t)byte_size, &status);
+			break;
+		case 2: // fold
+			csm = icu4lua_getcasemap(icu4lua_tocasemapcache(L, UTF8_UV_CASEMAPS), "", &ascii_simple, &status);
+			if (U_SUCCESS(status)) {
+				utf8_hashfolded(&state, csm, utf8, (int32_t)byte_size, &status);
+			}
+			break;
+		default:
+			xxh32_update(&state, utf8, byte_size);
+			break;
+	}
+	if (U_FAILURE(status)) {
+		lua_pushstring(L, u_errorName(status));
+		return lua_error(L);
+	}
+	lua_pushnumber(L, (lua_Number)xxh32_digest(&state));
+	return 1;
 }
 
 static int icu_utf8_codepoint(lua_State *L) {
@@ -381,76 +525,153 @@ static int icu_utf8_char(lua_State *L) {
     return 1;
 }
 
-static void utf8_pushrange(UMatchState* ms, uint32_t start_state, uint32_t end_state) {
-	lua_pushlstring(ms->L, (const char*)(ms->context) + (start_state >> 1), (end_state >> 1) - (start_state >> 1));
+static void utf8_pushrange(UMatchState* ms, int32_t start, int32_t end) {
+	lua_pushlstring(ms->L, (const char*)(ms->context) + start, end - start);
 }
 
-static int icu_utf8_match(lua_State *L) {
-	UCharIterator sourceIter;
+static int utf8_ispattern(lua_State *L, int arg) {
+	int is_pattern = 0;
+	if (lua_getmetatable(L,arg)) {
+		is_pattern = lua_rawequal(L,-1,UTF8_UV_PATTERN_META);
+		lua_pop(L,1);
+	}
+	return is_pattern;
+}
+
+// The limit set by icu.utf8.setmatchlimit
+static int32_t utf8_matchlimit(lua_State *L) {
+	return ((UPatternCache*)lua_touserdata(L, UTF8_UV_PATTERNS))->match_limit;
+}
+
+// Push the compiled form of the pattern at arg. That is either the value itself, or what the
+// cache has for the string (compiling it and adding it if needs be). Lua strings are interned,
+// so the same pattern string always has the same address while the cache keeps it alive.
+static UPattern* utf8_pushpattern(lua_State *L, int arg) {
+	UPatternCache* cache = (UPatternCache*)lua_touserdata(L, UTF8_UV_PATTERNS);
 	UCharIterator pattIter;
-	const char* string_utf8;
-	size_t string_utf8_len;
 	const char* patt_utf8;
 	size_t patt_utf8_len;
+	UPattern* patt;
+
+	if (utf8_ispattern(L,arg)) {
+		lua_pushvalue(L,arg);
+		return (UPattern*)lua_touserdata(L,-1);
+	}
+	patt_utf8 = luaL_checklstring(L,arg,&patt_utf8_len);
+	patt = upattern_pushcached(L, cache, patt_utf8);
+	if (patt) {
+		return patt;
+	}
+	uiter_setUTF8(&pattIter, patt_utf8, (int32_t)patt_utf8_len);
+	patt = upattern_compile(L, &pattIter);
+	lua_pushvalue(L, UTF8_UV_PATTERN_META);
+	lua_setmetatable(L,-2);
+	upattern_addcached(L, cache, patt_utf8, arg);
+	return patt;
+}
+
+static int icu_utf8_pattern(lua_State *L) {
+	utf8_pushpattern(L,1);
+	return 1;
+}
+
+static int icu_utf8_setmatchlimit(lua_State *L) {
+	UPatternCache* cache = (UPatternCache*)lua_touserdata(L, UTF8_UV_PATTERNS);
+	int32_t old_limit = cache->match_limit;
+	if (lua_isnoneornil(L,1)) {
+		cache->match_limit = -1;
+	}
+	else {
+		lua_Integer limit = luaL_checkinteger(L,1);
+		luaL_argcheck(L, limit >= 0, 1, "match limit cannot be negative");
+		cache->match_limit = (limit > INT32_MAX) ? INT32_MAX : (int32_t)limit;
+	}
+	if (old_limit < 0) {
+		lua_pushnil(L);
+	}
+	else {
+		lua_pushinteger(L, old_limit);
+	}
+	return 1;
+}
+
+static int icu_utf8_match(lua_State *L) {
+	const char* string_utf8;
+	size_t string_utf8_len;
 	UMatchState ms;
 	int init;
 
 	string_utf8 = luaL_checklstring(L,1,&string_utf8_len);
-	patt_utf8 = luaL_checklstring(L,2,&patt_utf8_len);
-	uiter_setUTF8(&sourceIter, string_utf8, (int32_t)string_utf8_len);
-	uiter_setUTF8(&pattIter, patt_utf8, (int32_t)patt_utf8_len);
+	umatch_setsource(&ms, string_utf8, (int32_t)string_utf8_len);
 	init = luaL_optint(L,3,0);
 	ms.L = L;
+	umatch_setpattern(&ms, utf8_pushpattern(L,2), utf8_matchlimit(L));
 	ms.pushRange = utf8_pushrange;
-	ms.context = (void*)string_utf8;
 
-	return iter_match(&ms, &pattIter, &sourceIter, init, 0);
+	return umatch_find_utf8(&ms, init, 0);
 }
 
-static const char *lmemfind (const char *s1, size_t l1, const char *s2, size_t l2) {
-	if (l2 == 0) {
-		return s1;  /* empty strings are everywhere */
-	}
-	else if (l2 > l1) {
-		return NULL;  /* avoids a negative `l1' */
-	}
-	else {
-		const char *init;  /* to search for a `*s2' inside `s1' */
-		l2--;  /* 1st char will be checked by `memchr' */
-		l1 = l1-l2;  /* `s2' cannot be found after that */
-		while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-			init++;   /* 1st char is already checked */
-			if (memcmp(init, s2+1, l2) == 0) {
-				return init-1;
-			}
-			else {  /* correct `l1' and `s1' to try again */
-				l1 -= init-s1;
-				s1 = init;
-			}
+// A pattern with none of the special characters in it can only match itself
+static int utf8_isplainpattern(const char* patt, size_t patt_len) {
+	size_t i;
+	for (i = 0; i < patt_len; i++) {
+		if (patt[i] != 0 && strchr(SPECIALS, patt[i])) {
+			return 0;
 		}
-		return NULL;  /* not found */
 	}
+	return 1;
 }
 
 static int icu_utf8_find(lua_State *L) {
 	size_t source_byte_len, patt_byte_len;
 	const char* source_utf8 = luaL_checklstring(L, 1, &source_byte_len);
-	const char* patt_utf8 = luaL_checklstring(L, 2, &patt_byte_len);
-	UCharIterator sourceIter, pattIter;
+	const char* patt_utf8 = NULL;
 	UMatchState ms;
+	int init = luaL_optint(L,3,0);
 
-	uiter_setUTF8(&sourceIter, source_utf8, (int32_t)source_byte_len);
-	uiter_setUTF8(&pattIter, patt_utf8, (int32_t)patt_byte_len);
+	if (lua_toboolean(L,4) || !utf8_ispattern(L,2)) {
+		patt_utf8 = luaL_checklstring(L, 2, &patt_byte_len);
+	}
+	if (patt_utf8 && (lua_toboolean(L,4) || utf8_isplainpattern(patt_utf8, patt_byte_len))) {
+		// Positions are UTF-16 indices, as for patterns, counted by moving a UTF-8 UCharIterator,
+		// whose state is the byte offset shifted left one (plus one if it is between the two
+		// halves of a supplementary character, in which case the offset is already past it)
+		UCharIterator sourceIter;
+		size_t offset;
+		const char* found;
+		UErrorCode status;
+		uiter_setUTF8(&sourceIter, source_utf8, (int32_t)source_byte_len);
+		if (init > 0) {
+			sourceIter.move(&sourceIter, init-1, UITER_ZERO);
+		}
+		else if (init < 0) {
+			sourceIter.move(&sourceIter, init, UITER_LIMIT);
+		}
+		offset = uiter_getState(&sourceIter) >> 1;
+		found = search_bytes(source_utf8 + offset, source_byte_len - offset, patt_utf8, patt_byte_len);
+		if (!found) {
+			lua_pushnil(L);
+			return 1;
+		}
+		status = U_ZERO_ERROR;
+		uiter_setState(&sourceIter, (uint32_t)(found - source_utf8) << 1, &status);
+		lua_pushinteger(L, 1 + sourceIter.getIndex(&sourceIter, UITER_CURRENT));
+		status = U_ZERO_ERROR;
+		uiter_setState(&sourceIter, (uint32_t)((found + patt_byte_len) - source_utf8) << 1, &status);
+		lua_pushinteger(L, sourceIter.getIndex(&sourceIter, UITER_CURRENT));
+		return 2;
+	}
 
+	umatch_setsource(&ms, source_utf8, (int32_t)source_byte_len);
 	ms.L = L;
+	umatch_setpattern(&ms, utf8_pushpattern(L,2), utf8_matchlimit(L));
 	ms.pushRange = utf8_pushrange;
-	ms.context = (void*)source_utf8;
 
-	return iter_match(&ms, &pattIter, &sourceIter, luaL_optint(L,3,0), 1);
+	return umatch_find_utf8(&ms, init, 1);
 }
 
-static void utf8_addrange(UMatchState* ms, uint32_t start_state, uint32_t end_state) {
-	luaL_addlstring(ms->b, (const char*)(ms->context) + (start_state >> 1), (end_state >> 1) - (start_state >> 1));
+static void utf8_addrange(UMatchState* ms, int32_t start, int32_t end) {
+	luaL_addlstring(ms->b, (const char*)(ms->context) + start, end - start);
 }
 
 static void utf8_addmatch(UMatchState* ms) {
@@ -471,14 +692,14 @@ static void utf8_addmatch(UMatchState* ms) {
 						luaL_addchar(b, news[i]);
 					}
 					else if (news[i] == '0') {
-						ms->addRange(ms, ms->capture[0].start_state, ms->end_state);
+						ms->addRange(ms, ms->start, ms->end);
 					}
 					else {
 						int cnum = news[i] - '1';
 						if (cnum >= ms->level) {
 							luaL_error(L, "invalid capture index");
 						}
-						ms->addRange(ms, ms->capture[cnum].start_state, ms->capture[cnum].end_state);
+						ms->addRange(ms, ms->capture[cnum].start, ms->capture[cnum].end);
 					}
 				}
 			}
@@ -487,20 +708,20 @@ static void utf8_addmatch(UMatchState* ms) {
 		case LUA_TFUNCTION:
 			if (ms->level == 0) {
 				lua_pushvalue(L, 3);
-				ms->pushRange(ms, ms->capture[0].start_state, ms->end_state);
+				ms->pushRange(ms, ms->start, ms->end);
 				lua_call(L,1,1);
 			}
 			else {
 				int i;
 				lua_pushvalue(L, 3);
 				for (i = 0; i < ms->level; i++) {
-					ms->pushRange(ms, ms->capture[i].start_state, ms->capture[i].end_state);
+					ms->pushRange(ms, ms->capture[i].start, ms->capture[i].end);
 				}
 				lua_call(L,ms->level,1);
 			}
 			break;
-		case LUA_TTABLE:
-			ms->pushRange(ms, ms->capture[0].start_state, ms->end_state);
+		case LUA_TTABLE: // keyed by the first capture (the whole match, if there are none)
+			ms->pushRange(ms, ms->capture[0].start, ms->capture[0].end);
 			lua_gettable(L,3);
 			break;
 		default:
@@ -509,34 +730,31 @@ static void utf8_addmatch(UMatchState* ms) {
 	}
 	if (!lua_toboolean(L,-1)) {
 		lua_pop(L,1);
-		ms->pushRange(ms, ms->capture[0].start_state, ms->end_state);
+		ms->pushRange(ms, ms->start, ms->end);
 	}
 	luaL_addvalue(b);
 }
 
 static int icu_utf8_gsub(lua_State *L) {
-	UCharIterator sourceIter;
-	UCharIterator pattIter;
-	size_t string_byte_len, patt_byte_len;
+	size_t string_byte_len;
 	const char* string_utf8 = luaL_checklstring(L, 1, &string_byte_len);
-	const char* patt_utf8 = luaL_checklstring(L, 2, &patt_byte_len);
 	UMatchState ms;
 	int max_s = luaL_optint(L, 4, string_byte_len+1);
 	int replacements;
 	luaL_Buffer b;
 
-	uiter_setUTF8(&sourceIter, string_utf8, (int32_t)string_byte_len);
-	uiter_setUTF8(&pattIter, patt_utf8, (int32_t)patt_byte_len);
+	umatch_setsource(&ms, string_utf8, (int32_t)string_byte_len);
 
+	lua_settop(L, 4); // the compiled pattern (and any frames) go above the replacement and count
 	ms.L = L;
-	ms.context = (void*)string_utf8;
+	umatch_setpattern(&ms, utf8_pushpattern(L,2), utf8_matchlimit(L));
 	ms.b = &b;
 	ms.pushRange = utf8_pushrange;
 	ms.addRange = utf8_addrange;
 
 	luaL_buffinit(L, &b);
 
-	replacements = uiter_gsub_aux(&ms, &pattIter, &sourceIter, utf8_addmatch, max_s);
+	replacements = umatch_gsub_utf8(&ms, utf8_addmatch, max_s);
 
 	luaL_pushresult(&b);
 	lua_pushinteger(L, replacements);
@@ -544,20 +762,21 @@ static int icu_utf8_gsub(lua_State *L) {
 }
 
 static int icu_utf8_gmatch(lua_State *L) {
-	size_t source_byte_len, patt_byte_len;
+	size_t source_byte_len;
 	const char* source_utf8 = luaL_checklstring(L, 1, &source_byte_len);
-	const char* patt_utf8 = luaL_checklstring(L, 2, &patt_byte_len);
+	UPattern* patt;
 	GmatchState* gms;
+	int upvalues = 3;
+	patt = utf8_pushpattern(L, 2);
+	lua_replace(L, 2);
 	lua_settop(L, 2);
 	gms = (GmatchState*)lua_newuserdata(L, sizeof(GmatchState));
-	gms->matched_empty_end = 0;
+	gms->position = 0;
 	gms->ms.L = L;
 	gms->ms.pushRange = utf8_pushrange;
-	gms->ms.context = (void*)source_utf8;
-	uiter_setUTF8(&(gms->sourceIter), source_utf8, (int32_t)source_byte_len);
-	uiter_setUTF8(&(gms->pattIter), patt_utf8, (int32_t)patt_byte_len);
-	gms->source_state = uiter_getState(&(gms->sourceIter));
-	lua_pushcclosure(L, gmatch_aux, 3); // strings kept in upvalues just to keep them from being garbage
+	umatch_setsource(&gms->ms, source_utf8, (int32_t)source_byte_len);
+	upvalues += umatch_setpattern(&gms->ms, patt, utf8_matchlimit(L)); // [frames]
+	lua_pushcclosure(L, umatch_gmatch_aux_utf8, upvalues); // strings kept in upvalues just to keep them from being garbage
 	return 1;
 }
 
@@ -888,12 +1107,15 @@ static const luaL_Reg icu_utf8_lib[] = {
 	{"reverse", icu_utf8_reverse},
 	{"upper", icu_utf8_upper},
 	{"lower", icu_utf8_lower},
+	{"hash", icu_utf8_hash},
 	{"codepoint", icu_utf8_codepoint},
 	{"char", icu_utf8_char},
 	{"match", icu_utf8_match},
 	{"gsub", icu_utf8_gsub},
 	{"find", icu_utf8_find},
 	{"gmatch", icu_utf8_gmatch},
+	{"pattern", icu_utf8_pattern},
+	{"setmatchlimit", icu_utf8_setmatchlimit},
 	{"format", icu_utf8_format},
 
 	{"loadstring", icu_utf8_loadstring},
@@ -904,7 +1126,37 @@ static const luaL_Reg icu_utf8_lib[] = {
 };
 
 int luaopen_icu_utf8(lua_State *L) {
-	luaL_register(L, "icu.utf8", icu_utf8_lib);
+	int IDX_CASEMAPS, IDX_PATTERN_META, IDX_PATTERNS, IDX_UTF8_LIB;
+	const luaL_Reg* lib_entry;
+	luaL_Reg null_entry = {NULL,NULL};
+	UPatternCache* patterns;
+
+	// The case map cache belongs to icu.ustring
+	icu4lua_requireustringlib(L);
+	icu4lua_pushcasemapcache(L);
+	IDX_CASEMAPS = lua_gettop(L);
+
+	// Create (or find) the compiled pattern metatable, which icu.ustring shares
+	luaL_newmetatable(L, "icu.pattern");
+	IDX_PATTERN_META = lua_gettop(L);
+
+	// Create the compiled pattern cache
+	patterns = (UPatternCache*)lua_newuserdata(L, sizeof(UPatternCache));
+	patterns->count = 0;
+	patterns->match_limit = -1;
+	IDX_PATTERNS = lua_gettop(L);
+
+	luaL_register(L, "icu.utf8", &null_entry);
+	IDX_UTF8_LIB = lua_gettop(L);
+
+	for (lib_entry = icu_utf8_lib; lib_entry->func; lib_entry++) {
+		lua_pushstring(L, lib_entry->name);
+		lua_pushvalue(L, IDX_CASEMAPS);
+		lua_pushvalue(L, IDX_PATTERN_META);
+		lua_pushvalue(L, IDX_PATTERNS);
+		lua_pushcclosure(L, lib_entry->func, 3);
+		lua_rawset(L, IDX_UTF8_LIB);
+	}
 
     lua_pushliteral(L,"\xEF\xBB\xBF");
 	lua_setfield(L,-2,"bom");
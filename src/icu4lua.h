@@ -1,6 +1,82 @@
 
 #include <string.h>
 
+// A ustring is a userdata block that starts with this header. The UChars themselves normally
+// follow directly after it, but a "view" ustring has no UChars of its own - data points into the
+// UChars of another ustring, which the view keeps alive through a registry reference.
+typedef struct icu4lua_UString {
+	const UChar* data;
+	int32_t length; // in UChars
+	uint32_t hash; // xxHash32 of the UChars with seed 0, only set if hash_valid is
+	int hash_valid;
+	int pool_ref; // index of this ustring in the pool's back-reference table, 0 if not pooled
+	int32_t cp_length; // length in code points, -1 until it has been counted
+	int32_t* cp_index; // UChar offset of every ICU4LUA_CPINDEX_STEP'th code point, built on demand
+	int view_ref; // registry reference to the ustring this is a view of, LUA_NOREF if not a view
+	int fold_ref; // registry reference to the case-folded ustring, LUA_NOREF until folded, LUA_REFNIL if already folded
+} icu4lua_UString;
+
+#define ICU4LUA_CPINDEX_STEP	64
+
+// The ustring pool is a userdata owned by icu.ustring. Other modules only ever call intern(),
+// which pushes the pooled ustring with the given content, creating it first if necessary, and
+// slice(), which pushes a ustring with part of the content of another one (possibly as a view).
+typedef void icu4lua_InternUStringFunc(lua_State *L, const UChar* ustr, int32_t ustr_len, int meta_idx, int pool_idx);
+typedef void icu4lua_SliceUStringFunc(lua_State *L, int ustring_idx, int32_t start, int32_t length, int meta_idx, int pool_idx);
+
+typedef struct icu4lua_UStringPool {
+	icu4lua_InternUStringFunc* intern;
+	icu4lua_SliceUStringFunc* slice;
+} icu4lua_UStringPool;
+
+// The converter cache is a userdata owned by icu.ustring. open() takes a converter for the given
+// encoding out of the cache, opening a new one only if there is none, and close() resets the
+// converter and gives it back, so converters are not opened and closed for every conversion.
+// hold() pushes a userdata that converters can be kept in while anything that might raise an
+// error is done with them. If it is collected with converters still in it, they are given back
+// then; release() gives them back straight away.
+typedef struct icu4lua_ConverterCache icu4lua_ConverterCache;
+
+#define ICU4LUA_HELD_CONVERTERS	2
+
+typedef struct icu4lua_HeldConverters {
+	icu4lua_ConverterCache* cache;
+	struct UConverter* conv[ICU4LUA_HELD_CONVERTERS]; // NULL if not in use
+} icu4lua_HeldConverters;
+
+typedef struct UConverter* icu4lua_OpenConverterFunc(icu4lua_ConverterCache* cache, const char* encoding, UErrorCode* status);
+typedef void icu4lua_CloseConverterFunc(icu4lua_ConverterCache* cache, struct UConverter* conv);
+typedef icu4lua_HeldConverters* icu4lua_HoldConvertersFunc(lua_State *L, icu4lua_ConverterCache* cache);
+typedef void icu4lua_ReleaseConvertersFunc(icu4lua_HeldConverters* held);
+
+struct icu4lua_ConverterCache {
+	icu4lua_OpenConverterFunc* open;
+	icu4lua_CloseConverterFunc* close;
+	icu4lua_HoldConvertersFunc* hold;
+	icu4lua_ReleaseConvertersFunc* release;
+};
+
+#define icu4lua_pushconvertercache(L)	(lua_getfield((L),LUA_REGISTRYINDEX,"icu.ustring converter cache"))
+#define icu4lua_toconvertercache(L,i)	((icu4lua_ConverterCache*)lua_touserdata((L),(i)))
+#define icu4lua_openconverter(cache,encoding,status)	((cache)->open((cache), (encoding), (status)))
+#define icu4lua_closeconverter(cache,conv)			((cache)->close((cache), (conv)))
+#define icu4lua_holdconverters(L,cache)				((cache)->hold((L), (cache)))
+#define icu4lua_releaseconverters(held)				((held)->cache->release(held))
+
+// The case map cache is a userdata owned by icu.ustring. get() returns the UCaseMap for a locale
+// (or the default locale, if it is NULL), opening it only if it is not one of the last few used.
+// ascii_simple is set if ASCII maps to ASCII the usual way (not Turkish, Azeri or Lithuanian).
+typedef struct icu4lua_CaseMapCache icu4lua_CaseMapCache;
+typedef struct UCaseMap* icu4lua_GetCaseMapFunc(icu4lua_CaseMapCache* cache, const char* locale, int* ascii_simple, UErrorCode* status);
+
+struct icu4lua_CaseMapCache {
+	icu4lua_GetCaseMapFunc* get;
+};
+
+#define icu4lua_pushcasemapcache(L)	(lua_getfield((L),LUA_REGISTRYINDEX,"icu.ustring casemap cache"))
+#define icu4lua_tocasemapcache(L,i)	((icu4lua_CaseMapCache*)lua_touserdata((L),(i)))
+#define icu4lua_getcasemap(cache,locale,ascii_simple,status)	((cache)->get((cache), (locale), (ascii_simple), (status)))
+
 // Useful macros for dealing with ustrings
 // meta_idx and pool_idx indices must be positive!
 
@@ -17,13 +93,14 @@
 #define icu4lua_pushustringmetatable(L)	(lua_getfield((L),LUA_REGISTRYINDEX,"icu.ustring"))
 #define icu4lua_pushustringpool(L)		(lua_getfield((L),LUA_REGISTRYINDEX,"icu.ustring pool"))
 
-#define icu4lua_ustrlen(L,i)			(lua_objlen((L),(i)) / sizeof(UChar))
+#define icu4lua_ustrlen(L,i)			((size_t)icu4lua_toustringheader((L),(i))->length)
+#define icu4lua_toustringheader(L,i)	((icu4lua_UString*)lua_touserdata((L),(i)))
+#define icu4lua_topool(L,pool_idx)		((icu4lua_UStringPool*)lua_touserdata((L),(pool_idx)))
 
 #define icu4lua_pushustring(L,ustr,ustr_len,meta_idx,pool_idx)    										\
-	{																									\
-		lua_pushlstring((L), (const char*)(ustr), (ustr_len) * sizeof(UChar));							\
-		icu4lua_internrawustring((L),(meta_idx),(pool_idx));											\
-	}
+	(icu4lua_topool((L),(pool_idx))->intern((L), (ustr), (int32_t)(ustr_len), (meta_idx), (pool_idx)))
+#define icu4lua_pushustringslice(L,ustring_idx,start,length,meta_idx,pool_idx)						\
+	(icu4lua_topool((L),(pool_idx))->slice((L), (ustring_idx), (int32_t)(start), (int32_t)(length), (meta_idx), (pool_idx)))
 
 #define icu4lua_checkustring(L,i,meta_idx)																\
 	(																									\
@@ -38,28 +115,16 @@
 
 #define icu4lua_internrawustring(L,meta_idx,pool_idx)													\
 	{																									\
-		lua_pushvalue((L),-1);																			\
-		lua_rawget((L), (pool_idx));																	\
-		if (lua_isnil((L),-1)) {																		\
-			UChar* ___new_ustring;																		\
-			lua_pop((L),1);																				\
-			___new_ustring = (UChar*)lua_newuserdata((L), lua_objlen((L),-1));							\
-			memcpy(___new_ustring, lua_tostring((L),-2), lua_objlen((L),-2));							\
-			lua_insert((L),-2);																			\
-			lua_pushvalue((L),-2);																		\
-			lua_rawset((L),(pool_idx));																	\
-			lua_pushvalue((L),(meta_idx));																\
-			lua_setmetatable((L),-2);																	\
-		}																								\
-		else {																							\
-			lua_remove((L),-2);																			\
-		}																								\
+		size_t ___raw_len;																				\
+		const char* ___raw = lua_tolstring((L),-1,&___raw_len);										\
+		icu4lua_pushustring((L), (const UChar*)___raw, ___raw_len / sizeof(UChar), (meta_idx), (pool_idx));	\
+		lua_remove((L),-2);																				\
 	}
 
-#define icu4lua_trustustring(L,i)		((UChar*)lua_touserdata((L),(i)))
+#define icu4lua_trustustring(L,i)		((UChar*)icu4lua_toustringheader((L),(i))->data)
 
 #define icu4lua_pushrawustring(L,i)																		\
-	lua_pushlstring(L, (const char*)lua_touserdata((L),(i)), lua_objlen((L),(i)))
+	lua_pushlstring(L, (const char*)icu4lua_trustustring((L),(i)), icu4lua_ustrlen((L),(i)) * sizeof(UChar))
 
 #define icu4lua_addustring(B, ustr, ustr_len)															\
 	luaL_addlstring((B), (const char*)(ustr), (ustr_len) * sizeof(UChar))
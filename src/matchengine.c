@@ -1,137 +1,133 @@
 
 // This is a modified version of the matching code found in Lua's lstrlib.c
-// adapted for use with ICU UCharIterators (and so can be used on both ustrings
-// and utf-8 Lua strings)
+// adapted for Unicode, and built twice (see matchengine_impl.h) so that it works
+// directly on both ustrings and utf-8 Lua strings
 
+#include <string.h>
 #include <ctype.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <unicode/ustring.h>
 #include <unicode/uchar.h>
+#include <unicode/utf.h>
 #include "matchengine.h"
+#include "search.h"
 
-static int capture_to_close(UMatchState *ms) {
-	int level = ms->level;
-	for (level--; level>=0; level--) {
-		if (ms->capture[level].what == CAP_UNFINISHED) {
-			return level;
-		}
-	}
-	return luaL_error(ms->L, "invalid pattern capture");
-}
+// Patterns are parsed once into an array of items, ending with PATT_END, so that matching
+// never has to look for the end of a class or skip over escapes again
 
-static int match(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter);
+#define PATT_END		0 // end of pattern, the match succeeded
+#define PATT_CHAR		1 // c is the character
+#define PATT_ANY		2 // .
+#define PATT_SET		3 // [...], or a class like %a or %!a, arg is the set index
+#define PATT_LITERAL	4 // a run of unquantified characters, arg is where it starts in literals
+#define PATT_OPEN		5 // (
+#define PATT_POSITION	6 // ()
+#define PATT_CLOSE		7 // )
+#define PATT_BALANCE	8 // %bxy, c is x and c2 is y
+#define PATT_FRONTIER	9 // %f[...], arg is the set index
+#define PATT_BACKREF	10 // %1 to %9, c is the digit
+#define PATT_EOS		11 // $ at the end of the pattern
 
-static int start_capture(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter, int what) {
-	int level = ms->level;
-	if (level >= LUA_MAXCAPTURES) {
-		return luaL_error(ms->L, "too many captures");
-	}
-	ms->capture[level].start_state = pSourceIter->getState(pSourceIter);
-	ms->capture[level].end_state = pSourceIter->getState(pSourceIter);
-	ms->capture[level].what = what;
-	ms->level = level+1;
-	if (!match(ms, pPattIter, pSourceIter)) {
-		ms->level--;
-		return 0;
-	}
-	return 1;
-}
+// Sets are parsed into elements, which are then compiled into a bitmap for ASCII and rewritten
+// as the (sorted, non-overlapping) SET_RANGEs and the SET_UCLASSes non-ASCII is tested against
+#define SET_CHAR	0 // lo is the character
+#define SET_RANGE	1 // lo-hi
+#define SET_CLASS	2 // %a and so on, lo is the class letter
+#define SET_UCLASS	3 // %!a and so on, lo is the class letter
 
-static int end_capture(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter) {
-	int l = capture_to_close(ms);
-	ms->capture[l].end_state = uiter_getState(pSourceIter);
-	ms->capture[l].what = CAP_SUCCESSFUL;
-	if (!match(ms, pPattIter, pSourceIter)) {
-		ms->capture[l].what = CAP_UNFINISHED;
-		return 0;
-	}
-	return 1;
-}
+#define CLASS_LETTERS	"acdlpsuwxzACDLPSUWXZ"
 
-static int32_t classend(UMatchState *ms, UCharIterator* pPattIter) {
-	uint32_t restore_state = uiter_getState(pPattIter);
-	uint32_t classend_state;
-	UErrorCode status;
-	switch(uiter_current32(pPattIter)) {
-		case L_ESC:
-			uiter_next32(pPattIter);
-			if (uiter_current32(pPattIter) == '!') {
-				uiter_next32(pPattIter);
-				if (uiter_current32(pPattIter) == U_SENTINEL) {
-					luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%!") ")");
-				}
-			}
-			else if (uiter_current32(pPattIter) == U_SENTINEL) {
-				luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
-			}
-			uiter_next32(pPattIter);
-			break;
-		case '[':
-			uiter_next32(pPattIter);
-			if (uiter_current32(pPattIter) == '^') {
-				uiter_next32(pPattIter);
-			}
-			for (;;) {
-				switch(uiter_current32(pPattIter)) {
-					case ']':
-						uiter_next32(pPattIter);
-						break;
-					case U_SENTINEL:
-						luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
-					case L_ESC: // skip escapes (i.e. %])
-						uiter_next32(pPattIter);
-						uiter_next32(pPattIter);
-						continue;
-					default:
-						uiter_next32(pPattIter);
-						continue;
-				}
-				break;
-			}
-			break;
-		default:
-			uiter_next32(pPattIter);
-			break;
-	}
-	classend_state = uiter_getState(pPattIter);
-	status = U_ZERO_ERROR;
-	uiter_setState(pPattIter, restore_state, &status);
-	if (U_FAILURE(status)) {
-		luaL_error(ms->L, "unable to set state after classend: %s", u_errorName(status));
-	}
-	return classend_state;
-}
+typedef struct UPattItem {
+	unsigned char op;
+	unsigned char quantifier; // 0 for exactly once, otherwise one of ?*+-
+	UChar32 c;
+	UChar32 c2;
+	int32_t arg;
+	int32_t length; // of a literal run
+	int32_t state; // the first of its states in the linear matcher (see patt_numberstates)
+} UPattItem;
+
+typedef struct UPattSet {
+	unsigned char ascii[16]; // bitmap of the ASCII characters that match, negation included
+	int negated;
+	int nonascii_all; // a class like %A is in it, which every non-ASCII character is in
+	int32_t first; // index of the first element
+	int32_t range_count; // SET_RANGEs from first, then SET_UCLASSes
+	int32_t class_count;
+} UPattSet;
+
+typedef struct UPattSetElement {
+	int kind;
+	UChar32 lo;
+	UChar32 hi;
+} UPattSetElement;
+
+// The items, sets, elements, literals and prefixes all live in the same userdata, straight after this
+struct UPattern {
+	int anchored; // starts with ^
+	int32_t frame_count; // the most backtracking frames matching can need, one per item
+	int32_t state_count; // the linear matcher's, 0 if the pattern can only be backtracked over
+	const UPattItem* items; // for match, find and gsub, without the ^
+	const UPattItem* gmatch_items; // gmatch takes a leading ^ literally
+	const UPattSet* sets;
+	const UPattSetElement* elements;
+	const UChar32* literals;
+	// What an unanchored match has to start with, so the engine can skip ahead (see patt_analyze)
+	int start_known; // if not, a match could start with anything, or nothing
+	unsigned char start_ascii[16]; // bitmap of the ASCII characters a match can start with
+	int start_nonascii; // whether a match can start with a character outside ASCII
+	const UChar* prefix_u16; // the literal string a match starts with, if there is one
+	int32_t prefix_u16_length;
+	const char* prefix_utf8;
+	int32_t prefix_utf8_length; // 0 if it has a U+FFFD, as ill-formed UTF-8 is read as that too
+};
+
+typedef struct UPattCompiler {
+	lua_State *L;
+	const UChar32* p; // the pattern's code points
+	int32_t len;
+	UPattItem* items;
+	int32_t item_count;
+	UPattSet* sets;
+	int32_t set_count;
+	UPattSetElement* elements;
+	int32_t element_count;
+	UChar32* literals;
+	int32_t literal_count;
+} UPattCompiler;
 
+// The C classes only ever match ASCII, whatever the locale
 static int match_class (UChar32 c, UChar32 cl) {
 	int res;
+	int ascii = (c >= 0 && c < 0x80);
 	switch (tolower(cl)) {
 		case 'a':
-			res = isalpha(c);
+			res = ascii && isalpha(c);
 			break;
 		case 'c':
-			res = iscntrl(c);
+			res = ascii && iscntrl(c);
 			break;
 		case 'd':
-			res = isdigit(c);
+			res = ascii && isdigit(c);
 			break;
 		case 'l':
-			res = islower(c);
+			res = ascii && islower(c);
 			break;
 		case 'p':
-			res = ispunct(c);
+			res = ascii && ispunct(c);
 			break;
 		case 's':
-			res = isspace(c);
+			res = ascii && isspace(c);
 			break;
 		case 'u':
-			res = isupper(c);
+			res = ascii && isupper(c);
 			break;
 		case 'w':
-			res = isalnum(c);
+			res = ascii && isalnum(c);
 			break;
 		case 'x':
-			res = isxdigit(c);
+			res = ascii && isxdigit(c);
 			break;
 		case 'z':
 			res = (c == 0);
@@ -181,532 +177,740 @@ static int match_class_u (UChar32 c, UChar32 cl) {
 	return (islower(cl) ? res : !res);
 }
 
-static int matchbracketclass(UChar32 sc, UCharIterator* pPattIter, uint32_t endclass_state) {
-	uint32_t restore_state = uiter_getState(pPattIter);
-	UChar32 pc; // Pattern character
-	UChar32 rc; // End-range character
-	int sig = 1;
-	UErrorCode status;
-	uiter_next32(pPattIter);
-	if (uiter_current32(pPattIter) == '^') {
-		sig = 0;
-		uiter_next32(pPattIter); // skip the ^
-	}
-	for (;;) {
-		switch(pc = uiter_current32(pPattIter)) {
-			case L_ESC:
-				uiter_next32(pPattIter);
-				pc = uiter_current32(pPattIter);
-				if (pc == '!') {
-					uiter_next32(pPattIter);
-					pc = uiter_current32(pPattIter);
-					if (match_class_u(sc, pc)) {
-						status = U_ZERO_ERROR;
-						uiter_setState(pPattIter, restore_state, &status);
-						return sig;
-					}
+static int patt_isclass(UChar32 cl) {
+	return (cl > 0 && cl < 0x80 && strchr(CLASS_LETTERS, (char)cl) != NULL);
+}
+
+// Fill in the bitmap of a set whose count elements have been parsed, and rewrite them in place
+// as its non-ASCII ranges, sorted and merged, followed by its %!x classes
+static void patt_finishset(UPattCompiler* pc, UPattSet* set, int32_t count) {
+	UPattSetElement* e = &pc->elements[set->first];
+	UPattSetElement* e_end = e + count;
+	UPattSetElement* out = e;
+	UPattSetElement* ranges = e;
+	UPattSetElement* classes;
+	UPattSetElement* r;
+	UPattSetElement tmp;
+	UChar32 c;
+	int32_t i;
+	memset(set->ascii, 0, sizeof(set->ascii));
+	set->nonascii_all = 0;
+	for (; e < e_end; e++) {
+		switch (e->kind) {
+			case SET_CHAR:
+			case SET_RANGE:
+				for (c = e->lo; c <= e->hi && c < 0x80; c++) {
+					set->ascii[c >> 3] |= (unsigned char)(1 << (c & 7));
 				}
-				else if (match_class(sc, pc)) {
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, restore_state, &status);
-					return sig;
+				if (e->hi >= 0x80 && e->lo <= e->hi) {
+					out->kind = SET_RANGE;
+					out->lo = (e->lo < 0x80) ? 0x80 : e->lo;
+					out->hi = e->hi;
+					out++;
 				}
-				uiter_next32(pPattIter);
-			case ']':
-				status = U_ZERO_ERROR;
-				uiter_setState(pPattIter, restore_state, &status);
-				return !sig;
-			default:
-				if (pc == sc) {
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, restore_state, &status);
-					return sig;
+				break;
+			case SET_CLASS:
+				for (c = 0; c < 0x80; c++) {
+					if (match_class(c, e->lo)) {
+						set->ascii[c >> 3] |= (unsigned char)(1 << (c & 7));
+					}
 				}
-				uiter_next32(pPattIter);
-				if (uiter_current32(pPattIter) == '-') {
-					uiter_next32(pPattIter);
-					rc = uiter_current32(pPattIter);
-					if (rc != ']') {
-						if (sc > pc && sc <= rc) {
-							status = U_ZERO_ERROR;
-							uiter_setState(pPattIter, restore_state, &status);
-							return sig;
-						}
-						uiter_next32(pPattIter);
+				set->nonascii_all |= isupper(e->lo) ? 1 : 0;
+				break;
+			default: // SET_UCLASS
+				for (c = 0; c < 0x80; c++) {
+					if (match_class_u(c, e->lo)) {
+						set->ascii[c >> 3] |= (unsigned char)(1 << (c & 7));
 					}
 				}
+				*out++ = *e;
+				break;
 		}
 	}
-}
-
-static int singlematch(int uc, UCharIterator* pPattIter, uint32_t classend_state) {
-	switch(uiter_current32(pPattIter)) {
-		case '.':
-			return 1;  // matches any char
-		case L_ESC: {
-			UChar32 cl;
-			uiter_next32(pPattIter);
-			cl = uiter_current32(pPattIter);
-			if (cl == '!') {
-				uiter_next32(pPattIter);
-				cl = uiter_current32(pPattIter);
-				uiter_previous32(pPattIter);
-				uiter_previous32(pPattIter);
-				return match_class_u(uc, cl);
-			}
-			else {
-				uiter_previous32(pPattIter);
-				return match_class(uc, cl);
-			}
+	if (set->negated) {
+		for (i = 0; i < 16; i++) {
+			set->ascii[i] = (unsigned char)~set->ascii[i];
 		}
-		case '[':
-			return matchbracketclass(uc, pPattIter, classend_state);
-		default:
-			return (uiter_current32(pPattIter) == uc);
 	}
-}
-
-static int matchbalance (UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter) {
-	UChar32 open, close;
-	open = uiter_current32(pPattIter);
-	uiter_next32(pPattIter);
-	if ((close = uiter_current32(pPattIter)) == U_SENTINEL) {
-		luaL_error(ms->L, "unbalanced pattern");
+	// Sets are short, so an insertion sort puts the ranges in order, and the classes after them
+	for (e = ranges + 1; e < out; e++) {
+		tmp = *e;
+		for (r = e; r > ranges && ((r[-1].kind == SET_UCLASS && tmp.kind == SET_RANGE)
+			|| (r[-1].kind == tmp.kind && r[-1].lo > tmp.lo)); r--) {
+			r[0] = r[-1];
+		}
+		r[0] = tmp;
 	}
-	uiter_next32(pPattIter);
-	if (uiter_current32(pSourceIter) != open) {
-		return 0;
+	for (classes = ranges; classes < out && classes->kind == SET_RANGE; classes++) {
 	}
-	else {
-		int cont = 1;
-		uint32_t restore_state = uiter_getState(pSourceIter);
-		UErrorCode status;
-		for (uiter_next32(pSourceIter); uiter_current32(pSourceIter) != U_SENTINEL; uiter_next32(pSourceIter)) {
-			if (uiter_current32(pSourceIter) == close) {
-				if (--cont == 0) {
-					uiter_next32(pSourceIter);
-					return 1;
-				}
-			}
-			else if (uiter_current32(pSourceIter) == open) {
-				cont++;
+	// Merge ranges that overlap or touch
+	r = ranges;
+	for (e = ranges; e < classes; e++) {
+		if (r > ranges && e->lo <= r[-1].hi + 1) {
+			if (e->hi > r[-1].hi) {
+				r[-1].hi = e->hi;
 			}
 		}
-		status = U_ZERO_ERROR;
-		uiter_setState(pSourceIter, restore_state, &status);
+		else {
+			*r++ = *e;
+		}
 	}
-	return 0; // string ends out of balance
+	set->range_count = (int32_t)(r - ranges);
+	set->class_count = (int32_t)(out - classes);
+	memmove(r, classes, set->class_count * sizeof(UPattSetElement));
 }
 
-static int check_capture(UMatchState *ms, int l) {
-	l -= '1';
-	if (l < 0 || l >= ms->level || ms->capture[l].what == CAP_UNFINISHED)
-		return luaL_error(ms->L, "invalid capture index");
-	return l;
+// A class like %a or %!a on its own is compiled as a set with just that in it
+static int32_t patt_compileclass(UPattCompiler* pc, int kind, UChar32 cl) {
+	UPattSet* set = &pc->sets[pc->set_count];
+	UPattSetElement* e;
+	set->negated = 0;
+	set->first = pc->element_count;
+	e = &pc->elements[pc->element_count++];
+	e->kind = kind;
+	e->lo = e->hi = cl;
+	patt_finishset(pc, set, 1);
+	pc->element_count = set->first + set->range_count + set->class_count;
+	return pc->set_count++;
 }
 
-// TODO: Find a better way to do this?
-static int match_capture(UMatchState *ms, UCharIterator* pSourceIter, int l) {
-	uint32_t cap_state, cap_end_state;
-	uint32_t match_state;
-	UChar32 cap_char;
-	UErrorCode status;
-	l = check_capture(ms, l);
-	if (ms->capture[l].what == CAP_POSITION) {
-		return 0;
+// Parse the set starting at the [ at *pi, leaving *pi after the closing ]
+static int32_t patt_compileset(UPattCompiler* pc, int32_t* pi) {
+	const UChar32* p = pc->p;
+	int32_t i = *pi + 1;
+	UPattSet* set = &pc->sets[pc->set_count];
+	UPattSetElement* e;
+	set->negated = 0;
+	set->first = pc->element_count;
+	if (i < pc->len && p[i] == '^') {
+		set->negated = 1;
+		i++;
 	}
-	match_state = uiter_getState(pSourceIter);
-	cap_state = ms->capture[l].start_state;
-	cap_end_state = ms->capture[l].end_state;
 	for (;;) {
-		if (cap_state == cap_end_state) {
-			status = U_ZERO_ERROR;
-			uiter_setState(pSourceIter, match_state, &status);
-			return 1;
+		if (i >= pc->len) {
+			luaL_error(pc->L, "malformed pattern (missing " LUA_QL("]") ")");
 		}
-		status = U_ZERO_ERROR;
-		uiter_setState(pSourceIter, cap_state, &status);
-		cap_char = uiter_current32(pSourceIter);
-		uiter_next32(pSourceIter);
-		cap_state = uiter_getState(pSourceIter);
-		status = U_ZERO_ERROR;
-		uiter_setState(pSourceIter, match_state, &status);
-		if (uiter_current32(pSourceIter) != cap_char) {
-			return 0;
-		}
-		uiter_next32(pSourceIter);
-		match_state = uiter_getState(pSourceIter);
-	}
-}
-
-
-// Try to match the current pattern as many times as possible, then try to match the next pattern
-// immediately after the end of the run - if it does not match, backtrack over the current pattern
-// matches until we find an "overlapping" match there, or we fail by reaching the beginning again.
-static int max_expand(UMatchState *ms, UCharIterator* pPattIter, UCharIterator* pSourceIter, uint32_t afterclass_state) {
-	UErrorCode status;
-	uint32_t patt_restore_state, string_restore_state;
-	int i = 0;
-	for (;;) {
-		if (uiter_current32(pSourceIter) == U_SENTINEL || !singlematch(uiter_current32(pSourceIter), pPattIter, afterclass_state)) {
+		if (p[i] == ']') {
+			i++;
 			break;
 		}
-		uiter_next32(pSourceIter);
-		i++;
-	}
-	status = U_ZERO_ERROR;
-	uiter_setState(pPattIter, afterclass_state, &status);
-	if (U_FAILURE(status)) {
-		luaL_error(ms->L, "cannot restore state in max_expand: %s", u_errorName(status));
-	}
-	uiter_next32(pPattIter);
-	patt_restore_state = uiter_getState(pPattIter);
-	string_restore_state = uiter_getState(pSourceIter);
-	while (i >= 0) {
-		if (match(ms, pPattIter, pSourceIter)) {
-			return 1;
+		e = &pc->elements[pc->element_count++];
+		if (p[i] == L_ESC) {
+			if (++i >= pc->len) {
+				luaL_error(pc->L, "malformed pattern (missing " LUA_QL("]") ")");
+			}
+			if (p[i] == '!' && i+1 < pc->len && patt_isclass(p[i+1])) {
+				e->kind = SET_UCLASS;
+				e->lo = p[i+1];
+				i += 2;
+			}
+			else {
+				e->kind = patt_isclass(p[i]) ? SET_CLASS : SET_CHAR;
+				e->lo = e->hi = p[i];
+				i++;
+			}
 		}
-		i--;
-		status = U_ZERO_ERROR;
-		uiter_setState(pPattIter, patt_restore_state, &status);
-		status = U_ZERO_ERROR;
-		uiter_setState(pSourceIter, string_restore_state, &status);
-		uiter_previous32(pSourceIter);
-		string_restore_state = uiter_getState(pSourceIter);
-	}
-	return 0;
-}
-
-static int min_expand(UMatchState *ms, UCharIterator* pPattIter, UCharIterator* pSourceIter, uint32_t end_state) {
-	uint32_t start_state = uiter_getState(pPattIter);
-	UErrorCode status;
-	for (;;) {
-		// First set the iterator to the pattern part *after* the minimally-expanded part
-		status = U_ZERO_ERROR;
-		uiter_setState(pPattIter, end_state, &status);
-		uiter_next32(pPattIter);
-		// If this matches, report success here
-		if (match(ms, pPattIter, pSourceIter)) {
-			return 1;
+		else if (i+2 < pc->len && p[i+1] == '-' && p[i+2] != ']') {
+			e->kind = SET_RANGE;
+			e->lo = p[i];
+			e->hi = p[i+2];
+			i += 3;
 		}
-		// Now set the iterator back to the minimally-expanded part
-		status = U_ZERO_ERROR;
-		uiter_setState(pPattIter, start_state, &status);
-		// If this fails, then neither part matches and we fail here
-		if (uiter_current32(pSourceIter)==U_SENTINEL || !singlematch(uiter_current32(pSourceIter), pPattIter, end_state)) {
-			return 0;
+		else {
+			e->kind = SET_CHAR;
+			e->lo = e->hi = p[i];
+			i++;
 		}
-		uiter_next32(pSourceIter);  // try with one more repetition
 	}
+	patt_finishset(pc, set, pc->element_count - set->first);
+	pc->element_count = set->first + set->range_count + set->class_count;
+	*pi = i;
+	return pc->set_count++;
 }
 
-static int match(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter) {
-	UErrorCode status;
-	init: // using goto to optimize tail recursion
-	switch(uiter_current32(pPattIter)) {
-		case '(': // start capture
-			uiter_next32(pPattIter);
-			if (uiter_current32(pPattIter) == ')') { // position capture?
-				uiter_next32(pPattIter);
-				return start_capture(ms, pPattIter, pSourceIter, CAP_POSITION);
-			}
-			return start_capture(ms, pPattIter, pSourceIter, CAP_UNFINISHED);
-		case ')': // end capture
-			uiter_next32(pPattIter);
-			return end_capture(ms, pPattIter, pSourceIter);
+// Parse the single character class at *pi (., %a, %!a, [...] or a character)
+static void patt_compilesingle(UPattCompiler* pc, UPattItem* item, int32_t* pi) {
+	const UChar32* p = pc->p;
+	int32_t i = *pi;
+	int kind = SET_CLASS;
+	switch (p[i]) {
+		case '.':
+			item->op = PATT_ANY;
+			i++;
+			break;
+		case '[':
+			item->op = PATT_SET;
+			item->arg = patt_compileset(pc, &i);
+			break;
 		case L_ESC:
-			uiter_next32(pPattIter);
-			switch(uiter_current32(pPattIter)) {
-				case 'b': // balanced string?
-					uiter_next32(pPattIter);
-					if (!matchbalance(ms, pPattIter, pSourceIter)) {
-						return 0;
-					}
-					goto init;
-				case 'f': { // frontier?
-					uint32_t startclass_state, classend_state;
-					UChar32 previous;
-					uiter_next32(pPattIter);
-					if (uiter_current32(pPattIter) != '[') {
-						luaL_error(ms->L, "missing " LUA_QL("[") " after " LUA_QL("%%f") " in pattern");
-					}
-					startclass_state = uiter_getState(pPattIter);
-					classend_state = classend(ms, pPattIter); // points to what is next
-					if (pSourceIter->hasPrevious(pSourceIter)) {
-						uiter_previous32(pSourceIter);
-						previous = uiter_current32(pSourceIter);
-						uiter_next32(pSourceIter);
-					}
-					else {
-						previous = '\0';
-					}
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, startclass_state, &status);
-					if (matchbracketclass(previous, pPattIter, classend_state)) {
-						return 0;
-					}
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, startclass_state, &status);
-					if (!matchbracketclass(uiter_current32(pSourceIter), pPattIter, classend_state)) {
-						return 0;
-					}
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, classend_state, &status);
-					goto init;
+			if (++i >= pc->len) {
+				luaL_error(pc->L, "malformed pattern (ends with " LUA_QL("%%") ")");
+			}
+			if (p[i] == '!') {
+				if (++i >= pc->len) {
+					luaL_error(pc->L, "malformed pattern (ends with " LUA_QL("%%!") ")");
 				}
-				default:
-					if (isdigit(uiter_current32(pPattIter))) { // capture results %0 to %9?
-						if (!match_capture(ms, pSourceIter, uiter_current32(pPattIter))) {
-							return 0;
-						}
-						uiter_next32(pPattIter);
-						goto init;
-					}
-					uiter_previous32(pPattIter);
-					goto dflt; // case default
+				kind = SET_UCLASS;
 			}
-		case U_SENTINEL: // end of pattern
-			return 1; // match succeeded
-		case '$':
-			if (uiter_current32(pSourceIter) == U_SENTINEL) {
-				return 1;
+			if (patt_isclass(p[i])) {
+				item->op = PATT_SET;
+				item->arg = patt_compileclass(pc, kind, p[i]);
 			}
-			goto dflt;
-		default: dflt: { // it is a pattern item
-			int m;
-			uint32_t startclass_state = uiter_getState(pPattIter);
-			uint32_t afterclass_state = classend(ms, pPattIter);
-			status = U_ZERO_ERROR;
-			uiter_setState(pPattIter, startclass_state, &status);
-			if (U_FAILURE(status)) {
-				luaL_error(ms->L, "cannot restore state to beginning of match class");
+			else {
+				item->op = PATT_CHAR;
+				item->c = p[i];
 			}
-			m = uiter_current32(pSourceIter)!=U_SENTINEL && singlematch(uiter_current32(pSourceIter), pPattIter, afterclass_state);
-			status = U_ZERO_ERROR;
-			uiter_setState(pPattIter, afterclass_state, &status);
-			switch (uiter_current32(pPattIter)) {
-				case '?': // optional
-					uiter_next32(pPattIter);
-					if (m) {
-						uiter_next32(pSourceIter);
-						if (match(ms, pPattIter, pSourceIter)) {
-							return 1;
-						}
-						status = U_ZERO_ERROR;
-						uiter_setState(pPattIter, afterclass_state, &status);
-						uiter_next32(pPattIter);
+			i++;
+			break;
+		default:
+			item->op = PATT_CHAR;
+			item->c = p[i++];
+			break;
+	}
+	*pi = i;
+}
+
+// Parse the pattern from index i to the end, adding items up to and including a PATT_END
+static void patt_compileitems(UPattCompiler* pc, int32_t i) {
+	const UChar32* p = pc->p;
+	UPattItem* item;
+	UPattItem* run = NULL; // the literal run that unquantified characters are added to
+	while (i < pc->len) {
+		item = &pc->items[pc->item_count];
+		item->quantifier = 0;
+		switch (p[i]) {
+			case '(':
+				if (i+1 < pc->len && p[i+1] == ')') {
+					item->op = PATT_POSITION;
+					i += 2;
+				}
+				else {
+					item->op = PATT_OPEN;
+					i++;
+				}
+				pc->item_count++;
+				run = NULL;
+				continue;
+			case ')':
+				item->op = PATT_CLOSE;
+				i++;
+				pc->item_count++;
+				run = NULL;
+				continue;
+			case '$':
+				if (i+1 == pc->len) {
+					item->op = PATT_EOS;
+					i++;
+					pc->item_count++;
+					run = NULL;
+					continue;
+				}
+				break; // otherwise it is just a character
+			case L_ESC:
+				if (i+1 >= pc->len) {
+					break; // let patt_compilesingle complain
+				}
+				if (p[i+1] == 'b') {
+					if (i+3 >= pc->len) {
+						luaL_error(pc->L, "unbalanced pattern");
 					}
-					goto init;
-				case '*': // 0 or more repetitions
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, startclass_state, &status);
-					return max_expand(ms, pPattIter, pSourceIter, afterclass_state);
-				case '+': // 1 or more repetitions
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, startclass_state, &status);
-					return m ? max_expand(ms, pPattIter, pSourceIter, afterclass_state) : 0;
-				case '-': // 0 or more repetitions (minimum)
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, startclass_state, &status);
-					return min_expand(ms, pPattIter, pSourceIter, afterclass_state);
-				default:
-					if (!m) {
-						status = U_ZERO_ERROR;
-						uiter_setState(pPattIter, startclass_state, &status);
-						return 0;
+					item->op = PATT_BALANCE;
+					item->c = p[i+2];
+					item->c2 = p[i+3];
+					i += 4;
+					pc->item_count++;
+					run = NULL;
+					continue;
+				}
+				if (p[i+1] == 'f') {
+					i += 2;
+					if (i >= pc->len || p[i] != '[') {
+						luaL_error(pc->L, "missing " LUA_QL("[") " after " LUA_QL("%%f") " in pattern");
 					}
-					uiter_next32(pSourceIter);
-					status = U_ZERO_ERROR;
-					uiter_setState(pPattIter, afterclass_state, &status);
-					goto init;
-			}
+					item->op = PATT_FRONTIER;
+					item->arg = patt_compileset(pc, &i);
+					pc->item_count++;
+					run = NULL;
+					continue;
+				}
+				if (p[i+1] >= '0' && p[i+1] <= '9') {
+					item->op = PATT_BACKREF;
+					item->c = p[i+1];
+					i += 2;
+					pc->item_count++;
+					run = NULL;
+					continue;
+				}
+				break;
+		}
+		patt_compilesingle(pc, item, &i);
+		if (i < pc->len && (p[i] == '?' || p[i] == '*' || p[i] == '+' || p[i] == '-')) {
+			item->quantifier = (unsigned char)p[i++];
+			pc->item_count++;
+			run = NULL;
+		}
+		else if (item->op != PATT_CHAR) {
+			pc->item_count++;
+			run = NULL;
+		}
+		else if (run) {
+			pc->literals[pc->literal_count++] = item->c;
+			run->length++;
+		}
+		else {
+			item->op = PATT_LITERAL;
+			item->arg = pc->literal_count;
+			item->length = 1;
+			pc->literals[pc->literal_count++] = item->c;
+			pc->item_count++;
+			run = item;
 		}
 	}
+	pc->items[pc->item_count++].op = PATT_END;
 }
 
-int uiter_match_aux(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter) {
-	uint32_t pattState;
-	uint32_t stringState;
-	UErrorCode status;
-	int anchor = (uiter_current32(pPattIter) == '^') ? (uiter_next32(pPattIter), 1) : 0;
+static int singlematch(const UPattern* patt, const UPattItem* p, UChar32 c);
 
-	for (;;) {
-		pattState = uiter_getState(pPattIter);
-		stringState = uiter_getState(pSourceIter);
-
-		ms->level = 0;
-		ms->capture[0].start_state = stringState;
-		if (match(ms, pPattIter, pSourceIter)) {
+// Whether a single character item could match anything outside ASCII (erring on yes)
+static int patt_matchesnonascii(const UPattern* patt, const UPattItem* p) {
+	const UPattSet* set;
+	switch (p->op) {
+		case PATT_CHAR:
+			return (p->c >= 0x80);
+		case PATT_SET:
+			set = &patt->sets[p->arg];
+			return set->negated || set->nonascii_all || set->range_count > 0 || set->class_count > 0;
+		default: // PATT_ANY
 			return 1;
-		}
+	}
+}
 
-		status = U_ZERO_ERROR;
-		uiter_setState(pPattIter, pattState, &status);
-		if (U_FAILURE(status)) {
-			return luaL_error(ms->L, "cannot restore pattern iterator state: %s", u_errorName(status));
+// Work out what a match of the items has to start with, from the first item that consumes
+// anything (captures can open before it), if that item has to match at least once
+static void patt_analyze(UPattern* patt, const UPattItem* p, UChar* prefix_u16, uint8_t* prefix_utf8) {
+	const UChar32* lit;
+	int32_t i, len16 = 0, len8 = 0;
+	int has_fffd = 0;
+	UChar32 c;
+	patt->start_known = 0;
+	memset(patt->start_ascii, 0, sizeof(patt->start_ascii));
+	patt->start_nonascii = 0;
+	patt->prefix_u16 = prefix_u16;
+	patt->prefix_u16_length = 0;
+	patt->prefix_utf8 = (const char*)prefix_utf8;
+	patt->prefix_utf8_length = 0;
+	while (p->op == PATT_OPEN || p->op == PATT_POSITION) {
+		p++;
+	}
+	if (p->op == PATT_LITERAL) {
+		lit = &patt->literals[p->arg];
+		for (i = 0; i < p->length; i++) {
+			U16_APPEND_UNSAFE(prefix_u16, len16, lit[i]);
+			U8_APPEND_UNSAFE(prefix_utf8, len8, lit[i]);
+			has_fffd |= (lit[i] == 0xfffd);
 		}
-		status = U_ZERO_ERROR;
-		uiter_setState(pSourceIter, stringState, &status);
-		if (U_FAILURE(status)) {
-			return luaL_error(ms->L, "cannot restore string iterator state: %s", u_errorName(status));
+		patt->prefix_u16_length = len16;
+		patt->prefix_utf8_length = has_fffd ? 0 : len8;
+		if (lit[0] < 0x80) {
+			patt->start_ascii[lit[0] >> 3] |= (unsigned char)(1 << (lit[0] & 7));
 		}
-
-		if (anchor) {
-			break;
+		else {
+			patt->start_nonascii = 1;
 		}
-		if (uiter_current32(pSourceIter) == U_SENTINEL) {
-			break;
+		patt->start_known = 1;
+	}
+	else if ((p->op == PATT_CHAR || p->op == PATT_ANY || p->op == PATT_SET)
+		&& (p->quantifier == 0 || p->quantifier == '+')) {
+		for (c = 0; c < 0x80; c++) {
+			if (singlematch(patt, p, c)) {
+				patt->start_ascii[c >> 3] |= (unsigned char)(1 << (c & 7));
+			}
+			else {
+				patt->start_known = 1; // it rules something out
+			}
 		}
-		uiter_next32(pSourceIter);
+		patt->start_nonascii = patt_matchesnonascii(patt, p);
+		patt->start_known |= !patt->start_nonascii;
 	}
-	return 0;
 }
-static int push_captures(UMatchState* ms, UCharIterator* pSourceIter) {
-	UErrorCode status;
-	int i;
-	if (ms->level == 0) {
-		ms->pushRange(ms, ms->capture[0].start_state, ms->end_state);
-		return 1;
-	}
-	for (i = 0; i < ms->level; i++) {
-		switch(ms->capture[i].what) {
-			case CAP_POSITION:
-				status = U_ZERO_ERROR;
-				pSourceIter->setState(pSourceIter, ms->capture[i].start_state, &status);
-				lua_pushinteger(ms->L, pSourceIter->getIndex(pSourceIter, UITER_CURRENT) + 1);
+
+// Number the states the linear matcher (see matchengine_impl.h) has for the items: one for each
+// character of a literal, two for + (before and after the first repetition) and - (before and
+// after choosing to take another), one for anything else. Returns how many there are, or 0 if
+// the items have captures, %b, %f or back references, which need backtracking
+static int32_t patt_numberstates(UPattItem* p) {
+	int32_t state = 0;
+	for (;; p++) {
+		p->state = state;
+		switch (p->op) {
+			case PATT_END:
+				return state + 1;
+			case PATT_EOS:
+				state++;
 				break;
-			case CAP_SUCCESSFUL: {
-				ms->pushRange(ms, ms->capture[i].start_state, ms->capture[i].end_state);
+			case PATT_LITERAL:
+				state += p->length;
+				break;
+			case PATT_CHAR:
+			case PATT_ANY:
+			case PATT_SET:
+				state += (p->quantifier == '+' || p->quantifier == '-') ? 2 : 1;
 				break;
-			}
 			default:
-				return luaL_error(ms->L, "unfinished captures in pattern");
+				return 0;
 		}
 	}
-	return ms->level;
 }
 
-int iter_match(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter, int init, int find) {
-	UErrorCode status;
-	if (init > 0) {
-		pSourceIter->move(pSourceIter, init-1, UITER_ZERO);
-	}
-	else if (init < 0) {
-		pSourceIter->move(pSourceIter, init, UITER_LIMIT);
-	}
-	if (!uiter_match_aux(ms, pPattIter, pSourceIter)) {
-		lua_pushnil(ms->L);
-		return 1;
-	}
-	ms->end_state = uiter_getState(pSourceIter);
-	if (find) {
-		lua_pushinteger(ms->L, pSourceIter->getIndex(pSourceIter, UITER_CURRENT));
-		status = U_ZERO_ERROR;
-		uiter_setState(pSourceIter, ms->capture[0].start_state, &status);
-		lua_pushinteger(ms->L, 1 + pSourceIter->getIndex(pSourceIter, UITER_CURRENT));
-		lua_insert(ms->L, -2);
-		if (ms->level == 0) {
-			return 2;
+// Compile the pattern that pPattIter is iterating over, and push it as a userdata (with no
+// metatable, that is up to the caller)
+UPattern* upattern_compile(lua_State *L, UCharIterator* pPattIter) {
+	UPattCompiler pc;
+	UPattern* patt;
+	UChar32* cp;
+	UChar32 c;
+	int32_t n = 0, chains, states;
+	pPattIter->move(pPattIter, 0, UITER_ZERO);
+	while (uiter_next32(pPattIter) != U_SENTINEL) {
+		n++;
+	}
+	// Every code point gives at most one item, set, element and literal, but an anchored
+	// pattern is parsed twice, once for gmatch. A literal prefix takes at most two UChars or
+	// four UTF-8 bytes a code point
+	chains = (n > 0 && (pPattIter->move(pPattIter, 0, UITER_ZERO), uiter_current32(pPattIter) == '^')) ? 2 : 1;
+	patt = (UPattern*)lua_newuserdata(L, sizeof(UPattern)
+		+ chains * (n+1) * (sizeof(UPattItem) + sizeof(UPattSet) + sizeof(UPattSetElement) + sizeof(UChar32))
+		+ n * (sizeof(UChar32) + 2 * sizeof(UChar) + 4));
+	pc.L = L;
+	pc.items = (UPattItem*)(patt + 1);
+	pc.sets = (UPattSet*)(pc.items + chains * (n+1));
+	pc.elements = (UPattSetElement*)(pc.sets + chains * (n+1));
+	pc.literals = (UChar32*)(pc.elements + chains * (n+1));
+	cp = pc.literals + chains * (n+1);
+	pc.item_count = pc.set_count = pc.element_count = pc.literal_count = 0;
+	pPattIter->move(pPattIter, 0, UITER_ZERO);
+	for (n = 0; (c = uiter_next32(pPattIter)) != U_SENTINEL; n++) {
+		cp[n] = c;
+	}
+	pc.p = cp;
+	pc.len = n;
+	patt->anchored = (chains == 2);
+	patt->items = pc.items;
+	patt_compileitems(&pc, patt->anchored ? 1 : 0);
+	patt->frame_count = pc.item_count;
+	patt->state_count = patt_numberstates(pc.items);
+	if (patt->anchored) {
+		patt->gmatch_items = pc.items + pc.item_count;
+		patt_compileitems(&pc, 0);
+		if (pc.item_count - patt->frame_count > patt->frame_count) {
+			patt->frame_count = pc.item_count - patt->frame_count;
+		}
+		// the ^ is just a character here, so both chains can be matched in linear time or neither
+		states = patt_numberstates((UPattItem*)patt->gmatch_items);
+		if (states > patt->state_count) {
+			patt->state_count = states;
 		}
-		return push_captures(ms, pSourceIter) + 2;
 	}
 	else {
-		return push_captures(ms, pSourceIter);
+		patt->gmatch_items = patt->items;
 	}
+	patt->sets = pc.sets;
+	patt->elements = pc.elements;
+	patt->literals = pc.literals;
+	// items only differs from gmatch_items when it is anchored, and then it never skips ahead
+	patt_analyze(patt, patt->gmatch_items, (UChar*)(cp + n), (uint8_t*)((UChar*)(cp + n) + 2 * n));
+	return patt;
 }
 
-int uiter_gsub_aux(UMatchState* ms, UCharIterator* pPattIter, UCharIterator *pSourceIter,
-				   ProcessUMatchStateFunc on_match, int max_replacements) {
-	int replacements = 0;
-	uint32_t source_state = uiter_getState(pSourceIter);
-	UErrorCode status;
-	int anchor = (uiter_current32(pPattIter) == '^') ? (uiter_next32(pPattIter), 1) : 0;
-	while (replacements < max_replacements) {
-		ms->level = 0;
-		ms->capture[0].start_state = uiter_getState(pSourceIter);
-		if (match(ms, pPattIter, pSourceIter)) {
-			ms->end_state = pSourceIter->getState(pSourceIter);
-			if (ms->level == 0) {
-				ms->level = 1;
-				ms->capture[0].what = CAP_SUCCESSFUL;
-				ms->capture[0].end_state = ms->end_state;
-			}
-			// add the replacement to output
-			on_match(ms);
-
-			// set the source_state to after the match
-			source_state = pSourceIter->getState(pSourceIter);
-			replacements++;
-			if (ms->capture[0].start_state == ms->end_state) {
-				if (uiter_current32(pSourceIter) == U_SENTINEL) {
-					break;
-				}
-				else {
-					uint32_t old_state = source_state;
-					uiter_next32(pSourceIter);
-					source_state = uiter_getState(pSourceIter);
-					ms->addRange(ms, old_state, source_state);
-				}
-			}
+// Push the pattern cached for key, making it the most recently used, or return NULL
+UPattern* upattern_pushcached(lua_State *L, UPatternCache* cache, const void* key) {
+	int i, key_ref, pattern_ref;
+	for (i = 0; i < cache->count; i++) {
+		if (cache->entries[i].key == key) {
+			key_ref = cache->entries[i].key_ref;
+			pattern_ref = cache->entries[i].pattern_ref;
+			memmove(cache->entries + 1, cache->entries, i * sizeof(cache->entries[0]));
+			cache->entries[0].key = key;
+			cache->entries[0].key_ref = key_ref;
+			cache->entries[0].pattern_ref = pattern_ref;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, pattern_ref);
+			return (UPattern*)lua_touserdata(L,-1);
+		}
+	}
+	return NULL;
+}
+
+// Cache the pattern on top of the stack for key, which is the value at key_idx, dropping the
+// least recently used pattern if the cache is full
+void upattern_addcached(lua_State *L, UPatternCache* cache, const void* key, int key_idx) {
+	int key_ref, pattern_ref;
+	lua_pushvalue(L, key_idx);
+	key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L,-1);
+	pattern_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (cache->count == UPATTERN_CACHE_SIZE) {
+		cache->count--;
+		luaL_unref(L, LUA_REGISTRYINDEX, cache->entries[cache->count].key_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, cache->entries[cache->count].pattern_ref);
+	}
+	memmove(cache->entries + 1, cache->entries, cache->count * sizeof(cache->entries[0]));
+	cache->entries[0].key = key;
+	cache->entries[0].key_ref = key_ref;
+	cache->entries[0].pattern_ref = pattern_ref;
+	cache->count++;
+}
+
+static int capture_to_close(UMatchState *ms) {
+	int level = ms->level;
+	for (level--; level>=0; level--) {
+		if (ms->capture[level].what == CAP_UNFINISHED) {
+			return level;
+		}
+	}
+	return luaL_error(ms->L, "invalid pattern capture");
+}
+
+// ASCII is looked up in the bitmap, anything else in the ranges (by binary search) and classes
+static int matchbracketclass(const UPattern* patt, int32_t set_index, UChar32 c) {
+	const UPattSet* set = &patt->sets[set_index];
+	const UPattSetElement* e;
+	int32_t lo, hi, mid;
+	if ((uint32_t)c < 0x80) {
+		return (set->ascii[c >> 3] >> (c & 7)) & 1;
+	}
+	if (set->nonascii_all) {
+		return !set->negated;
+	}
+	e = &patt->elements[set->first];
+	lo = 0;
+	hi = set->range_count - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (c < e[mid].lo) {
+			hi = mid - 1;
+		}
+		else if (c > e[mid].hi) {
+			lo = mid + 1;
 		}
 		else {
-			// add the single non-matching character to output, set the source_state to the next character
-			uint32_t old_state = source_state;
-			status = U_ZERO_ERROR;
-			pSourceIter->setState(pSourceIter, source_state, &status);
-			if (pSourceIter->current(pSourceIter) == U_SENTINEL) {
-				break;
-			}
-			pSourceIter->next(pSourceIter);
-			source_state = pSourceIter->getState(pSourceIter);
-			ms->addRange(ms, old_state, source_state);
+			return !set->negated;
 		}
-		if (anchor) {
-			break;
+	}
+	for (e += set->range_count, hi = set->class_count; hi > 0; e++, hi--) {
+		if (match_class_u(c, e->lo)) {
+			return !set->negated;
 		}
-		pPattIter->move(pPattIter, 0, UITER_ZERO);
 	}
-	source_state = uiter_getState(pSourceIter);
-	pSourceIter->move(pSourceIter, 0, UITER_LIMIT);
-	ms->addRange(ms, source_state, uiter_getState(pSourceIter));
-	return replacements;
+	return set->negated;
 }
 
-int gmatch_aux (lua_State *L) {
-	UErrorCode status;
-	GmatchState* gms = (GmatchState*)lua_touserdata(L, lua_upvalueindex(3));
-	gms->ms.L = L;
-	status = U_ZERO_ERROR;
-	uiter_setState(&gms->sourceIter, gms->source_state, &status);
-	for (;;) {
-		gms->ms.level = 0;
-		gms->ms.capture[0].start_state = gms->source_state;
-		gms->pattIter.move(&gms->pattIter, 0, UITER_ZERO);
-		gms->ms.capture[0].start_state = uiter_getState(&gms->sourceIter);
-		if (match(&gms->ms, &gms->pattIter, &gms->sourceIter)) {
-			gms->ms.end_state = uiter_getState(&gms->sourceIter);
-			gms->source_state = uiter_getState(&gms->sourceIter);
-			if (gms->source_state == gms->ms.capture[0].start_state) {
-				if (!gms->sourceIter.hasNext(&gms->sourceIter)) {
-					if (gms->matched_empty_end) {
-						return 0;
-					}
-					else {
-						gms->matched_empty_end = 1;
-					}
-				}
-				uiter_next32(&gms->sourceIter);
-				gms->source_state = uiter_getState(&gms->sourceIter);
-			}
-			return push_captures(&gms->ms, &gms->sourceIter);
+static int singlematch(const UPattern* patt, const UPattItem* p, UChar32 c) {
+	switch (p->op) {
+		case PATT_ANY:
+			return 1;  // matches any char
+		case PATT_CHAR:
+			return (p->c == c);
+		default: // PATT_SET
+			return matchbracketclass(patt, p->arg, c);
+	}
+}
+
+static int check_capture(UMatchState *ms, int l) {
+	l -= '1';
+	if (l < 0 || l >= ms->level || ms->capture[l].what == CAP_UNFINISHED)
+		return luaL_error(ms->L, "invalid capture index");
+	return l;
+}
+
+// A thread of the linear matcher: in state n of item p (see patt_numberstates)
+typedef struct UMatchThread {
+	const UPattItem* p;
+	int32_t n;
+	int32_t start; // where the match it is part of started
+} UMatchThread;
+
+// The linear matcher's threads, in the space the backtracking stack would otherwise use
+typedef struct UMatchLinear {
+	UMatchThread* stack; // of states still to be followed, for match_addthreads
+	int32_t* marks; // the generation in which each state was last reached
+	int32_t generation; // one for each position in the source
+} UMatchLinear;
+
+// Backtracking over a pattern the linear matcher can also run may take this many steps for
+// every code unit of the source, before matching switches over to the linear matcher
+#define MATCH_BACKTRACK_STEPS	16
+
+// Set the pattern to match with (after the source, see umatch_setsource), and the most steps
+// (items tried, characters scanned and frames gone back to) a single call may take, -1 for no
+// limit. Patterns too big for the local frames get a userdata for theirs, which is pushed
+// (returning 1), and so has to be kept alive as long as the UMatchState is used. Patterns the
+// linear matcher can run need room for 3 threads and a mark for each state, and this is
+// shared with the frames as backtracking is never gone back to once the linear matcher is used
+int umatch_setpattern(UMatchState* ms, const UPattern* patt, int32_t limit) {
+	size_t size = patt->frame_count * sizeof(UMatchFrame);
+	size_t linear_size = (3 * patt->state_count + 1) * sizeof(UMatchThread) + patt->state_count * sizeof(int32_t);
+	ms->patt = patt;
+	ms->step_limit = limit;
+	ms->linear = 0;
+	if (ms->source_length < (INT32_MAX - 1) / MATCH_BACKTRACK_STEPS - 1) {
+		ms->backtrack_left = MATCH_BACKTRACK_STEPS * (ms->source_length + 1);
+	}
+	else {
+		ms->backtrack_left = INT32_MAX - 1;
+	}
+	ms->steps_counted = ms->steps_left = 0;
+	if (patt->state_count > 0 && linear_size > size) {
+		size = linear_size;
+	}
+	if (size <= sizeof(ms->local_frames)) {
+		ms->frames = ms->local_frames;
+		return 0;
+	}
+	ms->frames = (UMatchFrame*)lua_newuserdata(ms->L, size);
+	return 1;
+}
+
+// Count down to whichever comes first, the limit or the end of the backtracking budget
+static void match_setcountdown(UMatchState* ms) {
+	int32_t steps = (ms->step_limit < 0) ? INT32_MAX - 1 : ms->limit_left;
+	if (ms->patt->state_count > 0 && !ms->linear && ms->backtrack_left < steps) {
+		steps = ms->backtrack_left;
+	}
+	ms->steps_counted = ms->steps_left = steps;
+}
+
+// Start a call's count of steps. The backtracking budget carries on from the last call, for gmatch
+static void match_resetsteps(UMatchState* ms) {
+	if (ms->patt->state_count > 0 && !ms->linear) {
+		ms->backtrack_left -= ms->steps_counted - ms->steps_left;
+	}
+	ms->limit_left = ms->step_limit;
+	match_setcountdown(ms);
+}
+
+// steps_left has run out, so either the limit has been reached, or backtracking over a pattern
+// the linear matcher can run has used up its budget, and has to give up (returning 1) so the
+// match can be carried on with in linear time. Without a limit, the count just starts again
+static int match_outofsteps(UMatchState* ms) {
+	int32_t steps = ms->steps_counted - ms->steps_left;
+	if (ms->step_limit >= 0) {
+		ms->limit_left -= steps;
+		if (ms->limit_left < 0) {
+			luaL_error(ms->L, "match limit exceeded");
 		}
-		status = U_ZERO_ERROR;
-		uiter_setState(&gms->sourceIter, gms->source_state, &status);
-		if (uiter_current32(&gms->sourceIter) == U_SENTINEL) {
-			break;
+	}
+	if (ms->patt->state_count > 0 && !ms->linear) {
+		ms->backtrack_left -= steps;
+		if (ms->backtrack_left < 0) {
+			ms->linear = 1;
+			match_setcountdown(ms);
+			return 1;
 		}
-		uiter_next32(&gms->sourceIter);
-		gms->source_state = uiter_getState(&gms->sourceIter);
 	}
-	return 0; // end of gmatch
+	match_setcountdown(ms);
+	return 0;
 }
+
+// Count a step, and give up backtracking if the budget for it has run out
+#define MATCH_STEP(ms)	if (--(ms)->steps_left < 0 && match_outofsteps(ms)) return NULL
+
+#define MATCH_FRAME_OPEN		0 // undo opening a capture
+#define MATCH_FRAME_CLOSE		1 // undo closing capture n
+#define MATCH_FRAME_OPTIONAL	2 // ? matched its item at s, try the rest without it
+#define MATCH_FRAME_MAX			3 // * or + took n repetitions, ending at s
+#define MATCH_FRAME_MIN			4 // - took the repetitions up to s
+
+void umatch_setsource(UMatchState* ms, const void* source, int32_t length) {
+	ms->context = (void*)source;
+	ms->source_length = length;
+	ms->index_offset = 0;
+	ms->index = 0;
+}
+
+// The UTF-8 engine's positions are byte offsets, but Lua sees UTF-16 indices, so count the
+// UTF-16 units from the last offset that was converted (or from the start, if it is before)
+static int32_t utf8_toindex(UMatchState* ms, int32_t offset) {
+	const uint8_t* s = (const uint8_t*)ms->context;
+	int32_t i = ms->index_offset;
+	int32_t index = ms->index;
+	UChar32 c;
+	if (offset < i) {
+		i = index = 0;
+	}
+	while (i < offset) {
+		U8_NEXT(s, i, ms->source_length, c);
+		index += (c > 0xffff) ? 2 : 1;
+	}
+	ms->index_offset = i;
+	ms->index = index;
+	return index;
+}
+
+// An index in the middle of a supplementary character gives the offset after it
+static int32_t utf8_fromindex(UMatchState* ms, int32_t index) {
+	const uint8_t* s = (const uint8_t*)ms->context;
+	int32_t i = ms->index_offset;
+	int32_t n = ms->index;
+	UChar32 c;
+	if (index < n) {
+		i = n = 0;
+	}
+	while (n < index && i < ms->source_length) {
+		U8_NEXT(s, i, ms->source_length, c);
+		n += (c > 0xffff) ? 2 : 1;
+	}
+	ms->index_offset = i;
+	ms->index = n;
+	return i;
+}
+
+// As with UTF-8, an index between the two halves of a surrogate pair gives the offset after it
+static int32_t u16_fromindex(UMatchState* ms, int32_t index) {
+	const UChar* s = (const UChar*)ms->context;
+	if (index >= ms->source_length) {
+		return ms->source_length;
+	}
+	if (index > 0 && U16_IS_TRAIL(s[index]) && U16_IS_LEAD(s[index-1])) {
+		index++;
+	}
+	return index;
+}
+
+#define MATCH_SOURCE(ms)		((const MATCH_UNIT*)(ms)->context)
+#define MATCH_SOURCE_END(ms)	(MATCH_SOURCE(ms) + (ms)->source_length)
+
+// The engine over ustrings
+#define MATCH_UNIT				UChar
+#define MATCH_FN(name)			name##_u16
+#define MATCH_NEXT(s, e, c)		do { int32_t i_ = 0; U16_NEXT((s), i_, (int32_t)((e) - (s)), (c)); (s) += i_; } while (0)
+#define MATCH_FWD(s, e)			do { int32_t i_ = 0; U16_FWD_1((s), i_, (int32_t)((e) - (s))); (s) += i_; } while (0)
+#define MATCH_BACK(init, s)		do { int32_t i_ = (int32_t)((s) - (init)); U16_BACK_1((init), 0, i_); (s) = (init) + i_; } while (0)
+#define MATCH_PREV(init, s, c)	do { int32_t i_ = (int32_t)((s) - (init)); U16_PREV((init), 0, i_, (c)); } while (0)
+#define MATCH_TOINDEX(ms, offset)	(offset)
+#define MATCH_FROMINDEX(ms, index)	u16_fromindex((ms), (index))
+#define MATCH_PREFIX_LENGTH(patt)	((patt)->prefix_u16_length)
+#define MATCH_SEARCH(patt, s, e)	search_uchars((s), (int32_t)((e) - (s)), (patt)->prefix_u16, (patt)->prefix_u16_length)
+#include "matchengine_impl.h"
+#undef MATCH_UNIT
+#undef MATCH_FN
+#undef MATCH_NEXT
+#undef MATCH_FWD
+#undef MATCH_BACK
+#undef MATCH_PREV
+#undef MATCH_TOINDEX
+#undef MATCH_FROMINDEX
+#undef MATCH_PREFIX_LENGTH
+#undef MATCH_SEARCH
+
+// The engine over UTF-8, where ill-formed sequences are read as U+FFFD
+#define MATCH_UNIT				uint8_t
+#define MATCH_FN(name)			name##_utf8
+#define MATCH_NEXT(s, e, c)		do { int32_t i_ = 0; U8_NEXT((s), i_, (int32_t)((e) - (s)), (c)); (s) += i_; if ((c) < 0) (c) = 0xfffd; } while (0)
+#define MATCH_FWD(s, e)			do { int32_t i_ = 0; U8_FWD_1((s), i_, (int32_t)((e) - (s))); (s) += i_; } while (0)
+#define MATCH_BACK(init, s)		do { int32_t i_ = (int32_t)((s) - (init)); U8_BACK_1((init), 0, i_); (s) = (init) + i_; } while (0)
+#define MATCH_PREV(init, s, c)	do { int32_t i_ = (int32_t)((s) - (init)); U8_PREV((init), 0, i_, (c)); if ((c) < 0) (c) = 0xfffd; } while (0)
+#define MATCH_TOINDEX(ms, offset)	utf8_toindex((ms), (offset))
+#define MATCH_FROMINDEX(ms, index)	utf8_fromindex((ms), (index))
+#define MATCH_PREFIX_LENGTH(patt)	((patt)->prefix_utf8_length)
+#define MATCH_SEARCH(patt, s, e)	((const uint8_t*)search_bytes((const char*)(s), (size_t)((e) - (s)), (patt)->prefix_utf8, (size_t)(patt)->prefix_utf8_length))
+#include "matchengine_impl.h"
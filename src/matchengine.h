@@ -6,6 +6,14 @@
 #define CAP_POSITION    (-2)
 
 #define L_ESC           '%'
+#define SPECIALS        "^$*+?.([%-"
+
+// How many compiled patterns a UPatternCache holds on to
+#define UPATTERN_CACHE_SIZE	16
+
+// Patterns with up to this many items backtrack without allocating, and the linear matcher's
+// threads for a dozen or so states fit in the same space (see umatch_setpattern)
+#define UMATCH_LOCAL_FRAMES	32
 
 struct UMatchState;
 typedef struct UMatchState UMatchState;
@@ -13,34 +21,81 @@ typedef struct UMatchState UMatchState;
 struct GmatchState;
 typedef struct GmatchState GmatchState;
 
-typedef void ProcessUCharIteratorRangeFunc(UMatchState* ms, uint32_t start_state, uint32_t end_state);
+// A pattern parsed into items, ready for matching (see upattern_compile)
+struct UPattern;
+typedef struct UPattern UPattern;
+
+// start and end are offsets into the source, in UChars for a ustring or bytes for UTF-8
+typedef void ProcessUMatchRangeFunc(UMatchState* ms, int32_t start, int32_t end);
 typedef void ProcessUMatchStateFunc(UMatchState* ms);
 
+// Something for the matcher to go back to when the rest of the pattern fails to match: another
+// way of matching an item, or a capture to undo
+typedef struct UMatchFrame {
+	int kind;
+	const void* item;
+	const void* s; // where in the source
+	int32_t n;
+} UMatchFrame;
+
 struct UMatchState {
 	int level; // total number of captures, finished or unfinished
 	lua_State *L;
 	luaL_Buffer* b;
-	void* context;
-	ProcessUCharIteratorRangeFunc* pushRange;
-	ProcessUCharIteratorRangeFunc* addRange;
-	uint32_t end_state;
+	void* context; // the source's UChars or UTF-8 bytes (see umatch_setsource)
+	int32_t source_length; // in UChars or bytes
+	int source_idx; // stack index of the source string, for pushRange
+	const UPattern* patt;
+	ProcessUMatchRangeFunc* pushRange;
+	ProcessUMatchRangeFunc* addRange;
+	int32_t start; // of the whole match
+	int32_t end;
+	int32_t index_offset; // the last UTF-8 offset turned into a UTF-16 index, and that index
+	int32_t index;
+	int32_t step_limit; // the most steps a single call may take, -1 for no limit
+	int32_t steps_left; // before match_outofsteps has to look at the limit and the budget
+	int32_t steps_counted; // what steps_left was last set to
+	int32_t limit_left; // of step_limit, not counting the steps since steps_left was set
+	int32_t backtrack_left; // steps backtracking may take before switching to the linear matcher
+	int linear; // matching has switched to the linear matcher, for the rest of the call (or gmatch)
+	UMatchFrame* frames; // the backtracking stack or the linear matcher's threads, local_frames unless the pattern is too big
 	struct {
-		uint32_t start_state;
-		uint32_t end_state;
+		int32_t start;
+		int32_t end;
 		int what;
 	} capture[LUA_MAXCAPTURES];
+	UMatchFrame local_frames[UMATCH_LOCAL_FRAMES];
 };
 
 struct GmatchState {
-	UMatchState ms;
-	UCharIterator sourceIter;
-	UCharIterator pattIter;
-	uint32_t source_state;
-	int matched_empty_end;
+	UMatchState ms; // ms.patt and the source must be kept alive by the gmatch closure
+	int32_t position; // where the next match is looked for, past the end when there are no more
 };
 
-int iter_match(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter, int init, int find);
-int uiter_gsub_aux(UMatchState* ms, UCharIterator* pPattIter, UCharIterator* pSourceIter, ProcessUMatchStateFunc on_match, int max_s);
-int gmatch_aux(lua_State *L);
+// Compiled patterns, keyed by the (interned) string they were compiled from
+typedef struct UPatternCache {
+	struct {
+		const void* key; // kept alive by key_ref while it is in the cache
+		int key_ref;
+		int pattern_ref;
+	} entries[UPATTERN_CACHE_SIZE]; // most recently used first
+	int count;
+	int32_t match_limit; // for matching with any pattern, -1 for no limit (see umatch_setpattern)
+} UPatternCache;
+
+UPattern* upattern_compile(lua_State *L, UCharIterator* pPattIter);
+UPattern* upattern_pushcached(lua_State *L, UPatternCache* cache, const void* key);
+void upattern_addcached(lua_State *L, UPatternCache* cache, const void* key, int key_idx);
+
+void umatch_setsource(UMatchState* ms, const void* source, int32_t length);
+int umatch_setpattern(UMatchState* ms, const UPattern* patt, int32_t limit);
+
+// The engine is built once for ustring sources (_u16) and once for UTF-8 sources (_utf8)
+int umatch_find_u16(UMatchState* ms, int init, int find);
+int umatch_gsub_u16(UMatchState* ms, ProcessUMatchStateFunc on_match, int max_s);
+int umatch_gmatch_aux_u16(lua_State *L);
+int umatch_find_utf8(UMatchState* ms, int init, int find);
+int umatch_gsub_utf8(UMatchState* ms, ProcessUMatchStateFunc on_match, int max_s);
+int umatch_gmatch_aux_utf8(lua_State *L);
 
 #define uchar(c)        ((unsigned char)(c))
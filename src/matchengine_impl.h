@@ -0,0 +1,666 @@
+
+// The body of the pattern matching engine, included by matchengine.c once for each kind of
+// source storage, so there is no include guard. Before each inclusion, matchengine.c defines:
+//   MATCH_UNIT            the code unit type (UChar or uint8_t)
+//   MATCH_FN(name)        the name of the specialized version of a function
+//   MATCH_NEXT(s, e, c)   decode the code point at s into c, moving s past it
+//   MATCH_FWD(s, e)       move s past the code point at s
+//   MATCH_BACK(init, s)   move s back to the start of the code point before it
+//   MATCH_PREV(init, s, c) decode the code point before s into c, leaving s alone
+//   MATCH_TOINDEX(ms, offset)  the UTF-16 index of a source offset
+//   MATCH_FROMINDEX(ms, index) the source offset of a UTF-16 index
+//   MATCH_PREFIX_LENGTH(patt)  the length of the pattern's literal prefix in code units
+//   MATCH_SEARCH(patt, s, e)   find the literal prefix between s and e, or NULL
+// Positions are plain pointers into the source, and a match returns the pointer to where it
+// ended (or NULL if it failed), as in Lua's lstrlib.c, but backtracking goes through the
+// UMatchFrame stack rather than C recursion. Patterns with nothing but single character items,
+// literals and $ can also be matched by the linear matcher (see linear_match), which is
+// switched to when backtracking over them has taken too long
+
+static const MATCH_UNIT* MATCH_FN(matchbalance)(UMatchState* ms, const MATCH_UNIT* s, const UPattItem* p) {
+	const MATCH_UNIT* s_end = MATCH_SOURCE_END(ms);
+	UChar32 c;
+	int cont = 1;
+	if (s >= s_end) {
+		return NULL;
+	}
+	MATCH_NEXT(s, s_end, c);
+	if (c != p->c) {
+		return NULL;
+	}
+	while (s < s_end) {
+		MATCH_STEP(ms);
+		MATCH_NEXT(s, s_end, c);
+		if (c == p->c2) {
+			if (--cont == 0) {
+				return s;
+			}
+		}
+		else if (c == p->c) {
+			cont++;
+		}
+	}
+	return NULL; // string ends out of balance
+}
+
+// The same text is always encoded the same way, so the code units can be compared directly
+static const MATCH_UNIT* MATCH_FN(match_capture)(UMatchState* ms, const MATCH_UNIT* s, int l) {
+	int32_t len;
+	l = check_capture(ms, l);
+	if (ms->capture[l].what == CAP_POSITION) {
+		return NULL;
+	}
+	len = ms->capture[l].end - ms->capture[l].start;
+	if (MATCH_SOURCE_END(ms) - s >= len
+		&& memcmp(MATCH_SOURCE(ms) + ms->capture[l].start, s, len * sizeof(MATCH_UNIT)) == 0) {
+		return s + len;
+	}
+	return NULL;
+}
+
+// Match the items from p at s. Where there is more than one way to go on (a quantifier) the
+// first is taken and a frame is pushed to come back to, like a call in lstrlib.c's recursion:
+// * and + take as many repetitions as possible and give them back one at a time, - takes as
+// few as possible and adds one at a time, ? takes its item then tries without it. Captures
+// push a frame to undo them. Every item pushes at most one frame, and the frames above one
+// are gone by the time it is come back to, so the stack never holds more than the items.
+static const MATCH_UNIT* MATCH_FN(match)(UMatchState* ms, const MATCH_UNIT* s, const UPattItem* p) {
+	const MATCH_UNIT* s_init = MATCH_SOURCE(ms);
+	const MATCH_UNIT* s_end = MATCH_SOURCE_END(ms);
+	const MATCH_UNIT* next;
+	UMatchFrame* top = ms->frames; // the next free frame
+	UMatchFrame* f;
+	UChar32 c;
+	int32_t n;
+	int m;
+	for (;;) {
+		MATCH_STEP(ms);
+		switch (p->op) {
+			case PATT_END: // end of pattern
+				return s; // match succeeded
+			case PATT_EOS:
+				if (s != s_end) {
+					goto fail;
+				}
+				p++;
+				continue;
+			case PATT_OPEN: // start capture
+			case PATT_POSITION: // position capture
+				if (ms->level >= LUA_MAXCAPTURES) {
+					luaL_error(ms->L, "too many captures");
+				}
+				ms->capture[ms->level].start = ms->capture[ms->level].end = (int32_t)(s - s_init);
+				ms->capture[ms->level].what = (p->op == PATT_OPEN) ? CAP_UNFINISHED : CAP_POSITION;
+				ms->level++;
+				top->kind = MATCH_FRAME_OPEN;
+				top++;
+				p++;
+				continue;
+			case PATT_CLOSE: // end capture
+				n = capture_to_close(ms);
+				ms->capture[n].end = (int32_t)(s - s_init);
+				ms->capture[n].what = CAP_SUCCESSFUL;
+				top->kind = MATCH_FRAME_CLOSE;
+				top->n = n;
+				top++;
+				p++;
+				continue;
+			case PATT_BALANCE:
+				if ((s = MATCH_FN(matchbalance)(ms, s, p)) == NULL) {
+					goto fail;
+				}
+				p++;
+				continue;
+			case PATT_FRONTIER: {
+				UChar32 previous;
+				next = s;
+				if (s > s_init) {
+					MATCH_PREV(s_init, s, previous);
+				}
+				else {
+					previous = '\0';
+				}
+				if (s < s_end) {
+					MATCH_NEXT(next, s_end, c);
+				}
+				else {
+					c = '\0';
+				}
+				if (matchbracketclass(ms->patt, p->arg, previous)
+					|| !matchbracketclass(ms->patt, p->arg, c)) {
+					goto fail;
+				}
+				p++;
+				continue;
+			}
+			case PATT_BACKREF: // capture results %0 to %9
+				if ((s = MATCH_FN(match_capture)(ms, s, p->c)) == NULL) {
+					goto fail;
+				}
+				p++;
+				continue;
+			case PATT_LITERAL: {
+				const UChar32* lit = &ms->patt->literals[p->arg];
+				for (n = p->length; n > 0; n--) {
+					if (s >= s_end) {
+						goto fail;
+					}
+					MATCH_NEXT(s, s_end, c);
+					if (c != *lit++) {
+						goto fail;
+					}
+				}
+				p++;
+				continue;
+			}
+			default: // a single character item, maybe quantified
+				next = s;
+				m = 0;
+				if (s < s_end) {
+					MATCH_NEXT(next, s_end, c);
+					m = singlematch(ms->patt, p, c);
+				}
+				switch (p->quantifier) {
+					case '?': // optional
+						if (m) {
+							top->kind = MATCH_FRAME_OPTIONAL;
+							top->item = p;
+							top->s = s;
+							top++;
+							s = next;
+						}
+						p++;
+						continue;
+					case '+': // 1 or more repetitions
+						if (!m) {
+							goto fail;
+						}
+						s = next;
+						// the rest is the same as *
+						// fall through
+					case '*': // 0 or more repetitions
+						n = 0;
+						while (s < s_end) {
+							MATCH_STEP(ms);
+							next = s;
+							MATCH_NEXT(next, s_end, c);
+							if (!singlematch(ms->patt, p, c)) {
+								break;
+							}
+							s = next;
+							n++;
+						}
+						if (n > 0) {
+							top->kind = MATCH_FRAME_MAX;
+							top->item = p;
+							top->s = s;
+							top->n = n;
+							top++;
+						}
+						p++;
+						continue;
+					case '-': // 0 or more repetitions (minimum)
+						top->kind = MATCH_FRAME_MIN;
+						top->item = p;
+						top->s = s;
+						top++;
+						p++;
+						continue;
+					default:
+						if (!m) {
+							goto fail;
+						}
+						s = next;
+						p++;
+						continue;
+				}
+		}
+		fail: // go back to the last frame with another way of going on
+		for (;;) {
+			if (top == ms->frames) {
+				return NULL;
+			}
+			MATCH_STEP(ms);
+			f = top - 1;
+			switch (f->kind) {
+				case MATCH_FRAME_OPEN:
+					ms->level--;
+					top--;
+					continue;
+				case MATCH_FRAME_CLOSE:
+					ms->capture[f->n].what = CAP_UNFINISHED;
+					top--;
+					continue;
+				case MATCH_FRAME_OPTIONAL: // try without it
+					top--;
+					s = (const MATCH_UNIT*)f->s;
+					p = (const UPattItem*)f->item + 1;
+					break;
+				case MATCH_FRAME_MAX: // give back one repetition
+					s = (const MATCH_UNIT*)f->s;
+					MATCH_BACK(s_init, s);
+					if (--f->n == 0) {
+						top--;
+					}
+					else {
+						f->s = s;
+					}
+					p = (const UPattItem*)f->item + 1;
+					break;
+				default: // MATCH_FRAME_MIN, add one repetition
+					s = (const MATCH_UNIT*)f->s;
+					p = (const UPattItem*)f->item;
+					if (s < s_end) {
+						next = s;
+						MATCH_NEXT(next, s_end, c);
+						if (singlematch(ms->patt, p, c)) {
+							f->s = s = next;
+							p++;
+							break;
+						}
+					}
+					top--;
+					continue;
+			}
+			break;
+		}
+	}
+}
+
+// Skip ahead from s to the first place an unanchored match could start, or to the end. Only
+// code point boundaries are ever stopped at, and search_uchars never stops inside a pair either
+static const MATCH_UNIT* MATCH_FN(skip)(const UPattern* patt, const MATCH_UNIT* s, const MATCH_UNIT* s_end) {
+	if (MATCH_PREFIX_LENGTH(patt) > 0) {
+		s = MATCH_SEARCH(patt, s, s_end);
+		return s ? s : s_end;
+	}
+	if (patt->start_known) {
+		while (s < s_end) {
+			if (*s < 0x80) {
+				if (patt->start_ascii[*s >> 3] & (1 << (*s & 7))) {
+					break;
+				}
+				s++;
+			}
+			else if (patt->start_nonascii) {
+				break;
+			}
+			else {
+				MATCH_FWD(s, s_end);
+			}
+		}
+	}
+	return s;
+}
+
+// Add the thread for state n of item p at s, or the threads for all the states it leads to
+// without reading anything, to the end of list, in the order the backtracker would try them
+static void MATCH_FN(addthreads)(UMatchLinear* lin, UMatchThread* list, int32_t* count,
+	const UPattItem* p, int32_t n, const MATCH_UNIT* s, const MATCH_UNIT* s_end, int32_t start)
+{
+	UMatchThread* top = lin->stack;
+	top->p = p;
+	top->n = n;
+	top++;
+	while (top > lin->stack) {
+		top--;
+		p = top->p;
+		n = top->n;
+		if (lin->marks[p->state + n] == lin->generation) {
+			continue; // a thread that is tried first already got there
+		}
+		lin->marks[p->state + n] = lin->generation;
+		switch (p->op) {
+			case PATT_EOS:
+				if (s == s_end) {
+					top->p = p + 1;
+					top->n = 0;
+					top++;
+				}
+				continue;
+			case PATT_END:
+			case PATT_LITERAL:
+				break;
+			default:
+				if (p->quantifier == '-' && n == 0) {
+					// without another repetition first, then with one (the stack is last in, first out)
+					top->p = p;
+					top->n = 1;
+					top++;
+					top->p = p + 1;
+					top->n = 0;
+					top++;
+					continue;
+				}
+				if (p->quantifier == '?' || p->quantifier == '*' || (p->quantifier == '+' && n == 1)) {
+					// with another repetition first, then without
+					list[*count].p = p;
+					list[*count].n = n;
+					list[*count].start = start;
+					(*count)++;
+					top->p = p + 1;
+					top->n = 0;
+					top++;
+					continue;
+				}
+				break;
+		}
+		list[*count].p = p;
+		list[*count].n = n;
+		list[*count].start = start;
+		(*count)++;
+	}
+}
+
+// Find the first match of items from s onwards (only at s, if anchored), as match would find
+// it, setting ms->start and ms->end if there is one. Rather than trying each way of matching in
+// turn, every way is followed at once, reading each character of the source just once: a
+// thread for each state that can be reached, kept in the order the backtracker would try them.
+// Where two threads reach the same state only the first is kept, as the other can only go on
+// the same way, so there are never more threads than states. A thread that gets to the end of
+// the pattern is a match, and the threads after it can be dropped, but the ones before it
+// carry on in case one of them gets to the end as well, as that would be the match preferred
+static int MATCH_FN(linear_match)(UMatchState* ms, const MATCH_UNIT* s, const UPattItem* items, int anchored) {
+	const MATCH_UNIT* s_init = MATCH_SOURCE(ms);
+	const MATCH_UNIT* s_end = MATCH_SOURCE_END(ms);
+	const MATCH_UNIT* s_start = s;
+	const MATCH_UNIT* next = s;
+	int32_t state_count = ms->patt->state_count;
+	UMatchThread* current = (UMatchThread*)ms->frames;
+	UMatchThread* following = current + state_count;
+	UMatchThread* swap;
+	int32_t current_count = 0, following_count, i, n;
+	const UPattItem* p;
+	UMatchLinear lin;
+	int matched = 0;
+	UChar32 c = 0;
+	lin.stack = following + state_count;
+	lin.marks = (int32_t*)(lin.stack + state_count + 1);
+	for (i = 0; i < state_count; i++) {
+		lin.marks[i] = -1;
+	}
+	lin.generation = 0;
+	ms->level = 0;
+	for (;;) {
+		// a match starting here comes after all those that started earlier
+		if (!matched && (!anchored || s == s_start)) {
+			if (current_count == 0 && !anchored) {
+				next = MATCH_FN(skip)(ms->patt, s, s_end);
+				if (next != s) {
+					s = next;
+					lin.generation++;
+				}
+			}
+			MATCH_FN(addthreads)(&lin, current, &current_count, items, 0, s, s_end, (int32_t)(s - s_init));
+		}
+		else if (current_count == 0) {
+			break;
+		}
+		if (s < s_end) {
+			next = s;
+			MATCH_NEXT(next, s_end, c);
+		}
+		lin.generation++;
+		following_count = 0;
+		for (i = 0; i < current_count; i++) {
+			if (--ms->steps_left < 0) {
+				match_outofsteps(ms);
+			}
+			p = current[i].p;
+			n = current[i].n;
+			if (p->op == PATT_END) {
+				matched = 1;
+				ms->start = current[i].start;
+				ms->end = (int32_t)(s - s_init);
+				break;
+			}
+			if (s >= s_end) {
+				continue;
+			}
+			if (p->op == PATT_LITERAL) {
+				if (c != ms->patt->literals[p->arg + n]) {
+					continue;
+				}
+				if (++n == p->length) {
+					p++;
+					n = 0;
+				}
+			}
+			else {
+				if (!singlematch(ms->patt, p, c)) {
+					continue;
+				}
+				switch (p->quantifier) {
+					case '*':
+					case '-':
+						n = 0;
+						break;
+					case '+':
+						n = 1;
+						break;
+					default:
+						p++;
+						n = 0;
+						break;
+				}
+			}
+			MATCH_FN(addthreads)(&lin, following, &following_count, p, n, next, s_end, current[i].start);
+		}
+		if (s >= s_end) {
+			break;
+		}
+		swap = current;
+		current = following;
+		following = swap;
+		current_count = following_count;
+		s = next;
+	}
+	return matched;
+}
+
+// Look for a match from s onwards (only at s, if the pattern is anchored), setting ms->start
+// and ms->end if there is one
+static int MATCH_FN(match_aux)(UMatchState* ms, const MATCH_UNIT* s) {
+	const MATCH_UNIT* s_end = MATCH_SOURCE_END(ms);
+	const MATCH_UNIT* e;
+	for (;;) {
+		if (ms->linear) {
+			return MATCH_FN(linear_match)(ms, s, ms->patt->items, ms->patt->anchored);
+		}
+		if (!ms->patt->anchored) {
+			s = MATCH_FN(skip)(ms->patt, s, s_end);
+		}
+		ms->level = 0;
+		if ((e = MATCH_FN(match)(ms, s, ms->patt->items)) != NULL) {
+			ms->start = (int32_t)(s - MATCH_SOURCE(ms));
+			ms->end = (int32_t)(e - MATCH_SOURCE(ms));
+			return 1;
+		}
+		if (ms->linear) {
+			continue; // backtracking gave up, so carry on from s in linear time
+		}
+		if (ms->patt->anchored || s >= s_end) {
+			return 0;
+		}
+		MATCH_FWD(s, s_end);
+	}
+}
+
+static int MATCH_FN(push_captures)(UMatchState* ms) {
+	int i;
+	if (ms->level == 0) {
+		ms->pushRange(ms, ms->start, ms->end);
+		return 1;
+	}
+	for (i = 0; i < ms->level; i++) {
+		switch(ms->capture[i].what) {
+			case CAP_POSITION:
+				lua_pushinteger(ms->L, MATCH_TOINDEX(ms, ms->capture[i].start) + 1);
+				break;
+			case CAP_SUCCESSFUL:
+				ms->pushRange(ms, ms->capture[i].start, ms->capture[i].end);
+				break;
+			default:
+				return luaL_error(ms->L, "unfinished captures in pattern");
+		}
+	}
+	return ms->level;
+}
+
+// init is a 1-based UTF-16 index, negative to count back from the end
+static int32_t MATCH_FN(initoffset)(UMatchState* ms, int init) {
+	int32_t index = 0;
+	if (init > 0) {
+		index = init - 1;
+	}
+	else if (init < 0) {
+		index = MATCH_TOINDEX(ms, ms->source_length) + init;
+		if (index < 0) {
+			index = 0;
+		}
+	}
+	return MATCH_FROMINDEX(ms, index);
+}
+
+int MATCH_FN(umatch_find)(UMatchState* ms, int init, int find) {
+	match_resetsteps(ms);
+	if (!MATCH_FN(match_aux)(ms, MATCH_SOURCE(ms) + MATCH_FN(initoffset)(ms, init))) {
+		lua_pushnil(ms->L);
+		return 1;
+	}
+	if (find) {
+		lua_pushinteger(ms->L, MATCH_TOINDEX(ms, ms->start) + 1);
+		lua_pushinteger(ms->L, MATCH_TOINDEX(ms, ms->end));
+		if (ms->level == 0) {
+			return 2;
+		}
+		return MATCH_FN(push_captures)(ms) + 2;
+	}
+	else {
+		return MATCH_FN(push_captures)(ms);
+	}
+}
+
+int MATCH_FN(umatch_gsub)(UMatchState* ms, ProcessUMatchStateFunc on_match, int max_replacements) {
+	const MATCH_UNIT* s_init = MATCH_SOURCE(ms);
+	const MATCH_UNIT* s_end = MATCH_SOURCE_END(ms);
+	const MATCH_UNIT* s = s_init;
+	const MATCH_UNIT* e;
+	const MATCH_UNIT* next;
+	int replacements = 0;
+	match_resetsteps(ms);
+	while (replacements < max_replacements) {
+		if (ms->linear) {
+			// go straight to the next match, adding everything before it
+			if (!MATCH_FN(linear_match)(ms, s, ms->patt->items, ms->patt->anchored)) {
+				break;
+			}
+			next = s_init + ms->start;
+			if (next > s) {
+				ms->addRange(ms, (int32_t)(s - s_init), ms->start);
+				s = next;
+			}
+			e = s_init + ms->end;
+		}
+		else {
+			if (!ms->patt->anchored) {
+				// everything skipped over would have been added one character at a time
+				next = MATCH_FN(skip)(ms->patt, s, s_end);
+				if (next > s) {
+					ms->addRange(ms, (int32_t)(s - s_init), (int32_t)(next - s_init));
+					s = next;
+				}
+			}
+			ms->level = 0;
+			e = MATCH_FN(match)(ms, s, ms->patt->items);
+			if (e == NULL && ms->linear) {
+				continue; // backtracking gave up, so carry on from s in linear time
+			}
+		}
+		if (e != NULL) {
+			ms->start = (int32_t)(s - s_init);
+			ms->end = (int32_t)(e - s_init);
+			if (ms->level == 0) {
+				ms->level = 1;
+				ms->capture[0].what = CAP_SUCCESSFUL;
+				ms->capture[0].start = ms->start;
+				ms->capture[0].end = ms->end;
+			}
+			// add the replacement to output
+			on_match(ms);
+			replacements++;
+		}
+		if (e != NULL && e > s) {
+			s = e;
+		}
+		else if (s < s_end) {
+			// add the single non-matching (or empty-matching) character to output
+			next = s;
+			MATCH_FWD(next, s_end);
+			ms->addRange(ms, (int32_t)(s - s_init), (int32_t)(next - s_init));
+			s = next;
+		}
+		else {
+			break;
+		}
+		if (ms->patt->anchored) {
+			break;
+		}
+	}
+	ms->addRange(ms, (int32_t)(s - s_init), ms->source_length);
+	return replacements;
+}
+
+// The GmatchState is upvalue 3
+int MATCH_FN(umatch_gmatch_aux)(lua_State *L) {
+	GmatchState* gms = (GmatchState*)lua_touserdata(L, lua_upvalueindex(3));
+	UMatchState* ms = &gms->ms;
+	const MATCH_UNIT* s_init = MATCH_SOURCE(ms);
+	const MATCH_UNIT* s_end = MATCH_SOURCE_END(ms);
+	const MATCH_UNIT* s;
+	const MATCH_UNIT* e;
+	ms->L = L;
+	match_resetsteps(ms);
+	if (gms->position > ms->source_length) {
+		return 0;
+	}
+	for (s = s_init + gms->position;;) {
+		if (ms->linear) {
+			if (!MATCH_FN(linear_match)(ms, s, ms->patt->gmatch_items, 0)) {
+				break;
+			}
+			s = s_init + ms->start;
+			e = s_init + ms->end;
+		}
+		else {
+			s = MATCH_FN(skip)(ms->patt, s, s_end);
+			ms->level = 0;
+			e = MATCH_FN(match)(ms, s, ms->patt->gmatch_items);
+			if (e == NULL && ms->linear) {
+				continue; // backtracking gave up, so carry on from s in linear time
+			}
+		}
+		if (e != NULL) {
+			ms->start = (int32_t)(s - s_init);
+			ms->end = (int32_t)(e - s_init);
+			if (e != s) {
+				gms->position = ms->end;
+			}
+			else if (e < s_end) {
+				// an empty match, so the next one is looked for a character later
+				MATCH_FWD(e, s_end);
+				gms->position = (int32_t)(e - s_init);
+			}
+			else {
+				gms->position = ms->source_length + 1;
+			}
+			return MATCH_FN(push_captures)(ms);
+		}
+		if (s >= s_end) {
+			break;
+		}
+		MATCH_FWD(s, s_end);
+	}
+	gms->position = ms->source_length + 1;
+	return 0; // end of gmatch
+}
@@ -0,0 +1,374 @@
+// Plain substring search. Short needles (and short haystacks, where setting up a skip table
+// costs more than it saves) are found by filtering on the first and last unit of the needle -
+// for bytes the first unit is found by memchr, which C libraries vectorize - and only comparing
+// the rest where both match. Otherwise it is Boyer-Moore-Horspool, where a mismatch lets the
+// search skip ahead by up to the whole length of the needle.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unicode/utypes.h>
+#include <unicode/utf16.h>
+#include "search.h"
+
+#define SEARCH_HORSPOOL_MIN_NEEDLE		4
+#define SEARCH_HORSPOOL_MIN_HAYSTACK	256
+
+const char* search_bytes(const char* haystack, size_t haystack_len, const char* needle, size_t needle_len) {
+	const unsigned char* s = (const unsigned char*)haystack;
+	const unsigned char* n = (const unsigned char*)needle;
+	const unsigned char* limit;
+	size_t last, i;
+	size_t skip[256];
+
+	if (needle_len == 0) {
+		return haystack; // empty strings are everywhere
+	}
+	if (needle_len > haystack_len) {
+		return NULL;
+	}
+	if (needle_len == 1) {
+		return (const char*)memchr(haystack, n[0], haystack_len);
+	}
+	last = needle_len - 1;
+	limit = s + (haystack_len - last); // the needle cannot start at or after this
+	if (needle_len < SEARCH_HORSPOOL_MIN_NEEDLE || haystack_len < SEARCH_HORSPOOL_MIN_HAYSTACK) {
+		while (s < limit && (s = (const unsigned char*)memchr(s, n[0], limit - s)) != NULL) {
+			if (s[last] == n[last] && memcmp(s + 1, n + 1, last - 1) == 0) {
+				return (const char*)s;
+			}
+			s++;
+		}
+		return NULL;
+	}
+	for (i = 0; i < 256; i++) {
+		skip[i] = needle_len;
+	}
+	for (i = 0; i < last; i++) {
+		skip[n[i]] = last - i;
+	}
+	for (; s < limit; s += skip[s[last]]) {
+		if (s[last] == n[last] && s[0] == n[0] && memcmp(s + 1, n + 1, last - 1) == 0) {
+			return (const char*)s;
+		}
+	}
+	return NULL;
+}
+
+// The skip table for UChars is indexed by the low byte, so units that share it share the
+// smallest skip of any of them - that can only make a skip shorter, never skip past a match
+static const UChar* search_uchars_aux(const UChar* haystack, int32_t haystack_len, const UChar* needle, int32_t needle_len) {
+	const UChar* s = haystack;
+	const UChar* limit;
+	int32_t last, i;
+	UChar first, last_unit;
+	int32_t skip[256];
+
+	if (needle_len > haystack_len) {
+		return NULL;
+	}
+	last = needle_len - 1;
+	first = needle[0];
+	last_unit = needle[last];
+	limit = s + (haystack_len - last);
+	if (needle_len < SEARCH_HORSPOOL_MIN_NEEDLE || haystack_len < SEARCH_HORSPOOL_MIN_HAYSTACK) {
+		for (; s < limit; s++) {
+			if (s[0] == first && s[last] == last_unit && memcmp(s, needle, sizeof(UChar) * last) == 0) {
+				return s;
+			}
+		}
+		return NULL;
+	}
+	for (i = 0; i < 256; i++) {
+		skip[i] = needle_len;
+	}
+	for (i = 0; i < last; i++) {
+		skip[needle[i] & 0xFF] = last - i;
+	}
+	for (; s < limit; s += skip[s[last] & 0xFF]) {
+		if (s[last] == last_unit && s[0] == first && memcmp(s + 1, needle + 1, sizeof(UChar) * (last - 1)) == 0) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+// Like u_strFindFirst, a match never starts or ends in the middle of a surrogate pair
+const UChar* search_uchars(const UChar* haystack, int32_t haystack_len, const UChar* needle, int32_t needle_len) {
+	const UChar* limit = haystack + haystack_len;
+	const UChar* from = haystack;
+	const UChar* found;
+	int check_start, check_end;
+
+	if (needle_len == 0) {
+		return haystack;
+	}
+	check_start = U16_IS_TRAIL(needle[0]);
+	check_end = U16_IS_LEAD(needle[needle_len - 1]);
+	for (;;) {
+		found = search_uchars_aux(from, (int32_t)(limit - from), needle, needle_len);
+		if (!found) {
+			return NULL;
+		}
+		if (!(check_start && found > haystack && U16_IS_LEAD(found[-1]))
+			&& !(check_end && found + needle_len < limit && U16_IS_TRAIL(found[needle_len]))) {
+			return found;
+		}
+		from = found + 1;
+	}
+}
+
+// The trie is put together with linked lists of children, then build() lays the edges out
+// sorted by byte, one run per state, works out the failure links breadth-first, and gives
+// the root a full table of 256 so the most common step is a single lookup. From each state
+// a chain of "dictionary" links leads through every state whose needle ends there too.
+
+#define SEARCH_AUTOMATON_MIN_STATES	64
+
+struct SearchAutomaton {
+	int32_t state_count;
+	int32_t state_capacity;
+	int32_t needle_count;
+	int32_t needle_capacity;
+	int32_t max_length; // of any needle, in code points
+	// per state
+	int32_t* first_child; // while building
+	int32_t* next_sibling; // while building
+	unsigned char* in_byte; // the byte on the edge leading into the state
+	int32_t* output; // the first needle that ends here, or -1
+	int32_t* fail;
+	int32_t* dict; // the next state down the failure chain that has an output, or -1
+	int32_t* edge_start; // each state's run of edges, once built
+	int32_t* edge_end;
+	// per edge (state_count - 1 of them, sorted by byte within each state's run)
+	unsigned char* edge_byte;
+	int32_t* edge_target;
+	// per needle
+	int32_t* next_same; // the next needle with the same text, or -1
+	int32_t* needle_length; // in code points
+	int32_t root_next[256];
+};
+
+SearchAutomaton* search_automaton_new(void) {
+	SearchAutomaton* automaton = (SearchAutomaton*)calloc(1, sizeof(SearchAutomaton));
+	if (!automaton) {
+		return NULL;
+	}
+	automaton->state_capacity = SEARCH_AUTOMATON_MIN_STATES;
+	automaton->first_child = (int32_t*)malloc(sizeof(int32_t) * automaton->state_capacity);
+	automaton->next_sibling = (int32_t*)malloc(sizeof(int32_t) * automaton->state_capacity);
+	automaton->in_byte = (unsigned char*)malloc(automaton->state_capacity);
+	automaton->output = (int32_t*)malloc(sizeof(int32_t) * automaton->state_capacity);
+	if (!automaton->first_child || !automaton->next_sibling || !automaton->in_byte || !automaton->output) {
+		search_automaton_free(automaton);
+		return NULL;
+	}
+	automaton->state_count = 1;
+	automaton->first_child[0] = automaton->next_sibling[0] = automaton->output[0] = -1;
+	automaton->in_byte[0] = 0;
+	return automaton;
+}
+
+void search_automaton_free(SearchAutomaton* automaton) {
+	if (!automaton) {
+		return;
+	}
+	free(automaton->first_child);
+	free(automaton->next_sibling);
+	free(automaton->in_byte);
+	free(automaton->output);
+	free(automaton->fail);
+	free(automaton->dict);
+	free(automaton->edge_start);
+	free(automaton->edge_end);
+	free(automaton->edge_byte);
+	free(automaton->edge_target);
+	free(automaton->next_same);
+	free(automaton->needle_length);
+	free(automaton);
+}
+
+static int search_automaton_grow(void** array, size_t element_size, int32_t capacity) {
+	void* grown = realloc(*array, element_size * capacity);
+	if (!grown) {
+		return 0;
+	}
+	*array = grown;
+	return 1;
+}
+
+// Returns 0 if memory ran out (the automaton can still be freed)
+int search_automaton_add(SearchAutomaton* automaton, const char* needle, size_t needle_len, int32_t needle_cp_len) {
+	const unsigned char* p = (const unsigned char*)needle;
+	int32_t state = 0, child, needle_index, last;
+	size_t i;
+
+	if (automaton->needle_count == automaton->needle_capacity) {
+		int32_t capacity = automaton->needle_capacity ? automaton->needle_capacity * 2 : SEARCH_AUTOMATON_MIN_STATES;
+		if (!search_automaton_grow((void**)&automaton->next_same, sizeof(int32_t), capacity)
+			|| !search_automaton_grow((void**)&automaton->needle_length, sizeof(int32_t), capacity)) {
+			return 0;
+		}
+		automaton->needle_capacity = capacity;
+	}
+	for (i = 0; i < needle_len; i++) {
+		for (child = automaton->first_child[state]; child != -1; child = automaton->next_sibling[child]) {
+			if (automaton->in_byte[child] == p[i]) {
+				break;
+			}
+		}
+		if (child == -1) {
+			if (automaton->state_count == automaton->state_capacity) {
+				int32_t capacity = automaton->state_capacity * 2;
+				if (!search_automaton_grow((void**)&automaton->first_child, sizeof(int32_t), capacity)
+					|| !search_automaton_grow((void**)&automaton->next_sibling, sizeof(int32_t), capacity)
+					|| !search_automaton_grow((void**)&automaton->in_byte, 1, capacity)
+					|| !search_automaton_grow((void**)&automaton->output, sizeof(int32_t), capacity)) {
+					return 0;
+				}
+				automaton->state_capacity = capacity;
+			}
+			child = automaton->state_count++;
+			automaton->first_child[child] = automaton->output[child] = -1;
+			automaton->in_byte[child] = p[i];
+			automaton->next_sibling[child] = automaton->first_child[state];
+			automaton->first_child[state] = child;
+		}
+		state = child;
+	}
+	needle_index = automaton->needle_count++;
+	automaton->next_same[needle_index] = -1;
+	automaton->needle_length[needle_index] = needle_cp_len;
+	if (needle_cp_len > automaton->max_length) {
+		automaton->max_length = needle_cp_len;
+	}
+	if (automaton->output[state] == -1) {
+		automaton->output[state] = needle_index;
+	}
+	else {
+		for (last = automaton->output[state]; automaton->next_same[last] != -1; last = automaton->next_same[last]);
+		automaton->next_same[last] = needle_index;
+	}
+	return 1;
+}
+
+// Returns 0 if memory ran out
+int search_automaton_build(SearchAutomaton* automaton) {
+	int32_t state_count = automaton->state_count;
+	int32_t* queue;
+	int32_t head, tail, state, child, edge, fail, i, j;
+	unsigned char c;
+
+	automaton->fail = (int32_t*)malloc(sizeof(int32_t) * state_count);
+	automaton->dict = (int32_t*)malloc(sizeof(int32_t) * state_count);
+	automaton->edge_start = (int32_t*)malloc(sizeof(int32_t) * state_count);
+	automaton->edge_end = (int32_t*)malloc(sizeof(int32_t) * state_count);
+	automaton->edge_byte = (unsigned char*)malloc(state_count);
+	automaton->edge_target = (int32_t*)malloc(sizeof(int32_t) * state_count);
+	queue = (int32_t*)malloc(sizeof(int32_t) * state_count);
+	if (!automaton->fail || !automaton->dict || !automaton->edge_start || !automaton->edge_end
+		|| !automaton->edge_byte || !automaton->edge_target || !queue) {
+		free(queue);
+		return 0;
+	}
+
+	// Lay the edges out breadth-first, keeping each state's run sorted (by insertion, runs are short)
+	queue[0] = 0;
+	for (head = 0, tail = 1, edge = 0; head < tail; head++) {
+		state = queue[head];
+		automaton->edge_start[state] = edge;
+		for (child = automaton->first_child[state]; child != -1; child = automaton->next_sibling[child]) {
+			c = automaton->in_byte[child];
+			for (j = edge; j > automaton->edge_start[state] && automaton->edge_byte[j - 1] > c; j--) {
+				automaton->edge_byte[j] = automaton->edge_byte[j - 1];
+				automaton->edge_target[j] = automaton->edge_target[j - 1];
+			}
+			automaton->edge_byte[j] = c;
+			automaton->edge_target[j] = child;
+			edge++;
+			queue[tail++] = child;
+		}
+		automaton->edge_end[state] = edge;
+	}
+	for (i = 0; i < 256; i++) {
+		automaton->root_next[i] = 0;
+	}
+	for (j = automaton->edge_start[0]; j < automaton->edge_end[0]; j++) {
+		automaton->root_next[automaton->edge_byte[j]] = automaton->edge_target[j];
+	}
+
+	// Failure links, in the same breadth-first order, so that everything shallower is done
+	automaton->fail[0] = 0;
+	automaton->dict[0] = -1;
+	for (head = 0; head < tail; head++) {
+		state = queue[head];
+		for (j = automaton->edge_start[state]; j < automaton->edge_end[state]; j++) {
+			child = automaton->edge_target[j];
+			fail = (state == 0) ? 0 : search_automaton_step(automaton, automaton->fail[state], automaton->edge_byte[j]);
+			automaton->fail[child] = fail;
+			automaton->dict[child] = (automaton->output[fail] != -1) ? fail : automaton->dict[fail];
+		}
+	}
+	free(queue);
+	free(automaton->first_child);
+	free(automaton->next_sibling);
+	automaton->first_child = automaton->next_sibling = NULL;
+	return 1;
+}
+
+int32_t search_automaton_step(const SearchAutomaton* automaton, int32_t state, unsigned char c) {
+	int32_t low, high, mid;
+	while (state != 0) {
+		low = automaton->edge_start[state];
+		high = automaton->edge_end[state];
+		while (low < high) {
+			mid = (low + high) / 2;
+			if (automaton->edge_byte[mid] < c) {
+				low = mid + 1;
+			}
+			else {
+				high = mid;
+			}
+		}
+		if (low < automaton->edge_end[state] && automaton->edge_byte[low] == c) {
+			return automaton->edge_target[low];
+		}
+		state = automaton->fail[state];
+	}
+	return automaton->root_next[c];
+}
+
+// The first state at or down the failure chain from state where a needle ends, or -1
+int32_t search_automaton_hitstate(const SearchAutomaton* automaton, int32_t state) {
+	return (automaton->output[state] != -1) ? state : automaton->dict[state];
+}
+
+// The first (and longest) needle that ends at a hit state
+int32_t search_automaton_needle(const SearchAutomaton* automaton, int32_t hit_state) {
+	return automaton->output[hit_state];
+}
+
+// Move on from needle, which ends at hit_state, to the next needle that ends at the same place.
+// Returns the hit state for that needle (setting *needle), or -1 if there are no more.
+int32_t search_automaton_nexthit(const SearchAutomaton* automaton, int32_t hit_state, int32_t* needle) {
+	if (automaton->next_same[*needle] != -1) {
+		*needle = automaton->next_same[*needle];
+		return hit_state;
+	}
+	hit_state = automaton->dict[hit_state];
+	if (hit_state != -1) {
+		*needle = automaton->output[hit_state];
+	}
+	return hit_state;
+}
+
+int32_t search_automaton_needlelength(const SearchAutomaton* automaton, int32_t needle) {
+	return automaton->needle_length[needle];
+}
+
+int32_t search_automaton_needlecount(const SearchAutomaton* automaton) {
+	return automaton->needle_count;
+}
+
+int32_t search_automaton_maxlength(const SearchAutomaton* automaton) {
+	return automaton->max_length;
+}
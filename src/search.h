@@ -0,0 +1,23 @@
+
+// Plain (non-pattern) substring search, shared by icu.ustring and icu.utf8.
+
+const char* search_bytes(const char* haystack, size_t haystack_len, const char* needle, size_t needle_len);
+const UChar* search_uchars(const UChar* haystack, int32_t haystack_len, const UChar* needle, int32_t needle_len);
+
+// Aho-Corasick automaton, for finding any of a set of needles in one pass. Needles are added as
+// UTF-8, and the automaton is then stepped through the text a byte at a time. State 0 is the
+// root, and needles are numbered from 0 in the order they were added.
+
+typedef struct SearchAutomaton SearchAutomaton;
+
+SearchAutomaton* search_automaton_new(void);
+void search_automaton_free(SearchAutomaton* automaton);
+int search_automaton_add(SearchAutomaton* automaton, const char* needle, size_t needle_len, int32_t needle_cp_len);
+int search_automaton_build(SearchAutomaton* automaton);
+int32_t search_automaton_step(const SearchAutomaton* automaton, int32_t state, unsigned char c);
+int32_t search_automaton_hitstate(const SearchAutomaton* automaton, int32_t state);
+int32_t search_automaton_needle(const SearchAutomaton* automaton, int32_t hit_state);
+int32_t search_automaton_nexthit(const SearchAutomaton* automaton, int32_t hit_state, int32_t* needle);
+int32_t search_automaton_needlelength(const SearchAutomaton* automaton, int32_t needle);
+int32_t search_automaton_needlecount(const SearchAutomaton* automaton);
+int32_t search_automaton_maxlength(const SearchAutomaton* automaton);